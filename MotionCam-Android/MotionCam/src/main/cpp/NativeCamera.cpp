@@ -21,6 +21,9 @@ using namespace motioncam;
 
 static const jlong INVALID_NATIVE_OBJ = -1;
 
+// Night captures use the sharpest frames around the shutter press
+static const int64_t NIGHT_SELECTION_WINDOW_MS = 500;
+
 namespace {
     std::shared_ptr<NativeRawPreviewListener> gRawPreviewListener = nullptr;
     std::shared_ptr<NativeCameraBridgeListener> gCameraSessionListener = nullptr;
@@ -317,7 +320,11 @@ jboolean JNICALL Java_com_motioncam_camera_NativeCameraSessionBridge_CaptureImag
 
     motioncam::PostProcessSettings settings(json);
 
-    RawBufferManager::get().save(metadata, bufferHandle, saveNumImages, settings, std::string(outputPath));
+    FrameSelection selection;
+    if(settings.captureMode == "NIGHT")
+        selection = FrameSelection(FrameSelectionMode::BEST_QUALITY, NIGHT_SELECTION_WINDOW_MS);
+
+    RawBufferManager::get().save(metadata, bufferHandle, saveNumImages, settings, std::string(outputPath), selection);
 
     return JNI_TRUE;
 }
@@ -334,6 +341,29 @@ jboolean JNICALL Java_com_motioncam_camera_NativeCameraSessionBridge_PauseCaptur
     return JNI_TRUE;
 }
 
+extern "C" JNIEXPORT
+jlong JNICALL Java_com_motioncam_camera_NativeCameraSessionBridge_TrimMemory(JNIEnv *env, jobject thiz, jlong sessionHandle, jlong maxMemoryUsageBytes) {
+    std::shared_ptr<CaptureSessionManager> sessionManager = getCameraSessionManager(sessionHandle);
+    if(!sessionManager) {
+        return 0;
+    }
+
+    return RawBufferManager::get().trimMemory(maxMemoryUsageBytes);
+}
+
+extern "C" JNIEXPORT
+jboolean JNICALL Java_com_motioncam_camera_NativeCameraSessionBridge_SetBufferCompaction(
+        JNIEnv *env, jobject thiz, jlong sessionHandle, jlong minAgeMs, jlong maxCompressedBytes) {
+    std::shared_ptr<CaptureSessionManager> sessionManager = getCameraSessionManager(sessionHandle);
+    if(!sessionManager) {
+        return JNI_FALSE;
+    }
+
+    RawBufferManager::get().setCompaction(minAgeMs, maxCompressedBytes);
+
+    return JNI_TRUE;
+}
+
 extern "C" JNIEXPORT
 jboolean JNICALL Java_com_motioncam_camera_NativeCameraSessionBridge_ResumeCapture(JNIEnv *env, jobject thiz, jlong sessionHandle) {
     std::shared_ptr<CaptureSessionManager> sessionManager = getCameraSessionManager(sessionHandle);
@@ -1,6 +1,8 @@
 #include "NativeClBuffer.h"
 #include "ClHelper.h"
 
+#include <motioncam/Util.h>
+
 #ifdef GPU_CAMERA_PREVIEW
 
 #include <HalideRuntimeOpenCL.h>
@@ -80,8 +82,9 @@ namespace motioncam {
     const std::vector<uint8_t>& NativeClBuffer::hostData() {
         uint8_t* data = lock(false);
 
+        // Only allocated the first time
         mHostBuffer.resize(mBufferLength);
-        mHostBuffer.assign(data, data + mBufferLength);
+        util::fastCopy(mHostBuffer.data(), data, mBufferLength);
 
         unlock();
 
@@ -19,7 +19,10 @@
 #include <motioncam/Measure.h>
 #include <motioncam/Settings.h>
 #include <motioncam/RawBufferManager.h>
+#include <motioncam/RawBufferPool.h>
 #include <motioncam/RawContainer.h>
+#include <motioncam/RawCodec.h>
+#include <motioncam/FrameStats.h>
 #include "motioncam/CameraProfile.h"
 #include "motioncam/Temperature.h"
 #include <motioncam/ImageProcessor.h>
@@ -30,6 +33,9 @@ namespace motioncam {
     static const int COPY_THREADS = 1; // More than one copy thread breaks RAW preview
     static const int MINIMUM_BUFFERS = 16;
     static const int ESTIMATE_SHADOWS_FRAME_INTERVAL = 8;
+    static const int FRAME_COPY_THREADS = 2;
+    static const bool PACK_RAW16 = true;
+    static const int COPY_BAND_ROWS = 64;
 
 #ifdef GPU_CAMERA_PREVIEW
     void VERIFY_RESULT(int32_t errCode, const std::string& errString)
@@ -39,6 +45,67 @@ namespace motioncam {
     }
 #endif
 
+    static PixelFormat getPixelFormat(int32_t format) {
+        switch(format) {
+            default:
+            case AIMAGE_FORMAT_RAW10:
+                return PixelFormat::RAW10;
+
+            case AIMAGE_FORMAT_RAW12:
+                return PixelFormat::RAW12;
+
+            case AIMAGE_FORMAT_RAW16:
+                return PixelFormat::RAW16;
+
+            case AIMAGE_FORMAT_YUV_420_888:
+                return PixelFormat::YUV_420_888;
+        }
+    }
+
+    // Many sensors output RAW16 with a 10 or 12 bit white level. Those frames are packed as they are copied
+    // so each buffer is up to 37.5% smaller.
+    static PixelFormat getStoredPixelFormat(int32_t format, int32_t width, int whiteLevel) {
+        const PixelFormat pixelFormat = getPixelFormat(format);
+
+        if(!PACK_RAW16 || pixelFormat != PixelFormat::RAW16 || whiteLevel <= 0)
+            return pixelFormat;
+
+        if(whiteLevel <= 1023 && width % 4 == 0)
+            return PixelFormat::RAW10;
+        else if(whiteLevel <= 4095 && width % 2 == 0)
+            return PixelFormat::RAW12;
+
+        return pixelFormat;
+    }
+
+    static std::shared_ptr<FrameStatsColorTransform> createStatsColorTransform(
+        const RawCameraMetadata& cameraMetadata, const RawImageMetadata& metadata)
+    {
+        if(metadata.lensShadingMap.size() != 4)
+            return nullptr;
+
+        cv::Mat cameraToPcs;
+        cv::Mat pcsToSrgb;
+        cv::Vec3f cameraWhite;
+
+        ImageProcessor::createSrgbMatrix(cameraMetadata, metadata, metadata.asShot, cameraWhite, cameraToPcs, pcsToSrgb);
+
+        cv::Mat cameraToSrgb = pcsToSrgb * cameraToPcs;
+        cameraToSrgb.convertTo(cameraToSrgb, CV_32F);
+
+        auto colorTransform = std::make_shared<FrameStatsColorTransform>();
+
+        for(int i = 0; i < 9; i++)
+            colorTransform->cameraToSrgb[i] = cameraToSrgb.at<float>(i / 3, i % 3);
+
+        for(int i = 0; i < 3; i++)
+            colorTransform->cameraWhite[i] = cameraWhite[i];
+
+        colorTransform->lensShadingMap = metadata.lensShadingMap;
+
+        return colorTransform;
+    }
+
     //
 
     RawImageConsumer::RawImageConsumer(std::shared_ptr<CameraDescription> cameraDescription, const size_t maxMemoryUsageBytes) :
@@ -51,9 +118,17 @@ namespace motioncam {
         mShadowBoost(0.0f),
         mTempOffset(0.0f),
         mTintOffset(0.0f),
-        mPreviewShadows(0.0f),
-        mPreviewShadowStep(0.0f),
-        mCameraDesc(std::move(cameraDescription))
+        mContrast(PostProcessSettings().contrast),
+        mSaturation(PostProcessSettings().saturation),
+        mBlacks(PostProcessSettings().blacks),
+        mWhitePoint(PostProcessSettings().whitePoint),
+        mEstimatedSettings(std::make_shared<PostProcessSettings>()),
+        mFrameCopyGeneration(0),
+        mFrameCopyPending(0),
+        mFrameCopyHelpers(0),
+        mStopFrameCopy(false),
+        mCameraDesc(std::move(cameraDescription)),
+        mFramesSinceEstimatedSettings(0)
     {
     }
 
@@ -72,10 +147,20 @@ namespace motioncam {
 
         mRunning = true;
 
+        // Start the frame copy threads before anything can copy a frame. The consumer thread copies the first band.
+        mStopFrameCopy = false;
+        mFrameCopyGeneration = 0;
+
+        for(int i = 1; i < FRAME_COPY_THREADS; i++) {
+            mFrameCopyThreads.push_back(std::make_shared<std::thread>(&RawImageConsumer::doFrameCopy, this, i));
+        }
+
         // Start consumer threads
         for(int i = 0; i < COPY_THREADS; i++) {
             mConsumerThreads.push_back(std::make_shared<std::thread>(&RawImageConsumer::doCopyImage, this));
         }
+
+        mEstimateSettingsThread = std::make_shared<std::thread>(&RawImageConsumer::doEstimateSettings, this);
     }
 
     void RawImageConsumer::stop() {
@@ -93,6 +178,148 @@ namespace motioncam {
         }
 
         mConsumerThreads.clear();
+
+        // Wake up the estimator so it can exit
+        {
+            std::lock_guard<std::mutex> lock(mEstimateLock);
+            mEstimateFrame = nullptr;
+        }
+
+        mEstimateCondition.notify_one();
+
+        mEstimateSettingsThread->join();
+        mEstimateSettingsThread = nullptr;
+
+        // Consumer threads are gone so there are no frames being copied
+        {
+            std::lock_guard<std::mutex> lock(mFrameCopyLock);
+            mStopFrameCopy = true;
+        }
+
+        mFrameCopyCondition.notify_all();
+
+        for(auto& frameCopyThread : mFrameCopyThreads) {
+            frameCopyThread->join();
+        }
+
+        mFrameCopyThreads.clear();
+    }
+
+    void RawImageConsumer::doFrameCopy(int band) {
+        int64_t generation = 0;
+
+        std::unique_lock<std::mutex> lock(mFrameCopyLock);
+
+        while(true) {
+            mFrameCopyCondition.wait(lock, [&] { return mStopFrameCopy || mFrameCopyGeneration != generation; });
+
+            if(mStopFrameCopy)
+                break;
+
+            generation = mFrameCopyGeneration;
+
+            // Not needed for this frame, the band doesn't exist or the copying thread takes it
+            if(band > mFrameCopyHelpers)
+                continue;
+
+            auto job = mFrameCopyJob;
+
+            lock.unlock();
+
+            job(band);
+
+            lock.lock();
+
+            if(--mFrameCopyPending == 0)
+                mFrameCopyDoneCondition.notify_one();
+        }
+    }
+
+    // Copies, or packs, the frame in bands of rows and measures the sampled rows of each band while they are
+    // still in the cache. Each accumulator gets its own band. The first band is copied on the calling thread
+    // and the rest are handed to the frame copy threads. Only the consumer thread copies frames.
+    void RawImageConsumer::copyFrame(const uint8_t* src,
+                                     const int srcRowStride,
+                                     const size_t srcLength,
+                                     const bool pack,
+                                     const RawImageBuffer& dst,
+                                     uint8_t* dstData,
+                                     std::vector<FrameStatsAccumulator>& stats)
+    {
+        const int height = dst.height;
+
+        auto copyRows = [&](const int start, const int end, FrameStatsAccumulator& accumulator) {
+            for(int bandStart = start; bandStart < end; bandStart += COPY_BAND_ROWS) {
+                const int bandEnd = std::min(end, bandStart + COPY_BAND_ROWS);
+
+                if(pack) {
+                    for(int y = bandStart; y < bandEnd; y++) {
+                        codec::packRow(
+                            reinterpret_cast<const uint16_t*>(src + static_cast<size_t>(y) * srcRowStride),
+                            dst.pixelFormat,
+                            dst.width,
+                            dstData + static_cast<size_t>(y) * dst.rowStride);
+                    }
+                }
+                else {
+                    const size_t offset = static_cast<size_t>(bandStart) * srcRowStride;
+                    if(offset >= srcLength)
+                        break;
+
+                    // The last row may not be padded to the full stride
+                    size_t len = srcLength - offset;
+                    if(bandEnd < height)
+                        len = std::min(len, static_cast<size_t>(bandEnd - bandStart) * srcRowStride);
+
+                    util::fastCopy(dstData + offset, src + offset, len);
+                }
+
+                for(int y = bandStart; y + 1 < bandEnd; y += 2) {
+                    if(accumulator.isSampled(y)) {
+                        accumulator.add(y,
+                                        src + static_cast<size_t>(y) * srcRowStride,
+                                        src + static_cast<size_t>(y + 1) * srcRowStride);
+                    }
+                }
+            }
+        };
+
+        const int numBands = static_cast<int>(stats.size());
+        const int rowsPerBand = ((height + numBands - 1) / numBands + 1) & ~1;
+
+        auto copyBand = [&](const int band) {
+            const int start = std::min(height, band * rowsPerBand);
+            const int end = std::min(height, (band + 1) * rowsPerBand);
+
+            copyRows(start, end, stats[band]);
+        };
+
+        const int numHelpers = std::min(numBands - 1, static_cast<int>(mFrameCopyThreads.size()));
+
+        if(numHelpers > 0) {
+            std::lock_guard<std::mutex> lock(mFrameCopyLock);
+
+            mFrameCopyJob = copyBand;
+            mFrameCopyHelpers = numHelpers;
+            mFrameCopyPending = numHelpers;
+            ++mFrameCopyGeneration;
+        }
+
+        if(numHelpers > 0)
+            mFrameCopyCondition.notify_all();
+
+        copyBand(0);
+
+        // Copy anything there isn't a thread for ourselves
+        for(int band = numHelpers + 1; band < numBands; band++)
+            copyBand(band);
+
+        if(numHelpers > 0) {
+            std::unique_lock<std::mutex> lock(mFrameCopyLock);
+
+            mFrameCopyDoneCondition.wait(lock, [&] { return mFrameCopyPending == 0; });
+            mFrameCopyJob = nullptr;
+        }
     }
 
     void RawImageConsumer::queueImage(AImage* image) {
@@ -253,35 +480,67 @@ namespace motioncam {
     }
 
     void RawImageConsumer::onBufferReady(const std::shared_ptr<RawImageBuffer>& buffer) {
-        // Estimate settings every few frames
-        if(mFramesSinceEstimatedSettings >= ESTIMATE_SHADOWS_FRAME_INTERVAL)
+        RawBufferManager::get().enqueueReadyBuffer(buffer);
+    }
+
+    void RawImageConsumer::postEstimateSettings(const RawImageBuffer& buffer) {
+        // Only the metadata is needed, the buffer itself goes back to the ring buffer
+        auto frame = std::make_unique<RawImageBuffer>(std::make_unique<NativeHostBuffer>());
+
+        frame->metadata     = buffer.metadata;
+        frame->pixelFormat  = buffer.pixelFormat;
+        frame->width        = buffer.width;
+        frame->height       = buffer.height;
+        frame->rowStride    = buffer.rowStride;
+
         {
-            // Keep previous value
-            mPreviewShadows = mEstimatedSettings.shadows;
+            std::lock_guard<std::mutex> lock(mEstimateLock);
+            mEstimateFrame = std::move(frame);
+        }
 
-            motioncam::ImageProcessor::estimateBasicSettings(*buffer, mCameraDesc->metadata, mEstimatedSettings);
+        mEstimateCondition.notify_one();
+    }
+
+    void RawImageConsumer::doEstimateSettings() {
+        PostProcessSettings settings;
+
+        while(true) {
+            std::unique_ptr<RawImageBuffer> frame;
+
+            {
+                std::unique_lock<std::mutex> lock(mEstimateLock);
+                mEstimateCondition.wait(lock, [this] { return !mRunning || mEstimateFrame; });
+
+                if(!mRunning)
+                    break;
+
+                frame = std::move(mEstimateFrame);
+            }
+
+            // Update the colour transform used to measure the next frames
+            auto colorTransform = createStatsColorTransform(mCameraDesc->metadata, frame->metadata);
+            if(colorTransform)
+                std::atomic_store(&mStatsColorTransform, std::shared_ptr<const FrameStatsColorTransform>(colorTransform));
+
+            // Need the histogram measured when the frame was copied, there is no image data here
+            if(!frame->metadata.stats.valid || frame->metadata.stats.histogram.empty())
+                continue;
+
+            motioncam::ImageProcessor::estimateBasicSettings(*frame, mCameraDesc->metadata, settings);
 
             // Update shadows to include user selected boost
-            float userShadows = std::pow(2.0f, std::log(mEstimatedSettings.shadows) / std::log(2.0f) + mShadowBoost);
-            mEstimatedSettings.shadows = std::max(1.0f, std::min(32.0f, userShadows));
+            float userShadows = std::pow(2.0f, std::log(settings.shadows) / std::log(2.0f) + mShadowBoost);
+            settings.shadows = std::max(1.0f, std::min(32.0f, userShadows));
 
             // Store noise profile
-            if(!buffer->metadata.noiseProfile.empty()) {
-                mEstimatedSettings.noiseSigma = 1024 * sqrt(0.18 * buffer->metadata.noiseProfile[0] + buffer->metadata.noiseProfile[1]);
+            if(!frame->metadata.noiseProfile.empty()) {
+                settings.noiseSigma = 1024 * sqrt(0.18 * frame->metadata.noiseProfile[0] + frame->metadata.noiseProfile[1]);
             }
 
-            mPreviewShadowStep = (1.0f / ESTIMATE_SHADOWS_FRAME_INTERVAL) * (mEstimatedSettings.shadows - mPreviewShadows);
-            mFramesSinceEstimatedSettings = 0;
-        }
-        else {
-            ++mFramesSinceEstimatedSettings;
-
-            // Interpolate shadows to make transition smoother
-            mPreviewShadows += mPreviewShadowStep;
+            std::atomic_store(&mEstimatedSettings, std::shared_ptr<const PostProcessSettings>(std::make_shared<PostProcessSettings>(settings)));
         }
 
-        RawBufferManager::get().enqueueReadyBuffer(buffer);
-
+        LOGD("Exiting estimate settings thread");
     }
 
     void RawImageConsumer::doMatchMetadata() {
@@ -298,8 +557,23 @@ namespace motioncam {
 
             // Found a match, set it to the image and remove from pending list
             if(pendingBufferIt != mPendingBuffers.end()) {
-                // Update the metadata of the image
+                // Update the metadata of the image, keeping the stats measured when it was copied
+                FrameStats stats = std::move(pendingBufferIt->second->metadata.stats);
+
                 pendingBufferIt->second->metadata = metadata;
+                pendingBufferIt->second->metadata.stats = std::move(stats);
+
+                // Hand the frame to the estimator every few frames
+                if(!std::atomic_load(&mStatsColorTransform) || mFramesSinceEstimatedSettings >= ESTIMATE_SHADOWS_FRAME_INTERVAL) {
+                    postEstimateSettings(*pendingBufferIt->second);
+                    mFramesSinceEstimatedSettings = 0;
+                }
+                else {
+                    ++mFramesSinceEstimatedSettings;
+                }
+
+                // Score the frame so the best ones are kept
+                mFrameScorer.score(*pendingBufferIt->second);
 
                 // Return buffer to either preprocess queue or normal queue if raw preview is not enabled
                 if( mEnableRawPreview &&
@@ -331,7 +605,7 @@ namespace motioncam {
     }
 
     void RawImageConsumer::doSetupBuffers(size_t bufferLength) {
-        int memoryUseBytes = RawBufferManager::get().memoryUseBytes();
+        int64_t memoryUseBytes = RawBufferManager::get().memoryUseBytes();
 
         LOGI("Setting up buffers");
 
@@ -344,25 +618,49 @@ namespace motioncam {
             // Use relaxed math
             halide_opencl_set_build_options("-cl-fast-relaxed-math");
         }
+#else
+        // Reserve memory for all the buffers up front. The buffers hold on to the pool.
+        std::shared_ptr<RawBufferPool> bufferPool;
+
+        try {
+            const int64_t budgetBytes = std::max<int64_t>(
+                mMaximumMemoryUsageBytes, static_cast<int64_t>(bufferLength) * MINIMUM_BUFFERS);
+
+            bufferPool = RawBufferPool::create(bufferLength, budgetBytes);
+        }
+        catch(std::exception& e) {
+            LOGW("Failed to create buffer pool (%s)", e.what());
+        }
+
+        RawBufferManager::get().setBufferPool(bufferPool);
 #endif
 
         while(  mRunning
                 &&  ( memoryUseBytes + bufferLength < mMaximumMemoryUsageBytes
                     || RawBufferManager::get().numBuffers() < MINIMUM_BUFFERS) )
         {
-            std::shared_ptr<RawImageBuffer> buffer;
+            std::unique_ptr<NativeBuffer> data;
 
 #ifdef GPU_CAMERA_PREVIEW
-            buffer = std::make_shared<RawImageBuffer>(std::make_unique<NativeClBuffer>(bufferLength));
+            data = std::make_unique<NativeClBuffer>(bufferLength);
 #else
-            buffer = std::make_shared<RawImageBuffer>(std::make_unique<NativeHostBuffer>(bufferLength));
+            if(bufferPool) {
+                data = bufferPool->allocate();
+                if(!data)
+                    break;
+            }
+            else {
+                data = std::make_unique<NativeHostBuffer>(bufferLength);
+            }
 #endif
 
+            auto buffer = std::make_shared<RawImageBuffer>(std::move(data));
+
             RawBufferManager::get().addBuffer(buffer);
 
             memoryUseBytes = RawBufferManager::get().memoryUseBytes();
 
-            LOGI("Memory use: %d, max: %zu", memoryUseBytes, mMaximumMemoryUsageBytes);
+            LOGI("Memory use: %lld, max: %zu", static_cast<long long>(memoryUseBytes), mMaximumMemoryUsageBytes);
         }
 
         LOGD("Finished setting up %d buffers", RawBufferManager::get().numBuffers());
@@ -457,6 +755,11 @@ namespace motioncam {
 
         cl_int errCode = -1;
 
+        std::shared_ptr<const PostProcessSettings> estimatedSettings;
+        float previewShadows = 0.0f;
+        float previewShadowStep = 0.0f;
+        int previewShadowSteps = 0;
+
         bool outputCreated = false;
         int downscaleFactor = mRawPreviewQuality;
         int processedFrames = 0;
@@ -474,6 +777,24 @@ namespace motioncam {
 
             Halide::Runtime::Buffer<uint8_t> inputBuffer = wrapCameraPreviewInputBuffer(*buffer);
 
+            // Interpolate shadows towards the latest estimate to make transition smoother
+            auto latestSettings = std::atomic_load(&mEstimatedSettings);
+
+            if(latestSettings != estimatedSettings) {
+                if(!estimatedSettings)
+                    previewShadows = latestSettings->shadows;
+
+                previewShadowStep = (1.0f / ESTIMATE_SHADOWS_FRAME_INTERVAL) * (latestSettings->shadows - previewShadows);
+                previewShadowSteps = ESTIMATE_SHADOWS_FRAME_INTERVAL;
+
+                estimatedSettings = std::move(latestSettings);
+            }
+
+            if(previewShadowSteps > 0) {
+                previewShadows += previewShadowStep;
+                --previewShadowSteps;
+            }
+
             previewTimestamp = std::chrono::steady_clock::now();
 
             motioncam::CameraPreview::generate(
@@ -481,11 +802,11 @@ namespace motioncam {
                     mCameraDesc->metadata,
                     downscaleFactor,
                     mCameraDesc->lensFacing == ACAMERA_LENS_FACING_FRONT,
-                    mPreviewShadows,
-                    mEstimatedSettings.contrast,
-                    mEstimatedSettings.saturation,
-                    mEstimatedSettings.blacks,
-                    mEstimatedSettings.whitePoint,
+                    previewShadows,
+                    mContrast,
+                    mSaturation,
+                    mBlacks,
+                    mWhitePoint,
                     mTempOffset,
                     mTintOffset,
                     0.25f,
@@ -555,24 +876,38 @@ namespace motioncam {
         mPreviewListener  = std::move(listener);
         mEnableRawPreview = true;
         mRawPreviewQuality = previewQuality;
+
+        PostProcessSettings settings;
+
+        mContrast = settings.contrast;
+        mSaturation = settings.saturation;
+        mBlacks = settings.blacks;
+        mWhitePoint = settings.whitePoint;
+
+        std::atomic_store(&mEstimatedSettings, std::shared_ptr<const PostProcessSettings>(std::make_shared<PostProcessSettings>(settings)));
+
         mPreprocessThread = std::make_shared<std::thread>(&RawImageConsumer::doPreprocess, this);
-        mEstimatedSettings = PostProcessSettings();
     }
 
     void RawImageConsumer::updateRawPreviewSettings(
             float shadowBoost, float contrast, float saturation, float blacks, float whitePoint, float tempOffset, float tintOffset)
     {
         mShadowBoost = shadowBoost;
-        mEstimatedSettings.contrast = contrast;
-        mEstimatedSettings.saturation = saturation;
-        mEstimatedSettings.blacks = blacks;
-        mEstimatedSettings.whitePoint = whitePoint;
+        mContrast = contrast;
+        mSaturation = saturation;
+        mBlacks = blacks;
+        mWhitePoint = whitePoint;
         mTempOffset = tempOffset;
         mTintOffset = tintOffset;
     }
 
     void RawImageConsumer::getEstimatedSettings(PostProcessSettings& outSettings) {
-        outSettings = mEstimatedSettings;
+        outSettings = *std::atomic_load(&mEstimatedSettings);
+
+        outSettings.contrast = mContrast;
+        outSettings.saturation = mSaturation;
+        outSettings.blacks = mBlacks;
+        outSettings.whitePoint = mWhitePoint;
     }
 
     void RawImageConsumer::disableRawPreview() {
@@ -612,14 +947,30 @@ namespace motioncam {
             // Lock and get an image out
             if(!mSetupBuffersThread) {
                 int length = 0;
+                int32_t format = 0;
+                int32_t width = 0;
+                int32_t height = 0;
                 uint8_t* data = nullptr;
 
                 // Get size of buffer
-                if(AImage_getPlaneData(pendingImage.get(), 0, &data, &length) != AMEDIA_OK) {
+                if(AImage_getPlaneData(pendingImage.get(), 0, &data, &length) != AMEDIA_OK
+                   || AImage_getFormat(pendingImage.get(), &format) != AMEDIA_OK
+                   || AImage_getWidth(pendingImage.get(), &width) != AMEDIA_OK
+                   || AImage_getHeight(pendingImage.get(), &height) != AMEDIA_OK)
+                {
                     LOGE("Failed to get size of camera buffer!");
                 }
                 else {
-                    mSetupBuffersThread = std::make_shared<std::thread>(&RawImageConsumer::doSetupBuffers, this, static_cast<size_t>(length));
+                    size_t bufferLength = static_cast<size_t>(length);
+
+                    const PixelFormat storedFormat = getStoredPixelFormat(format, width, mCameraDesc->metadata.whiteLevel);
+                    if(storedFormat != getPixelFormat(format)) {
+                        bufferLength = codec::rowLength(storedFormat, width) * height;
+
+                        LOGI("Packing RAW16 frames to %s", storedFormat == PixelFormat::RAW10 ? "RAW10" : "RAW12");
+                    }
+
+                    mSetupBuffersThread = std::make_shared<std::thread>(&RawImageConsumer::doSetupBuffers, this, bufferLength);
                 }
 
                 // Give the buffers thread a chance to create some buffers before we try to get one below.
@@ -639,6 +990,7 @@ namespace motioncam {
             dst->height    = 0;
             dst->rowStride = 0;
             dst->metadata.timestampNs = 0;
+            dst->metadata.stats = FrameStats();
 
             //
             // Copy buffer
@@ -665,38 +1017,41 @@ namespace motioncam {
 
             // Copy raw data if were able to acquire it successfully
             if(result) {
-                switch(format) {
-                    default:
-                    case AIMAGE_FORMAT_RAW10:
-                        dst->pixelFormat = PixelFormat::RAW10;
-                        break;
-
-                    case AIMAGE_FORMAT_RAW12:
-                        dst->pixelFormat = PixelFormat::RAW12;
-                        break;
-
-                    case AIMAGE_FORMAT_RAW16:
-                        dst->pixelFormat = PixelFormat::RAW16;
-                        break;
-
-                    case AIMAGE_FORMAT_YUV_420_888:
-                        dst->pixelFormat = PixelFormat::YUV_420_888;
-                        break;
-                }
+                const PixelFormat srcFormat = getPixelFormat(format);
 
+                dst->pixelFormat            = getStoredPixelFormat(format, width, mCameraDesc->metadata.whiteLevel);
                 dst->width                  = width;
                 dst->height                 = height;
                 dst->rowStride              = rowStride;
                 dst->metadata.timestampNs   = timestamp;
 
-                if(dst->data->len() != length) {
+                size_t dstLength = static_cast<size_t>(length);
+                const bool pack = dst->pixelFormat != srcFormat;
+
+                if(pack) {
+                    dst->rowStride = static_cast<int>(codec::rowLength(dst->pixelFormat, width));
+                    dstLength = static_cast<size_t>(dst->rowStride) * height;
+                }
+
+                if(dst->data->len() != dstLength) {
                     LOGE("Unexpected buffer size!!");
                 }
                 else {
                     auto dstBuffer = dst->data->lock(true);
 
-                    if(dstBuffer)
-                        std::copy(data, data + length, dstBuffer);
+                    if(dstBuffer) {
+                        std::vector<FrameStatsAccumulator> stats(
+                            FRAME_COPY_THREADS,
+                            FrameStatsAccumulator(
+                                mCameraDesc->metadata, srcFormat, width, height, std::atomic_load(&mStatsColorTransform)));
+
+                        copyFrame(data, rowStride, static_cast<size_t>(length), pack, *dst, dstBuffer, stats);
+
+                        for(size_t i = 1; i < stats.size(); i++)
+                            stats[0].merge(stats[i]);
+
+                        stats[0].finish(dst->metadata.stats);
+                    }
 
                     dst->data->unlock();
                 }
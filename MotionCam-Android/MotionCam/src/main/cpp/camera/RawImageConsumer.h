@@ -4,11 +4,16 @@
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <map>
 #include <string>
 #include <chrono>
+#include <functional>
 
 #include <motioncam/RawImageMetadata.h>
+#include <motioncam/FrameScorer.h>
+#include <motioncam/FrameStats.h>
 
 #ifdef GPU_CAMERA_PREVIEW
     #include <HalideBuffer.h>
@@ -49,11 +54,22 @@ namespace motioncam {
     private:
         bool copyMetadata(RawImageMetadata& dst, const ACameraMetadata* src);
         void onBufferReady(const std::shared_ptr<RawImageBuffer>& buffer);
+        void postEstimateSettings(const RawImageBuffer& buffer);
 
         void doSetupBuffers(size_t bufferLength);
         void doCopyImage();
         void doMatchMetadata();
         void doPreprocess();
+        void doEstimateSettings();
+        void doFrameCopy(int band);
+
+        void copyFrame(const uint8_t* src,
+                       const int srcRowStride,
+                       const size_t srcLength,
+                       const bool pack,
+                       const RawImageBuffer& dst,
+                       uint8_t* dstData,
+                       std::vector<FrameStatsAccumulator>& stats);
 
 #ifdef GPU_CAMERA_PREVIEW
         static Halide::Runtime::Buffer<uint8_t> createCameraPreviewOutputBuffer(const RawImageBuffer& buffer, const int downscaleFactor);
@@ -68,6 +84,7 @@ namespace motioncam {
         std::vector<std::shared_ptr<std::thread>> mConsumerThreads;
         std::shared_ptr<std::thread> mSetupBuffersThread;
         std::shared_ptr<std::thread> mPreprocessThread;
+        std::shared_ptr<std::thread> mEstimateSettingsThread;
         std::atomic<bool> mRunning;
         std::atomic<bool> mEnableRawPreview;
         std::atomic<bool> mOverrideWhiteBalance;
@@ -75,14 +92,36 @@ namespace motioncam {
         std::atomic<float> mShadowBoost;
         std::atomic<float> mTempOffset;
         std::atomic<float> mTintOffset;
-        PostProcessSettings mEstimatedSettings;
-        float mPreviewShadows;
-        float mPreviewShadowStep;
+        std::atomic<float> mContrast;
+        std::atomic<float> mSaturation;
+        std::atomic<float> mBlacks;
+        std::atomic<float> mWhitePoint;
+
+        // Published by the estimator thread with std::atomic_store()
+        std::shared_ptr<const PostProcessSettings> mEstimatedSettings;
+        std::shared_ptr<const FrameStatsColorTransform> mStatsColorTransform;
+
+        // Latest frame waiting for the estimator, older ones are dropped. Holds the metadata only.
+        std::mutex mEstimateLock;
+        std::condition_variable mEstimateCondition;
+        std::unique_ptr<RawImageBuffer> mEstimateFrame;
+
+        // Threads that copy the other bands of a frame while the consumer thread copies the first
+        std::vector<std::shared_ptr<std::thread>> mFrameCopyThreads;
+        std::mutex mFrameCopyLock;
+        std::condition_variable mFrameCopyCondition;
+        std::condition_variable mFrameCopyDoneCondition;
+        std::function<void (int)> mFrameCopyJob;
+        int64_t mFrameCopyGeneration;
+        int mFrameCopyPending;
+        int mFrameCopyHelpers;
+        bool mStopFrameCopy;
 
         std::shared_ptr<CameraDescription> mCameraDesc;
         int mRawPreviewQuality;
         bool mCopyCaptureColorTransform;
         int mFramesSinceEstimatedSettings;
+        FrameScorer mFrameScorer;
 
         moodycamel::BlockingConcurrentQueue<std::shared_ptr<AImage>> mImageQueue;
         moodycamel::ConcurrentQueue<RawImageMetadata> mPendingMetadata;
@@ -1,6 +1,7 @@
 package com.motioncam;
 
 import android.Manifest;
+import android.content.ComponentCallbacks2;
 import android.content.Context;
 import android.content.Intent;
 import android.content.SharedPreferences;
@@ -576,6 +577,28 @@ public class CameraActivity extends AppCompatActivity implements
         mFusedLocationClient.removeLocationUpdates(mLocationCallback);
     }
 
+    @Override
+    public void onTrimMemory(int level) {
+        super.onTrimMemory(level);
+
+        if(mNativeCamera == null)
+            return;
+
+        // Give back some of the capture buffers while the system is low on memory
+        long maxMemoryUsageBytes;
+
+        if(level == ComponentCallbacks2.TRIM_MEMORY_RUNNING_CRITICAL)
+            maxMemoryUsageBytes = mSettings.memoryUseBytes / 4;
+        else if(level == ComponentCallbacks2.TRIM_MEMORY_RUNNING_LOW)
+            maxMemoryUsageBytes = mSettings.memoryUseBytes / 2;
+        else
+            return;
+
+        long freedBytes = mNativeCamera.trimMemory(maxMemoryUsageBytes);
+
+        Log.i(TAG, "Trimmed " + freedBytes + " bytes of capture buffers (level=" + level + ")");
+    }
+
     @Override
     protected void onDestroy() {
         super.onDestroy();
@@ -282,6 +282,18 @@ public class NativeCameraSessionBridge implements NativeCameraSessionListener, N
         return GetAvailableImages(mNativeCameraHandle);
     }
 
+    public long trimMemory(long maxMemoryUsageBytes) {
+        ensureValidHandle();
+
+        return TrimMemory(mNativeCameraHandle, maxMemoryUsageBytes);
+    }
+
+    public void setBufferCompaction(long minAgeMs, long maxCompressedBytes) {
+        ensureValidHandle();
+
+        SetBufferCompaction(mNativeCameraHandle, minAgeMs, maxCompressedBytes);
+    }
+
     public PostProcessSettings estimatePostProcessSettings(boolean basicSettings, float shadowsBias) throws IOException {
         ensureValidHandle();
 
@@ -433,6 +445,8 @@ public class NativeCameraSessionBridge implements NativeCameraSessionListener, N
 
     private native boolean PauseCapture(long handle);
     private native boolean ResumeCapture(long handle);
+    private native long TrimMemory(long handle, long maxMemoryUsageBytes);
+    private native boolean SetBufferCompaction(long handle, long minAgeMs, long maxCompressedBytes);
 
     private native boolean SetManualExposure(long handle, int iso, long exposureTime);
     private native boolean SetAutoExposure(long handle);
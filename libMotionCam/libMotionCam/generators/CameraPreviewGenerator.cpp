@@ -471,6 +471,20 @@ void CameraPreviewGenerator::generate() {
 
         rawInput(v_x, v_y, v_c) = mux(v_c, { C_RAW16[0], C_RAW16[1], C_RAW16[2], C_RAW16[3] } );   
     }
+    else if(pixel_format == static_cast<int>(RawFormat::RAW12)) {
+        Expr C_RAW12[4];
+
+        // RAW12
+        Expr Xc = (v_y<<1) * stride + v_x * 3;
+        Expr Yc = ((v_y<<1) + 1) * stride + v_x * 3;
+
+        C_RAW12[0] = (inputRepeated(Xc)     << 4) | (inputRepeated(Xc + 2) & 0x0F);
+        C_RAW12[1] = (inputRepeated(Xc + 1) << 4) | (inputRepeated(Xc + 2) & 0xF0) >> 4;
+        C_RAW12[2] = (inputRepeated(Yc)     << 4) | (inputRepeated(Yc + 2) & 0x0F);
+        C_RAW12[3] = (inputRepeated(Yc + 1) << 4) | (inputRepeated(Yc + 2) & 0xF0) >> 4;
+
+        rawInput(v_x, v_y, v_c) = mux(v_c, { C_RAW12[0], C_RAW12[1], C_RAW12[2], C_RAW12[3] } );
+    }
     else {
         throw std::runtime_error("invalid pixel format");
     }
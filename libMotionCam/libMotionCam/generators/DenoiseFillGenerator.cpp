@@ -9,23 +9,29 @@ using std::function;
 
 class DenoiseFillGenerator : public Halide::Generator<DenoiseFillGenerator> {
 public:
-    Input<int> blackLevel{"blackLevel"};
+    // Sum of the fused frames (float32) or a single frame (uint16)
+    Input<Buffer<>> input{"input", 3};
+    Input<Buffer<float>> blackLevel{"blackLevel", 1};
     Input<int> whiteLevel{"whiteLevel"};
-    Input<uint8_t> numOfFrames{"numOfFrames"};
-    Input<Buffer<float>> input{"input", 3};
-    Output<Func> output{"output", 3};
-    Var x, y, c; 
+    Input<float> numOfFrames{"numOfFrames"};
+    Output<Buffer<uint16_t>> output{"output", 3};
+    Var x, y, c;
 
     Var v0_vi{"v0_vi"};
     Var v0_vo{"v0_vo"};
-    
+    Var v1_vi{"v1_vi"};
+    Var v1_vo{"v1_vo"};
+
     void generate() {
         int EXPANDED_RANGE = 16384;
-        Expr p = (input(x, y, c) / numOfFrames) - blackLevel;
-        Expr s = EXPANDED_RANGE / cast<float> (whiteLevel-blackLevel);
-        output(x, y, c) = cast<uint16_t>(max(0.0f, min(p * s + 0.5f, cast<float> (EXPANDED_RANGE)) ) );
+        Expr p = (cast<float>(input(x, y, c)) / numOfFrames) - blackLevel(c);
+        Expr s = EXPANDED_RANGE / (cast<float>(whiteLevel) - blackLevel(c));
+        output(x, y, c) = cast<uint16_t>(max(0.0f, min(p * s, cast<float> (EXPANDED_RANGE)) ) );
 
         input.set_estimates({{0, 2000}, {0, 1500}, {0, 4}});
+        blackLevel.set_estimates({{0, 4}});
+        whiteLevel.set_estimate(1023);
+        numOfFrames.set_estimate(8);
         output.set_estimates({{0, 2000}, {0, 1500}, {0, 4}});
 
         Var v0 = output.args()[0];
@@ -33,12 +39,13 @@ public:
         Var v2 = output.args()[2];
         output
             .compute_root()
+            .bound(v2, 0, 4)
             .split(v0, v0_vo, v0_vi, 8)
             .vectorize(v0_vi)
+            .split(v1, v1_vo, v1_vi, 32)
             .parallel(v2)
-            .parallel(v1);
+            .parallel(v1_vo);
     }
 };
 
 HALIDE_REGISTER_GENERATOR(DenoiseFillGenerator, denoise_fill_generator)
-
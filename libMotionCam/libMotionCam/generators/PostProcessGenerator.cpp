@@ -46,6 +46,7 @@ protected:
 private:
     Func deinterleaveRaw16(Func in, int c, Expr stride);
     Func deinterleaveRaw10(Func in, int c, Expr stride);
+    Func deinterleaveRaw12(Func in, int c, Expr stride);
 
 protected:
     Var v_i{"i"};
@@ -71,6 +72,7 @@ void PostProcessBase::deinterleave(Func& result, Func in, int c, Expr stride, Ex
     result(v_x, v_y) =
         select( rawFormat == static_cast<int>(RawFormat::RAW10), cast<uint16_t>(deinterleaveRaw10(in, c, stride)(v_x, v_y)),
                 rawFormat == static_cast<int>(RawFormat::RAW16), cast<uint16_t>(deinterleaveRaw16(in, c, stride)(v_x, v_y)),
+                rawFormat == static_cast<int>(RawFormat::RAW12), cast<uint16_t>(deinterleaveRaw12(in, c, stride)(v_x, v_y)),
                 0);
 }
 
@@ -149,6 +151,38 @@ Func PostProcessBase::deinterleaveRaw10(Func in, int c, Expr stride) {
     return result;
 }
 
+Func PostProcessBase::deinterleaveRaw12(Func in, int c, Expr stride) {
+    Func result("deinterleaveRaw12Result");
+
+    // Two pixels in three bytes, the upper 8 bits of each pixel followed by the lower 4 bits of both
+    Expr X = (v_y<<1) * stride + v_x * 3;
+    Expr Y = ((v_y<<1) + 1) * stride + v_x * 3;
+
+    switch(c)
+    {
+        case 0:
+            result(v_x, v_y) = (cast<uint16_t>(in(X))     << 4) | (cast<uint16_t>(in(X + 2)) & 0x0F);
+            break;
+
+        case 1:
+            result(v_x, v_y) = (cast<uint16_t>(in(X + 1)) << 4) | (cast<uint16_t>(in(X + 2)) & 0xF0) >> 4;
+            break;
+
+        case 2:
+            result(v_x, v_y) = (cast<uint16_t>(in(Y))     << 4) | (cast<uint16_t>(in(Y + 2)) & 0x0F);
+            break;
+
+        case 3:
+            result(v_x, v_y) = (cast<uint16_t>(in(Y + 1)) << 4) | (cast<uint16_t>(in(Y + 2)) & 0xF0) >> 4;
+            break;
+
+        default:
+            throw std::runtime_error("invalid channel");
+    }
+
+    return result;
+}
+
 
 void PostProcessBase::blur(Func& output, Func& outputTmp, Func input) {
     Func in32{"blur_in32"};
@@ -41,7 +41,10 @@ function build_denoise() {
 	./tmp/denoise_generator -g inverse_transform_generator -f inverse_transform -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} input.size=6
 
 	echo "[$ARCH] Building denoise_fill_generator"
-	./tmp/denoise_fill_generator -g denoise_fill_generator -f fill_denoise -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS}
+	./tmp/denoise_fill_generator -g denoise_fill_generator -f fill_denoise -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} input.type=float32
+
+	echo "[$ARCH] Building denoise_fill_generator raw"
+	./tmp/denoise_fill_generator -g denoise_fill_generator -f fill_denoise_raw -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} input.type=uint16
 }
 
 function build_postprocess() {
@@ -129,6 +132,16 @@ function build_camera_preview() {
 
 	echo "[$ARCH] Building camera_preview_generator4_raw16"
 	./tmp/camera_preview_generator -g camera_preview_generator -f camera_preview4_raw16 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} tonemap_levels=7 downscale_factor=4 pixel_format=1
+
+	# RAW12
+	echo "[$ARCH] Building camera_preview_generator2_raw12"
+	./tmp/camera_preview_generator -g camera_preview_generator -f camera_preview2_raw12 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} tonemap_levels=9 downscale_factor=2 pixel_format=2
+
+	echo "[$ARCH] Building camera_preview_generator3_raw12"
+	./tmp/camera_preview_generator -g camera_preview_generator -f camera_preview3_raw12 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} tonemap_levels=8 downscale_factor=3 pixel_format=2
+
+	echo "[$ARCH] Building camera_preview_generator4_raw12"
+	./tmp/camera_preview_generator -g camera_preview_generator -f camera_preview4_raw12 -e static_library,h -o ../halide/${ARCH} target=${TARGET}-${FLAGS} tonemap_levels=7 downscale_factor=4 pixel_format=2
 }
 
 function build_runtime() {
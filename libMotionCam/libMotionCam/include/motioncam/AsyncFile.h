@@ -0,0 +1,84 @@
+#ifndef AsyncFile_hpp
+#define AsyncFile_hpp
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+namespace motioncam {
+    namespace util {
+
+        //
+        // Output file that is written on a background thread. Writes are gathered into large chunks
+        // which are handed to the writer thread, so the caller only pays for a copy. If the caller gets
+        // too far ahead it waits for the oldest chunk to be written. A write error is thrown from the
+        // next call after it happens. Nothing is guaranteed to be on disk until close() returns.
+        //
+
+        class AsyncFile {
+        public:
+            AsyncFile(const std::string& path, const size_t chunkSize=DEFAULT_CHUNK_SIZE, const int maxPendingChunks=4);
+            ~AsyncFile();
+
+            // Not copyable
+            AsyncFile(const AsyncFile&) = delete;
+            AsyncFile& operator=(const AsyncFile&) = delete;
+
+            // Appends to the end of the file
+            void write(const void* data, size_t len);
+
+            // Writes at any offset, i.e. to fill in a header once its contents are known
+            void write(uint64_t offset, const void* data, size_t len);
+
+            // Waits until everything written so far has reached the file
+            void flush();
+
+            // Flushes and syncs the file to storage before closing it
+            void close();
+
+            uint64_t offset() const { return mOffset; }
+            const std::string& path() const { return mPath; }
+
+            static const size_t DEFAULT_CHUNK_SIZE = 4 * 1024 * 1024;
+
+        private:
+            struct Job {
+                uint64_t offset;
+                std::vector<uint8_t> data;
+            };
+
+            void append(const uint8_t* data, size_t len);
+            void submit(uint64_t offset, std::vector<uint8_t>&& data);
+            void submitChunk();
+            void checkError();
+            void writeJobs();
+            void writeJob(const Job& job);
+
+        private:
+            std::string mPath;
+            int mFd;
+            size_t mChunkSize;
+            size_t mMaxPending;
+
+            // Data not handed to the writer thread yet
+            std::vector<uint8_t> mChunk;
+            uint64_t mChunkOffset;
+            uint64_t mOffset;
+
+            std::thread mThread;
+            std::mutex mLock;
+            std::condition_variable mCv;
+            std::deque<Job> mJobs;
+            std::vector<std::vector<uint8_t>> mFreeChunks;
+            bool mWriting;
+            bool mStop;
+            std::exception_ptr mError;
+        };
+    }
+}
+
+#endif /* AsyncFile_hpp */
@@ -0,0 +1,122 @@
+#ifndef BinaryContainer_hpp
+#define BinaryContainer_hpp
+
+#include "motioncam/RawImageMetadata.h"
+#include "motioncam/Settings.h"
+
+#include <string>
+#include <vector>
+#include <map>
+
+namespace motioncam {
+
+    //
+    // Binary container layout (little endian):
+    //
+    //   [file header][camera metadata + settings][preview][frame proxies][padding to 4 KiB]
+    //   [frame header][lens shading map][padding to 4 KiB][frame data][padding to 4 KiB]
+    //   ...
+    //   [frame table][footer]
+    //
+    // Frame data always starts on a 4 KiB boundary so it can be mapped or read with O_DIRECT.
+    // The frame table holds a copy of every frame header and is written when the container
+    // is finished. If it is missing the frames are recovered by walking the frame headers.
+    // The preview and proxies are optional and only read when asked for.
+    //
+
+    namespace util {
+        class AsyncFile;
+    }
+
+    class BinaryContainerWriter {
+    public:
+        BinaryContainerWriter(const std::string& outputPath);
+        ~BinaryContainerWriter();
+
+        // Frames are written in the background, finish() returns once the container is on disk
+        void begin(const RawCameraMetadata& cameraMetadata,
+                   const PostProcessSettings& postProcessSettings,
+                   const int64_t referenceTimestamp,
+                   const bool isHdr,
+                   const std::vector<uint8_t>& preview=std::vector<uint8_t>(),
+                   const std::vector<std::shared_ptr<RawFrameProxy>>& proxies=std::vector<std::shared_ptr<RawFrameProxy>>());
+
+        void appendFrame(RawImageBuffer& frame);
+
+        // Writes the frame metadata with data that has already been prepared, i.e. compressed
+        void appendFrame(const RawImageBuffer& frame, const uint8_t* data, const size_t len, const bool isCompressed);
+        void finish();
+
+    private:
+        void write(const void* data, size_t len);
+        void pad();
+
+    private:
+        std::unique_ptr<util::AsyncFile> mFile;
+        bool mStarted;
+        bool mFinished;
+        std::vector<uint8_t> mFrameTable;
+        uint32_t mNumFrames;
+    };
+
+    class BinaryContainerReader {
+    public:
+        // With metadataOnly the colour matrices and lens shading maps are not loaded
+        BinaryContainerReader(const std::string& inputPath, const bool metadataOnly=false);
+        ~BinaryContainerReader();
+
+        static bool isBinaryContainer(const std::string& inputPath);
+
+        const RawCameraMetadata& getCameraMetadata() const { return mCameraMetadata; }
+        const PostProcessSettings& getPostProcessSettings() const { return mPostProcessSettings; }
+        int64_t getReferenceTimestamp() const { return mReferenceTimestamp; }
+        bool isHdr() const { return mIsHdr; }
+
+        // Frame metadata without data
+        const std::vector<std::shared_ptr<RawImageBuffer>>& getFrames() const { return mFrames; }
+
+        // Location of the frame data in the file
+        uint64_t getFrameOffset(size_t frame) const;
+        size_t getFrameLength(size_t frame) const;
+
+        void readFrame(size_t frame, std::vector<uint8_t>& output) const;
+
+        // Returns false if the container has no preview
+        bool readPreview(std::vector<uint8_t>& output) const;
+
+        // Returns null if there's no proxy for the frame
+        std::shared_ptr<RawFrameProxy> readFrameProxy(const int64_t timestampNs) const;
+
+        const std::string& path() const { return mInputPath; }
+
+    private:
+        struct ProxyLocation {
+            int32_t width;
+            int32_t height;
+            uint64_t offset;
+        };
+
+        void readPreviewTable(const uint8_t* data, size_t len, uint64_t fileSize);
+        bool readFrameTable(uint64_t fileSize);
+        void scanFrames(uint64_t fileSize);
+        size_t parseFrame(const uint8_t* data, size_t len, uint64_t fileSize);
+        void read(uint64_t offset, void* output, size_t len) const;
+
+    private:
+        std::string mInputPath;
+        int mFd;
+        bool mMetadataOnly;
+        uint64_t mFirstFrameOffset;
+        RawCameraMetadata mCameraMetadata;
+        PostProcessSettings mPostProcessSettings;
+        int64_t mReferenceTimestamp;
+        bool mIsHdr;
+        std::vector<std::shared_ptr<RawImageBuffer>> mFrames;
+        std::vector<std::pair<uint64_t, size_t>> mFrameData;
+        uint64_t mPreviewOffset;
+        uint64_t mPreviewLength;
+        std::map<int64_t, ProxyLocation> mProxies;
+    };
+}
+
+#endif /* BinaryContainer_hpp */
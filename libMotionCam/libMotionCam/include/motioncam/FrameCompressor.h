@@ -0,0 +1,63 @@
+#ifndef FrameCompressor_hpp
+#define FrameCompressor_hpp
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+namespace motioncam {
+    struct RawImageBuffer;
+
+    //
+    // Compresses frames on a pool of background threads so they can be written while later frames
+    // are still being compressed. At most a fixed number of compressed frames are held waiting to be
+    // written and they are returned in the order they were given.
+    //
+
+    class FrameCompressor {
+    public:
+        FrameCompressor(const std::vector<std::shared_ptr<RawImageBuffer>>& frames,
+                        const int numThreads=0,
+                        const int maxPending=0);
+
+        ~FrameCompressor();
+
+        // Returns false if the frame can't be compressed or doesn't get any smaller
+        static bool compressFrame(RawImageBuffer& frame, std::vector<uint8_t>& output);
+
+        // Number of threads used when no budget is given
+        static int defaultThreads();
+
+        // Waits for the next frame. If it could not be compressed, isCompressed is false and data is empty.
+        // Returns false once all frames have been returned.
+        bool next(std::shared_ptr<RawImageBuffer>& frame, std::vector<uint8_t>& data, bool& isCompressed);
+
+        // Total time spent in next() waiting for frames to be compressed
+        double stallTimeMs() const;
+
+    private:
+        void compressFrames();
+
+    private:
+        const std::vector<std::shared_ptr<RawImageBuffer>> mFrames;
+        size_t mMaxPending;
+
+        std::vector<std::thread> mThreads;
+        mutable std::mutex mLock;
+        std::condition_variable mCv;
+
+        std::vector<std::vector<uint8_t>> mCompressed;
+        std::vector<std::exception_ptr> mErrors;
+        std::vector<bool> mIsCompressed;
+        std::vector<bool> mReady;
+        size_t mNextCompress;
+        size_t mNextReturn;
+        bool mStop;
+        double mStallTimeMs;
+    };
+}
+
+#endif /* FrameCompressor_hpp */
@@ -0,0 +1,58 @@
+#ifndef FramePrefetcher_hpp
+#define FramePrefetcher_hpp
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+namespace motioncam {
+    class RawContainer;
+    struct RawImageBuffer;
+
+    //
+    // Loads frames from a container on background threads, staying at most a fixed number of
+    // frames ahead of the consumer. Frames are returned in the order they were requested.
+    //
+
+    class FramePrefetcher {
+    public:
+        FramePrefetcher(const RawContainer& rawContainer,
+                        const std::vector<std::string>& frames,
+                        const int maxPrefetch=3,
+                        const int numThreads=2);
+
+        ~FramePrefetcher();
+
+        // Returns the next frame, or null once all frames have been returned
+        std::shared_ptr<RawImageBuffer> next();
+
+        // Total time spent in next() waiting for frames to load
+        double stallTimeMs() const;
+
+    private:
+        void loadFrames();
+
+    private:
+        const RawContainer& mRawContainer;
+        const std::vector<std::string> mFrames;
+        const size_t mMaxPrefetch;
+
+        std::vector<std::thread> mThreads;
+        mutable std::mutex mLock;
+        std::condition_variable mCv;
+
+        std::vector<std::shared_ptr<RawImageBuffer>> mLoaded;
+        std::vector<std::exception_ptr> mErrors;
+        std::vector<bool> mReady;
+        size_t mNextLoad;
+        size_t mNextReturn;
+        bool mStop;
+        double mStallTimeMs;
+    };
+}
+
+#endif /* FramePrefetcher_hpp */
@@ -0,0 +1,32 @@
+#ifndef FrameScorer_hpp
+#define FrameScorer_hpp
+
+#include "motioncam/RawImageMetadata.h"
+
+#include <vector>
+
+namespace motioncam {
+
+    //
+    // Scores frames as they arrive from their FrameStats, so it's cheap enough to run on every frame. Sharpness
+    // is the gradient energy between pixels of the same colour, motion is how much the frame differs from the
+    // previous one and clipped is the fraction of pixels near the white level.
+    // Not thread safe, each frame is compared to the one scored before it.
+    //
+
+    class FrameScorer {
+    public:
+        FrameScorer();
+
+        // Sets frame.metadata.quality from frame.metadata.stats. Frames without stats are left at 0.
+        void score(RawImageBuffer& frame);
+
+        // Forget the previous frame, i.e. when the camera changes
+        void reset();
+
+    private:
+        std::vector<float> mPreviousBlocks;
+    };
+}
+
+#endif /* FrameScorer_hpp */
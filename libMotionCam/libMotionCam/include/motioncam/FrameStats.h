@@ -0,0 +1,82 @@
+#ifndef FrameStats_hpp
+#define FrameStats_hpp
+
+#include "motioncam/RawImageMetadata.h"
+
+#include <memory>
+#include <vector>
+
+namespace motioncam {
+
+    //
+    // Collects FrameStats from a downsampled grid of Bayer quads while a frame is being copied, so auto exposure,
+    // the preview and frame selection don't have to read the frame again. Rows are added in pairs as they are
+    // copied. Each copy thread uses its own accumulator and they are merged at the end.
+    //
+
+    // Colour transform used for the luma histogram. The metadata of a frame usually arrives after its image,
+    // so this comes from a recent frame.
+    struct FrameStatsColorTransform {
+        float cameraToSrgb[9];     // Row major
+        float cameraWhite[3];
+        std::vector<cv::Mat> lensShadingMap;
+    };
+
+    class FrameStatsAccumulator {
+    public:
+        // Same downscale as ImageProcessor::estimateBasicSettings() so the histograms match
+        static const int DOWNSCALE = 4;
+
+        static const int BLOCKS_X = 16;
+        static const int BLOCKS_Y = 12;
+        static const int HISTOGRAM_BINS = 256;
+
+        FrameStatsAccumulator(const RawCameraMetadata& cameraMetadata,
+                              const PixelFormat pixelFormat,
+                              const int width,
+                              const int height,
+                              std::shared_ptr<const FrameStatsColorTransform> colorTransform);
+
+        // Whether the rows y and y + 1 should be added
+        bool isSampled(const int y) const;
+
+        void add(const int y, const uint8_t* row, const uint8_t* nextRow);
+        void merge(const FrameStatsAccumulator& other);
+        void finish(FrameStats& stats) const;
+
+        // Measures a frame that is already in memory
+        static void measure(const RawImageBuffer& frame,
+                            const RawCameraMetadata& cameraMetadata,
+                            std::shared_ptr<const FrameStatsColorTransform> colorTransform,
+                            FrameStats& stats);
+
+    private:
+        PixelFormat mPixelFormat;
+        int mQuadWidth;
+        int mQuadHeight;
+        bool mValid;
+
+        float mBlackLevel[4];
+        float mWhiteLevel;
+        float mMeanBlackLevel;
+        int mClippedLevel;
+        int mChannels[4];
+        float mScale[4];
+
+        std::shared_ptr<const FrameStatsColorTransform> mColorTransform;
+
+        std::vector<int> mBlockX;
+        std::vector<int> mShadingX;
+
+        int64_t mNumQuads;
+        int64_t mChannelSums[4];
+        int64_t mGradient;
+        int64_t mGradientPixels;
+        int64_t mClipped;
+        std::vector<int64_t> mBlockSums;
+        std::vector<int32_t> mBlockCounts;
+        std::vector<uint32_t> mHistogram;
+    };
+}
+
+#endif /* FrameStats_hpp */
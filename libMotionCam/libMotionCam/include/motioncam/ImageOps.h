@@ -8,7 +8,8 @@
 
 namespace motioncam {
     
-    float estimateNoise(cv::Mat& input);
+    // Uses up to numThreads threads, or a few if not set
+    float estimateNoise(cv::Mat& input, int numThreads=0);
     
     float findMedian(cv::Mat& input, float p=0.5);
     float findMedian(std::vector<float> nums);
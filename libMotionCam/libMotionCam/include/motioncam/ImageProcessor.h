@@ -13,6 +13,7 @@
 namespace motioncam {
     class RawImage;
     class RawContainer;
+    class ImageProcessorSession;
     class PostProcessSettings;
     class Temperature;
     struct RawData;
@@ -44,11 +45,25 @@ namespace motioncam {
 
         static void process(RawContainer& rawContainer, const std::string& outputPath, const ImageProcessorProgress& progressListener);
 
+        static void process(RawContainer& rawContainer,
+                            const std::string& outputPath,
+                            const ImageProcessorProgress& progressListener,
+                            ImageProcessorSession& session);
+
         static Halide::Runtime::Buffer<uint8_t> createPreview(const RawImageBuffer& rawBuffer,
                                                        const int downscaleFactor,
                                                        const RawCameraMetadata& cameraMetadata,
                                                        const PostProcessSettings& settings);
         
+        // Renderings stored in a container so it can be shown and its frames compared without processing it
+        static std::vector<uint8_t> createEmbeddedPreview(const RawImageBuffer& rawBuffer,
+                                                          const RawCameraMetadata& cameraMetadata,
+                                                          const PostProcessSettings& settings);
+
+        static std::shared_ptr<RawFrameProxy> createFrameProxy(const RawImageBuffer& rawBuffer,
+                                                               const RawCameraMetadata& cameraMetadata,
+                                                               const PostProcessSettings& settings);
+
         static cv::Mat calcHistogram(const RawCameraMetadata& cameraMetadata,
                                      const RawImageBuffer& reference,
                                      const bool cumulative,
@@ -118,13 +133,15 @@ namespace motioncam {
                                      cv::Mat& outCameraToPcs,
                                      cv::Mat& outPcsToSrgb);
 
-        static std::vector<Halide::Runtime::Buffer<uint16_t>> denoise(RawContainer& rawContainer, ImageProgressHelper& progressHelper);
+        static std::vector<Halide::Runtime::Buffer<uint16_t>> denoise(RawContainer& rawContainer,
+                                                                      ImageProgressHelper& progressHelper,
+                                                                      ImageProcessorSession& session);
         
         static void addExifMetadata(const RawImageMetadata& metadata,
                                     const cv::Mat& thumbnail,
                                     const RawCameraMetadata& cameraMetadata,
                                     const PostProcessSettings& settings,
-                                    const std::string& inputOutput);
+                                    std::vector<uint8_t>& jpegData);
 
         static cv::Mat postProcess(std::vector<Halide::Runtime::Buffer<uint16_t>>& inputBuffers,
                                    const std::shared_ptr<HdrMetadata>& hdrMetadata,
@@ -133,7 +150,8 @@ namespace motioncam {
                                    const float chromaEps,
                                    const RawImageMetadata& metadata,
                                    const RawCameraMetadata& cameraMetadata,
-                                   const PostProcessSettings& settings);
+                                   const PostProcessSettings& settings,
+                                   ImageProcessorSession& session);
             
         static std::shared_ptr<HdrMetadata> prepareHdr(const RawCameraMetadata& cameraMetadata,
                                                        const PostProcessSettings& settings,
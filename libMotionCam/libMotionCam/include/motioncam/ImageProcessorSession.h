@@ -0,0 +1,120 @@
+#ifndef ImageProcessorSession_hpp
+#define ImageProcessorSession_hpp
+
+#include "motioncam/RawImageMetadata.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+
+#include <opencv2/opencv.hpp>
+#include <HalideBuffer.h>
+
+namespace motioncam {
+    class RawContainer;
+    class ImageProcessorProgress;
+    class Temperature;
+
+    //
+    // Wavelet buffers used by the spatial denoise, possibly from several threads. Pipelines calling the Halide
+    // denoise extern pass the pool of their session as the user context.
+    //
+
+    class WaveletBufferPool {
+    public:
+        static std::vector<Halide::Runtime::Buffer<float>> create(int width, int height);
+
+        std::vector<Halide::Runtime::Buffer<float>> acquire(int width, int height);
+        void release(std::vector<Halide::Runtime::Buffer<float>> buffers);
+        void clear();
+
+    private:
+        std::mutex mLock;
+        std::vector<std::vector<Halide::Runtime::Buffer<float>>> mBuffers;
+    };
+
+    //
+    // Keeps the buffers, threads, optical flow instances and colour transforms used to process an image, so processing
+    // many containers from the same camera doesn't create them again for each one. Buffers are reused when
+    // their dimensions match. Only one image should be processed at a time with a session.
+    //
+
+    class ImageProcessorSession {
+    public:
+        ImageProcessorSession();
+        ~ImageProcessorSession();
+
+        void process(const std::string& inputPath, const std::string& outputPath, const ImageProcessorProgress& progressListener);
+        void process(RawContainer& rawContainer, const std::string& outputPath, const ImageProcessorProgress& progressListener);
+
+        // Releases everything kept between calls to process()
+        void trim();
+
+        //
+        // Used by ImageProcessor
+        //
+
+        Halide::Runtime::Buffer<float> fuseBuffer(int width, int height);
+        Halide::Runtime::Buffer<uint16_t> denoiseBuffer(int width, int height);
+        WaveletBufferPool& waveletBuffers();
+
+        // Runs job(0) to job(numJobs - 1) at the same time and waits for them. The first job runs on the calling
+        // thread and the rest on threads kept by the session, up to MAX_WORKERS of them. Jobs must not throw.
+        void runJobs(int numJobs, const std::function<void (int)>& job);
+
+        cv::Ptr<cv::DISOpticalFlow> acquireOpticalFlow();
+        void releaseOpticalFlow(cv::Ptr<cv::DISOpticalFlow> opticalFlow);
+
+        void createSrgbMatrix(const RawCameraMetadata& cameraMetadata,
+                              const RawImageMetadata& rawImageMetadata,
+                              const Temperature& temperature,
+                              cv::Vec3f& cameraWhite,
+                              cv::Mat& outCameraToPcs,
+                              cv::Mat& outPcsToSrgb);
+
+        void createSrgbMatrix(const RawCameraMetadata& cameraMetadata,
+                              const RawImageMetadata& rawImageMetadata,
+                              const cv::Vec3f& asShot,
+                              cv::Vec3f& cameraWhite,
+                              cv::Mat& outCameraToPcs,
+                              cv::Mat& outPcsToSrgb);
+
+    private:
+        struct ColorTransform {
+            cv::Vec3f cameraWhite;
+            cv::Mat cameraToPcs;
+            cv::Mat pcsToSrgb;
+        };
+
+        void doJobs(int idx, int64_t generation);
+
+        bool findColorTransform(const std::string& key, cv::Vec3f& cameraWhite, cv::Mat& outCameraToPcs, cv::Mat& outPcsToSrgb);
+        void addColorTransform(const std::string& key, const cv::Vec3f& cameraWhite, const cv::Mat& cameraToPcs, const cv::Mat& pcsToSrgb);
+
+    private:
+        std::mutex mLock;
+
+        Halide::Runtime::Buffer<float> mFuseBuffer;
+        Halide::Runtime::Buffer<uint16_t> mDenoiseBuffer;
+        std::shared_ptr<WaveletBufferPool> mWaveletBuffers;
+        std::vector<cv::Ptr<cv::DISOpticalFlow>> mOpticalFlow;
+        std::map<std::string, ColorTransform> mColorTransforms;
+
+        std::vector<std::thread> mWorkers;
+        std::mutex mWorkerLock;
+        std::condition_variable mWorkerCondition;
+        std::condition_variable mWorkerDoneCondition;
+        std::function<void (int)> mWorkerJob;
+        int64_t mWorkerGeneration;
+        int mWorkerJobs;
+        int mWorkerPending;
+        bool mStopWorkers;
+    };
+}
+
+#endif /* ImageProcessorSession_hpp */
@@ -0,0 +1,43 @@
+#ifndef NativeMappedBuffer_hpp
+#define NativeMappedBuffer_hpp
+
+#include "motioncam/RawImageMetadata.h"
+
+#include <string>
+#include <vector>
+
+namespace motioncam {
+
+    //
+    // Read-only view of a byte range of a file, mapped into memory. Used to load uncompressed
+    // frames straight out of a container without copying them into an intermediate buffer.
+    //
+
+    class NativeMappedBuffer : public NativeBuffer {
+    public:
+        NativeMappedBuffer(const std::string& path, const uint64_t offset, const size_t length);
+        ~NativeMappedBuffer();
+
+        uint8_t* lock(bool write);
+        void unlock();
+
+        uint64_t nativeHandle();
+        size_t len();
+
+        const std::vector<uint8_t>& hostData();
+        void copyHostData(const std::vector<uint8_t>& data);
+
+        std::unique_ptr<NativeBuffer> clone();
+
+        void release();
+
+    private:
+        void* mMapping;
+        size_t mMappingLength;
+        uint8_t* mData;
+        size_t mLength;
+        std::vector<uint8_t> mHostBuffer;
+    };
+}
+
+#endif /* NativeMappedBuffer_hpp */
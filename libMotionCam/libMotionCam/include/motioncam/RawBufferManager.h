@@ -6,11 +6,89 @@
 #include <queue/concurrentqueue.h>
 #include <set>
 #include <vector>
+#include <deque>
 #include <memory>
 #include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
 
 namespace motioncam {
     class RawContainer;
+    class RawBufferPool;
+
+    // What save() does when too many captures, or too much memory, are waiting to be processed
+    enum class SaveQueuePolicy : int {
+        SPILL_TO_DISK = 0,  // Write the capture to disk on a background thread, never waits
+        BLOCK,              // Wait until a capture has been taken for processing
+        DROP_OLDEST         // Discard the oldest capture that is waiting
+    };
+
+    // How save() picks frames around the reference frame
+    enum class FrameSelectionMode : int {
+        NEAREST = 0,        // Closest in time to the reference
+        BEST_QUALITY        // Highest quality score, the best frame becomes the reference
+    };
+
+    struct FrameSelection {
+        FrameSelection(FrameSelectionMode mode=FrameSelectionMode::NEAREST, int64_t windowMs=0) : mode(mode), windowMs(windowMs) {
+        }
+
+        FrameSelectionMode mode;
+        
+        // Only frames within this distance of the reference are used when picking by quality, 0 for any
+        int64_t windowMs;
+    };
+
+    struct SaveJobStats {
+        SaveJobStats() : numFrames(0), bytes(0), spilled(false), dropped(false), failed(false), latencyMs(0) {
+        }
+
+        std::string outputPath;
+        int numFrames;
+        int64_t bytes;
+        bool spilled;       // Written to disk instead of being kept for processing
+        bool dropped;
+        bool failed;
+
+        // Time from save() until the capture was taken for processing, written to disk or dropped
+        double latencyMs;
+    };
+
+    struct SaveQueueStats {
+        SaveQueueStats() :
+            pendingContainers(0), pendingWrites(0), pendingBytes(0), numDropped(0), lastLatencyMs(0), averageLatencyMs(0) {
+        }
+
+        int pendingContainers;
+        int pendingWrites;
+        int64_t pendingBytes;   // Held by captures waiting to be processed or written
+        int numDropped;
+
+        // Of captures that weren't dropped
+        double lastLatencyMs;
+        double averageLatencyMs;
+
+        // The most recent captures, oldest first
+        std::vector<SaveJobStats> recentJobs;
+    };
+
+    //
+    // Ready buffers are kept in order of timestamp. When a buffer is needed for a new frame, the lowest
+    // scoring of the oldest few ZSL frames is reused, so blurry frames are the first to go. The capture thread hands them over through a lock-free
+    // queue that is only moved into the ordered list by whoever next needs the list, so handing over a frame
+    // never waits for the UI or a save to finish with the list. The next buffer to be reused is also set aside
+    // in a lock-free queue, so the capture thread can take it without waiting when the list is busy.
+    //
+    // Saved buffers are shared with the in-memory container instead of being copied, and come back once
+    // it has been processed. If the capture thread runs out of buffers before then, it takes them back
+    // from containers that are still waiting to be processed, which get a copy from the buffer pool instead
+    // if it has room.
+    //
+    // Optionally, frames that have been waiting for a while are compressed on a low priority thread so
+    // their buffers can be reused for new frames. This keeps more history in the same memory. They are
+    // decompressed again when they are consumed or saved.
+    //
 
     class RawBufferManager {
     public:
@@ -38,9 +116,17 @@ namespace motioncam {
         };
         
         void addBuffer(std::shared_ptr<RawImageBuffer>& buffer);
-        int memoryUseBytes() const;
+        
+        // Pool the capture buffers come from. Frames that are decompressed or copied take their memory from it.
+        void setBufferPool(std::shared_ptr<RawBufferPool> bufferPool);
+        
+        int64_t memoryUseBytes() const;
         int numBuffers() const;
         void reset();
+        
+        // Drops unused buffers, then the oldest ready ZSL frames, until no more than maxMemoryUseBytes are in use.
+        // Returns the bytes freed.
+        int64_t trimMemory(int64_t maxMemoryUseBytes);
 
         std::shared_ptr<RawImageBuffer> dequeueUnusedBuffer();
         void enqueueReadyBuffer(const std::shared_ptr<RawImageBuffer>& buffer);
@@ -56,32 +142,183 @@ namespace motioncam {
         std::unique_ptr<LockedBuffers> consumeLatestBuffer();
         std::unique_ptr<LockedBuffers> consumeAllBuffers();
         std::unique_ptr<LockedBuffers> consumeBuffer(int64_t timestampNs);
+        std::unique_ptr<LockedBuffers> consumeNearestBuffer(int64_t timestampNs);
         
         void save(RawType type,
                   int numSaveBuffers,
                   int64_t referenceTimestampNs,
                   const RawCameraMetadata& metadata,
                   const PostProcessSettings& settings,
-                  const std::string& outputPath);
+                  const std::string& outputPath,
+                  const FrameSelection& selection=FrameSelection());
 
         void save(RawCameraMetadata& metadata,
                   int64_t referenceTimestampNs,
                   int numSaveBuffers,
                   const PostProcessSettings& settings,
-                  const std::string& outputPath);
+                  const std::string& outputPath,
+                  const FrameSelection& selection=FrameSelection());
+        
+        // Store a preview of the reference frame and a proxy of each frame in saved containers
+        void setEmbedPreviews(bool embedPreviews);
+        
+        // Number of the oldest ZSL frames to choose from when reusing a ready buffer, 1 reuses the oldest
+        void setRetentionWindow(int numFrames);
+        
+        // Captures past maxPendingContainers, or that would take the memory held by waiting captures past
+        // maxPendingBytes (0 for no limit), are handled according to policy. Captures are spilled to disk on up
+        // to numWriters threads, which are started when first needed. When the writers fall behind by as much
+        // again the oldest capture that hasn't started writing is dropped. Spilled captures are written as zip
+        // containers like any other capture unless spillFormat says otherwise, in which case the output path
+        // should have a matching extension. Binary containers give each buffer back as soon as it is written.
+        void setSaveQueueOptions(int maxPendingContainers,
+                                 int numWriters,
+                                 SaveQueuePolicy policy,
+                                 int64_t maxPendingBytes=0,
+                                 ContainerFormat spillFormat=ContainerFormat::ZIP);
+        SaveQueueStats getSaveQueueStats();
+        
+        // Compresses ready frames older than minAgeMs, keeping up to maxCompressedBytes of them before the
+        // oldest are dropped. Disabled when maxCompressedBytes is 0. Buffers returned by consumeAllBuffers()
+        // are not decompressed, check isCompressed before using their data.
+        void setCompaction(int64_t minAgeMs, int64_t maxCompressedBytes);
+        int64_t compressedBytes() const;
         
     private:
+        typedef std::deque<std::shared_ptr<RawImageBuffer>> ReadyBuffers;
+        typedef std::chrono::steady_clock::time_point TimePoint;
+        
+        struct PendingContainer {
+            std::shared_ptr<RawContainer> container;
+            SaveJobStats stats;
+            TimePoint queuedTime;
+        };
+        
+        struct WriteJob {
+            std::vector<std::shared_ptr<RawImageBuffer>> buffers;
+            RawCameraMetadata metadata;
+            PostProcessSettings settings;
+            int64_t referenceTimestampNs;
+            bool isHdr;
+            bool returnToReadyBuffers;
+            std::vector<uint8_t> preview;
+            std::vector<std::shared_ptr<RawFrameProxy>> proxies;
+            std::string outputPath;
+            ContainerFormat format;
+            SaveJobStats stats;
+            TimePoint queuedTime;
+        };
+        
         RawBufferManager();
+        ~RawBufferManager();
+
+        // These must be called with mMutex held
+        void moveIncomingBuffers();
+        void insertReadyBuffer(const std::shared_ptr<RawImageBuffer>& buffer);
+        ReadyBuffers::iterator findReadyBuffer(int64_t timestampNs);
+        ReadyBuffers::iterator findNearestReadyBuffer(int64_t timestampNs);
+        ReadyBuffers::iterator findBufferToReuse();
+        void reserveBuffer();
+        void removeReadyBuffers(const std::vector<std::shared_ptr<RawImageBuffer>>& buffers);
+        void onReadyBufferRemoved(const std::shared_ptr<RawImageBuffer>& buffer);
+        void dropCompressedBuffers(int64_t maxCompressedBytes);
+
+        void decompressBuffers(const std::vector<std::shared_ptr<RawImageBuffer>>& buffers);
+        bool compactOldestBuffer();
+        void doCompaction();
+
+        std::vector<std::shared_ptr<RawImageBuffer>> shareBuffers(
+            const std::vector<std::shared_ptr<RawImageBuffer>>& buffers, bool returnToReadyBuffers);
+        bool reclaimSharedBuffer();
+        
+        // Returns true if a buffer that isn't counted was still around, it then takes the place of one that is
+        bool takeTemporaryBuffer();
 
-        std::atomic<int> mMemoryUseBytes;
+        void queueSave(const std::vector<std::shared_ptr<RawImageBuffer>>& buffers,
+                       const RawCameraMetadata& metadata,
+                       const PostProcessSettings& settings,
+                       int64_t referenceTimestampNs,
+                       bool isHdr,
+                       bool returnToReadyBuffers,
+                       std::vector<uint8_t> preview,
+                       std::vector<std::shared_ptr<RawFrameProxy>> proxies,
+                       const std::string& outputPath,
+                       TimePoint queuedTime);
+
+        void doWriteJobs();
+        
+        // Must be called with mPendingLock held
+        void onSaveCompleted(SaveJobStats stats, TimePoint queuedTime);
+        
+        void returnSavedBuffers(const std::vector<std::shared_ptr<RawImageBuffer>>& buffers, bool returnToReadyBuffers);
+
+        void createPreviews(const std::vector<std::shared_ptr<RawImageBuffer>>& buffers,
+                            const RawCameraMetadata& metadata,
+                            const PostProcessSettings& settings,
+                            int64_t referenceTimestampNs,
+                            std::vector<uint8_t>& outPreview,
+                            std::vector<std::shared_ptr<RawFrameProxy>>& outProxies);
+
+        void writeContainer(const std::vector<std::shared_ptr<RawImageBuffer>>& buffers,
+                            const RawCameraMetadata& metadata,
+                            const PostProcessSettings& settings,
+                            int64_t referenceTimestampNs,
+                            bool isHdr,
+                            bool returnToReadyBuffers,
+                            const std::vector<uint8_t>& preview,
+                            const std::vector<std::shared_ptr<RawFrameProxy>>& proxies,
+                            const std::string& outputPath,
+                            ContainerFormat format);
+
+        std::atomic<int64_t> mMemoryUseBytes;
         std::atomic<int> mNumBuffers;
+        std::atomic<int> mNumHdrBuffers;
+        std::atomic<bool> mEmbedPreviews;
+        std::atomic<int> mGeneration;
+        std::atomic<int> mRetentionWindow;
+        std::atomic<int> mNumTemporaryBuffers;
+        std::shared_ptr<RawBufferPool> mBufferPool;
                 
         std::recursive_mutex mMutex;
         
-        std::vector<std::shared_ptr<RawImageBuffer>> mReadyBuffers;
+        ReadyBuffers mReadyBuffers;
 
+        moodycamel::ConcurrentQueue<std::shared_ptr<RawImageBuffer>> mIncomingBuffers;
         moodycamel::ConcurrentQueue<std::shared_ptr<RawImageBuffer>> mUnusedBuffers;
-        moodycamel::ConcurrentQueue<std::shared_ptr<RawContainer>> mPendingContainers;
+        moodycamel::ConcurrentQueue<std::shared_ptr<RawImageBuffer>> mReservedBuffers;
+
+        std::mutex mPendingLock;
+        std::condition_variable mPendingCv;
+        std::deque<PendingContainer> mPendingContainers;
+        std::deque<WriteJob> mWriteJobs;
+        std::vector<std::thread> mWriters;
+        int mActiveWrites;
+        bool mStopWriters;
+        
+        int64_t mPendingBytes;
+        int64_t mWriteBytes;
+        
+        int mMaxPendingContainers;
+        int64_t mMaxPendingBytes;
+        int mNumWriters;
+        SaveQueuePolicy mSavePolicy;
+        ContainerFormat mSpillFormat;
+        
+        int mNumDropped;
+        int mNumCompleted;
+        double mTotalLatencyMs;
+        double mLastLatencyMs;
+        std::deque<SaveJobStats> mRecentJobs;
+        
+        std::atomic<int64_t> mCompressedBytes;
+        std::atomic<int64_t> mCompactionMinAgeNs;
+        std::atomic<int64_t> mMaxCompressedBytes;
+        std::set<int64_t> mUncompressibleFrames;
+        
+        std::thread mCompactionThread;
+        std::mutex mCompactionLock;
+        std::condition_variable mCompactionCv;
+        bool mStopCompaction;
     };
 
 } // namespace motioncam
@@ -0,0 +1,83 @@
+#ifndef RawBufferPool_hpp
+#define RawBufferPool_hpp
+
+#include "motioncam/RawImageMetadata.h"
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+namespace motioncam {
+
+    //
+    // Fixed size buffers carved out of one large anonymous mapping. The mapping is only reserved up
+    // front, pages are committed by the kernel when a buffer is first written so nothing is zero filled
+    // by us. The pool never hands out more than its budget, and the memory of a buffer that is dropped
+    // is returned to the system straight away.
+    //
+
+    class RawBufferPool : public std::enable_shared_from_this<RawBufferPool> {
+    public:
+        static std::shared_ptr<RawBufferPool> create(size_t bufferLength, int64_t budgetBytes);
+        ~RawBufferPool();
+
+        // Not copyable
+        RawBufferPool(const RawBufferPool&) = delete;
+        RawBufferPool& operator=(const RawBufferPool&) = delete;
+
+        // Returns null once the budget is used up
+        std::unique_ptr<NativeBuffer> allocate();
+
+        size_t bufferLength() const { return mBufferLength; }
+        int64_t budgetBytes() const;
+        int64_t usedBytes() const;
+
+    private:
+        friend class NativePoolBuffer;
+
+        RawBufferPool(size_t bufferLength, int64_t budgetBytes);
+
+        void release(int slot);
+        uint8_t* slotData(int slot) const;
+
+    private:
+        size_t mBufferLength;
+        size_t mSlotLength;
+        int mNumSlots;
+
+        uint8_t* mMapping;
+        size_t mMappingLength;
+
+        mutable std::mutex mLock;
+        std::vector<int> mFreeSlots;
+    };
+
+    class NativePoolBuffer : public NativeBuffer {
+    public:
+        NativePoolBuffer(std::shared_ptr<RawBufferPool> pool, int slot);
+        ~NativePoolBuffer();
+
+        uint8_t* lock(bool write);
+        void unlock();
+
+        uint64_t nativeHandle();
+        size_t len();
+
+        const std::vector<uint8_t>& hostData();
+        void copyHostData(const std::vector<uint8_t>& data);
+
+        std::unique_ptr<NativeBuffer> clone();
+
+        void release();
+
+    private:
+        std::shared_ptr<RawBufferPool> mPool;
+        int mSlot;
+        uint8_t* mData;
+        size_t mLength;
+        std::vector<uint8_t> mHostBuffer;
+    };
+}
+
+#endif /* RawBufferPool_hpp */
@@ -0,0 +1,45 @@
+#ifndef RawCodec_hpp
+#define RawCodec_hpp
+
+#include "motioncam/RawImageMetadata.h"
+
+#include <vector>
+
+namespace motioncam {
+    namespace codec {
+
+        //
+        // Lossless codec for RAW10/RAW12/RAW16 Bayer frames. Each pixel is predicted from its
+        // neighbours in the same colour plane and the residuals are bit packed in small blocks.
+        // Frames are split into strips of rows that can be decoded independently.
+        //
+
+        // Bytes used by a row of pixels, 0 if the format is not supported
+        size_t rowLength(const PixelFormat pixelFormat, const int width);
+
+        // Unpacks a row of RAW10/RAW12/RAW16 pixels to 16 bits. RAW10 rows must be a multiple of 4 pixels.
+        void unpackRow(const uint8_t* input, const PixelFormat pixelFormat, const int width, uint16_t* output);
+
+        // Packs a row of 16 bit pixels to RAW10/RAW12/RAW16, pixels that don't fit in the format are clipped.
+        // RAW10 rows must be a multiple of 4 pixels and RAW12 rows a multiple of 2.
+        void packRow(const uint16_t* input, const PixelFormat pixelFormat, const int width, uint8_t* output);
+
+        bool canEncode(const PixelFormat pixelFormat, const int width, const int height, const int rowStride, const size_t len);
+
+        // Returns false if the data can't be encoded or doesn't get any smaller
+        bool encode(const uint8_t* data,
+                    const size_t len,
+                    const PixelFormat pixelFormat,
+                    const int width,
+                    const int height,
+                    const int rowStride,
+                    std::vector<uint8_t>& output);
+
+        bool isEncoded(const uint8_t* data, const size_t len);
+        size_t decodedLength(const uint8_t* data, const size_t len);
+
+        void decode(const uint8_t* data, const size_t len, uint8_t* output, const size_t outputLen, const int numThreads=1);
+    }
+}
+
+#endif /* RawCodec_hpp */
@@ -4,6 +4,7 @@
 #include <string>
 #include <set>
 #include <map>
+#include <functional>
 
 #include <opencv2/opencv.hpp>
 #include <json11/json11.hpp>
@@ -12,16 +13,48 @@
 #include "motioncam/RawBufferManager.h"
 
 namespace motioncam {
+    class BinaryContainerReader;
+    class BinaryContainerWriter;
+
+    struct RawFrameInfo {
+        int64_t timestampNs;
+        int64_t exposureTime;
+        int32_t iso;
+        int32_t exposureCompensation;
+        RawType rawType;
+    };
+
+    // Summary of a container that can be read without loading the camera and frame metadata
+    struct RawContainerInfo {
+        RawContainerInfo() : referenceTimestamp(-1), isHdr(false) {
+        }
+
+        int64_t referenceTimestamp;
+        bool isHdr;
+        std::string captureMode;
+        std::vector<RawFrameInfo> frames;
+    };
 
     class RawContainer {
     public:
         RawContainer(const std::string& inputPath);
 
+        // If shareBuffers is set the buffers are kept instead of copied, and must not be written to
+        // while the container holds on to them
         RawContainer(const RawCameraMetadata& cameraMetadata,
                      const PostProcessSettings& postProcessSettings,
                      const int64_t referenceTimestamp,
                      const bool isHdr,
-                     const std::vector<std::shared_ptr<RawImageBuffer>>& buffers);
+                     const std::vector<std::shared_ptr<RawImageBuffer>>& buffers,
+                     const bool shareBuffers=false);
+
+        ~RawContainer();
+
+        // Reads only what is needed for a RawContainerInfo
+        static RawContainerInfo readInfo(const std::string& inputPath);
+
+        // Rewrites a container in the given format
+        static void convert(const std::string& inputPath, const std::string& outputPath, const ContainerFormat format);
 
         const RawCameraMetadata& getCameraMetadata() const;
         const PostProcessSettings& getPostProcessSettings() const;
@@ -34,14 +67,52 @@ namespace motioncam {
         
         std::shared_ptr<RawImageBuffer> getFrame(const std::string& frame) const;
         std::shared_ptr<RawImageBuffer> loadFrame(const std::string& frame) const;
+        
+        // Decodes a frame straight into output, i.e. a recycled or GPU buffer, without keeping it in
+        // the container. Output must be at least getFrameDataLength() bytes. Returns the bytes written.
+        size_t loadFrame(const std::string& frame, NativeBuffer& output) const;
+        size_t getFrameDataLength(const std::string& frame) const;
         void removeFrame(const std::string& frame);
         
-        void save(const std::string& outputPath);
+        // JPEG of the reference frame, empty if the container doesn't have one
+        std::vector<uint8_t> getPreview() const;
+        void setPreview(const std::vector<uint8_t>& preview);
+        
+        // Returns null if the frame has no proxy. The proxy timestamp must match the frame.
+        std::shared_ptr<RawFrameProxy> getFrameProxy(const std::string& frame) const;
+        void setFrameProxy(const std::string& frame, const std::shared_ptr<RawFrameProxy>& proxy);
+        
+        // Proxies are matched to frames by timestamp
+        void setPreviews(const std::vector<uint8_t>& preview, const std::vector<std::shared_ptr<RawFrameProxy>>& proxies);
+        
+        // Frames are compressed on numThreads threads, or one per core if not set
+        void save(const std::string& outputPath, const ContainerFormat format=ContainerFormat::ZIP, const int numThreads=0);
         
         bool isInMemory() const { return mIsInMemory; };
         
+        bool hasSharedFrames() const { return !mSharedFrames.empty(); }
+        
+        // Copies one shared buffer into copy so the original can be reused. Returns false if there are no
+        // shared buffers left or copy is too small.
+        bool copySharedFrame(const std::shared_ptr<RawImageBuffer>& copy);
+        
     private:
         void initialise();
+        void initialiseBinary();
+        
+        std::vector<std::shared_ptr<RawImageBuffer>> getFrameBuffers() const;
+        std::vector<std::shared_ptr<RawFrameProxy>> getFrameProxies() const;
+        std::unique_ptr<NativeBuffer> getStoredData(const std::string& frame) const;
+        
+        static size_t getDecodedLength(const uint8_t* data, const size_t len, const bool isCompressed);
+        static void decodeFrame(const uint8_t* data,
+                                const size_t len,
+                                const bool isCompressed,
+                                uint8_t* output,
+                                const size_t outputLen);
+        
+        void saveZip(const std::string& outputPath, const int numThreads);
+        void saveBinary(const std::string& outputPath, const int numThreads);
         
         static std::string getRequiredSettingAsString(const json11::Json& json, const std::string& key);
         static int getRequiredSettingAsInt(const json11::Json& json, const std::string& key);
@@ -59,6 +130,8 @@ namespace motioncam {
 
     private:
         std::unique_ptr<util::ZipReader> mZipReader;
+        std::unique_ptr<BinaryContainerReader> mBinaryReader;
+        std::map<std::string, size_t> mBinaryFrames;
         RawCameraMetadata mCameraMetadata;
         PostProcessSettings mPostProcessSettings;
         int64_t mReferenceTimestamp;
@@ -67,7 +140,44 @@ namespace motioncam {
         bool mIsInMemory;
         std::vector<std::string> mFrames;
         std::map<std::string, std::shared_ptr<RawImageBuffer>> mFrameBuffers;
+        std::set<std::string> mSharedFrames;
         std::unique_ptr<RawBufferManager::LockedBuffers> mLockedBuffers;        
+        std::vector<uint8_t> mPreview;
+        std::map<std::string, std::shared_ptr<RawFrameProxy>> mFrameProxies;
+        std::map<std::string, cv::Size> mZipProxySizes;
+    };
+
+    //
+    // Writes frames to a container as they are handed over, so the buffers can be reused straight away
+    // instead of being copied and held until the whole container is saved. Frames that have reached
+    // the file can be read back even if the container is never finished.
+    //
+
+    class RawContainerWriter {
+    public:
+        RawContainerWriter(const std::string& outputPath, const int numThreads=0);
+        ~RawContainerWriter();
+
+        void begin(const RawCameraMetadata& cameraMetadata,
+                   const PostProcessSettings& postProcessSettings,
+                   const int64_t referenceTimestamp,
+                   const bool isHdr,
+                   const std::vector<uint8_t>& preview=std::vector<uint8_t>(),
+                   const std::vector<std::shared_ptr<RawFrameProxy>>& proxies=std::vector<std::shared_ptr<RawFrameProxy>>());
+
+        void appendFrame(RawImageBuffer& frame);
+
+        // Compresses the frames in parallel and writes them in order. onFrameWritten is called
+        // as soon as each frame has been written.
+        void appendFrames(const std::vector<std::shared_ptr<RawImageBuffer>>& frames,
+                          const std::function<void (const std::shared_ptr<RawImageBuffer>&)>& onFrameWritten=nullptr);
+
+        void finish();
+
+    private:
+        std::unique_ptr<BinaryContainerWriter> mWriter;
+        std::vector<uint8_t> mTmpBuffer;
+        int mNumThreads;
     };
 }
 
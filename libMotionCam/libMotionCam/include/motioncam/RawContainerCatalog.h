@@ -0,0 +1,52 @@
+#ifndef RawContainerCatalog_hpp
+#define RawContainerCatalog_hpp
+
+#include "motioncam/RawContainer.h"
+
+#include <string>
+#include <map>
+
+namespace motioncam {
+
+    //
+    // Index of the containers in a directory. A rescan only opens containers that are new or whose
+    // size or modification time has changed. The index is stored in a compact binary file so a large
+    // directory can be listed without opening any containers.
+    //
+
+    class RawContainerCatalog {
+    public:
+        struct Entry {
+            Entry() : fileSize(0), modifiedTime(0), isValid(false) {
+            }
+
+            uint64_t fileSize;
+            int64_t modifiedTime;
+
+            // False if the file could not be read as a container
+            bool isValid;
+
+            RawContainerInfo info;
+        };
+
+        // Loads the index if it exists
+        RawContainerCatalog(const std::string& directory, const std::string& indexPath);
+
+        // Returns the number of containers that had to be read
+        size_t rescan();
+        void save() const;
+
+        // Keyed by filename
+        const std::map<std::string, Entry>& getEntries() const { return mEntries; }
+
+    private:
+        bool load();
+
+    private:
+        std::string mDirectory;
+        std::string mIndexPath;
+        std::map<std::string, Entry> mEntries;
+    };
+}
+
+#endif /* RawContainerCatalog_hpp */
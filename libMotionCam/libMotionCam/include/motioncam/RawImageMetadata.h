@@ -48,6 +48,35 @@ namespace motioncam {
         HDR
     };
 
+    enum class ContainerFormat : int {
+        ZIP = 0,
+        BINARY
+    };
+
+    // Measured as frames arrive so the best frames can be kept and saved. 0 if not measured.
+    struct FrameQuality {
+        FrameQuality() : sharpness(0), motion(0), clipped(0), score(0) {
+        }
+
+        float sharpness;    // Gradient energy relative to the mean level
+        float motion;       // Difference to the previous frame
+        float clipped;      // Fraction of clipped pixels
+        float score;        // Higher is better, only comparable between similar frames
+    };
+
+    // Collected while a frame is copied from the camera, see FrameStatsAccumulator. Not stored in containers.
+    struct FrameStats {
+        FrameStats() : valid(false), channelMeans{0, 0, 0, 0}, sharpness(0), clipped(0) {
+        }
+
+        bool valid;
+        float channelMeans[4];          // Mean of each pixel of the Bayer quad in sensor units, in frame order
+        float sharpness;                // Gradient energy relative to the mean level
+        float clipped;                  // Fraction of clipped pixels
+        std::vector<float> histogram;   // Luma histogram matching ImageProcessor::calcHistogram, empty if unknown
+        std::vector<float> blocks;      // Coarse grid of levels relative to the mean level
+    };
+
     struct RawImageMetadata
     {
         RawImageMetadata() :
@@ -71,7 +100,9 @@ namespace motioncam {
             recvdTimestampMs(other.recvdTimestampMs),
             screenOrientation(other.screenOrientation),
             rawType(other.rawType),
-            noiseProfile(other.noiseProfile)
+            noiseProfile(other.noiseProfile),
+            quality(other.quality),
+            stats(other.stats)
         {
         }
 
@@ -85,7 +116,9 @@ namespace motioncam {
             recvdTimestampMs(other.recvdTimestampMs),
             screenOrientation(other.screenOrientation),
             rawType(other.rawType),
-            noiseProfile(other.noiseProfile)
+            noiseProfile(other.noiseProfile),
+            quality(other.quality),
+            stats(other.stats)
         {
         }
 
@@ -100,6 +133,8 @@ namespace motioncam {
             screenOrientation = obj.screenOrientation;
             rawType = obj.rawType;
             noiseProfile = obj.noiseProfile;
+            quality = obj.quality;
+            stats = obj.stats;
 
             return *this;
         }
@@ -124,6 +159,8 @@ namespace motioncam {
         ScreenOrientation screenOrientation;
         RawType rawType;
         std::vector<double> noiseProfile;
+        FrameQuality quality;
+        FrameStats stats;
     };
 
     class NativeBuffer {
@@ -155,10 +192,12 @@ namespace motioncam {
         {
         }
 
-        NativeHostBuffer(const uint8_t* other, size_t len)
+        NativeHostBuffer(std::vector<uint8_t>&& other) : data(std::move(other))
+        {
+        }
+
+        NativeHostBuffer(const uint8_t* other, size_t len) : data(other, other + len)
         {
-            data.resize(len);
-            data.assign(other, other + len);
         }
 
         std::unique_ptr<NativeBuffer> clone() {
@@ -298,5 +337,16 @@ namespace motioncam {
         std::vector<float> apertures;
         std::vector<float> focalLengths;
     };
+
+    // Small greyscale rendering of a frame, stored in containers so frames can be compared without decoding them
+    struct RawFrameProxy {
+        RawFrameProxy() : timestampNs(-1), width(0), height(0) {
+        }
+
+        int64_t timestampNs;
+        int32_t width;
+        int32_t height;
+        std::vector<uint8_t> data;
+    };
 }
 #endif /* RawImageMetadata_hpp */
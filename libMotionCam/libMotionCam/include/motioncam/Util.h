@@ -4,13 +4,17 @@
 #include <string>
 #include <vector>
 #include <set>
+#include <mutex>
+#include <memory>
 
 #include <miniz_zip.h>
 #include <json11/json11.hpp>
 
 namespace motioncam {
     namespace util {
+        class AsyncFile;
         
+        // Entries are written in the background, commit() returns once the archive is on disk
         class ZipWriter {
         public:
             ZipWriter(const std::string& pathname);
@@ -18,14 +22,20 @@ namespace motioncam {
             
             void addFile(const std::string& filename, const std::string& data);
             void addFile(const std::string& filename, const std::vector<uint8_t>& data, const size_t numBytes);
-            
+            void addFile(const std::string& filename, const uint8_t* data, const size_t numBytes);
+
             void commit();
             
+        private:
+            static size_t write(void* opaque, mz_uint64 offset, const void* data, size_t len);
+            
         private:
             mz_zip_archive m_zip;
+            std::unique_ptr<AsyncFile> m_file;
             bool m_commited;
         };
 
+        // Reads are serialised so a single reader can be shared between threads
         class ZipReader {
         public:
             ZipReader(const std::string& pathname);
@@ -33,21 +43,41 @@ namespace motioncam {
             
             void read(const std::string& filename, std::string& output);
             void read(const std::string& filename, std::vector<uint8_t>& output);
-            
+
+            // Returns the location of an uncompressed entry within the archive
+            bool findStoredEntry(const std::string& filename, uint64_t& offset, size_t& length);
+
+            bool contains(const std::string& filename) const;
+
+            const std::string& path() const { return m_path; }
+
+        private:
+            size_t indexOf(const std::string& filename) const;
+
         private:
             mz_zip_archive m_zip;
+            std::mutex m_lock;
+            std::string m_path;
             std::vector<std::string> m_files;
         };
 
 #ifdef ZSTD_AVAILABLE
         void ReadCompressedFile(const std::string& inputPath, std::vector<uint8_t>& output);
-        void WriteCompressedFile(const std::vector<uint8_t>& data, const std::string& outputPath);
+        // numWorkers > 0 compresses on that many zstd worker threads, if zstd was built with threading support
+        void WriteCompressedFile(const std::vector<uint8_t>& data,
+                                 const std::string& outputPath,
+                                 const int compressionLevel=1,
+                                 const int numWorkers=0);
 #endif
 
         void ReadFile(const std::string& inputPath, std::vector<uint8_t>& output);
         void WriteFile(const uint8_t* data, size_t size, const std::string& outputPath);
         json11::Json ReadJsonFromFile(const std::string& path);
         void GetBasePath(const std::string& path, std::string& basePath, std::string& filename);
+        
+        // Copies large buffers such as whole frames with streaming stores so they don't push everything else
+        // out of the cache. Copies of several MB can be split over up to 4 threads. Small copies use memcpy.
+        void fastCopy(void* dst, const void* src, size_t len, int numThreads=1);
     }
 }
 
@@ -0,0 +1,252 @@
+#include "motioncam/AsyncFile.h"
+#include "motioncam/Exceptions.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+namespace motioncam {
+    namespace util {
+
+        AsyncFile::AsyncFile(const std::string& path, const size_t chunkSize, const int maxPendingChunks) :
+            mPath(path),
+            mFd(-1),
+            mChunkSize(std::max<size_t>(4096, chunkSize)),
+            mMaxPending(static_cast<size_t>(std::max(1, maxPendingChunks))),
+            mChunkOffset(0),
+            mOffset(0),
+            mWriting(false),
+            mStop(false)
+        {
+            mFd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if(mFd < 0) {
+                throw IOException("Can't create " + path);
+            }
+
+            mChunk.reserve(mChunkSize);
+            mThread = std::thread(&AsyncFile::writeJobs, this);
+        }
+
+        AsyncFile::~AsyncFile() {
+            if(mFd >= 0) {
+                try {
+                    close();
+                }
+                catch(...) {
+                    // Nothing we can do at this point
+                }
+            }
+        }
+
+        void AsyncFile::write(const void* data, size_t len) {
+            checkError();
+            append(static_cast<const uint8_t*>(data), len);
+        }
+
+        void AsyncFile::write(uint64_t offset, const void* data, size_t len) {
+            checkError();
+
+            auto* src = static_cast<const uint8_t*>(data);
+
+            // Anything before the current chunk has already been handed over, write it separately.
+            // The writer thread runs jobs in order so it will land after the data it replaces.
+            if(offset < mChunkOffset) {
+                size_t n = static_cast<size_t>(std::min<uint64_t>(len, mChunkOffset - offset));
+
+                submit(offset, std::vector<uint8_t>(src, src + n));
+
+                offset += n;
+                src += n;
+                len -= n;
+            }
+
+            if(len == 0)
+                return;
+
+            // Leave a gap
+            if(offset > mOffset) {
+                submitChunk();
+
+                mChunkOffset = offset;
+                mOffset = offset;
+            }
+
+            // Overwrite what's still in the current chunk and append the rest
+            size_t n = static_cast<size_t>(std::min<uint64_t>(len, mOffset - offset));
+
+            if(n > 0)
+                std::memcpy(mChunk.data() + (offset - mChunkOffset), src, n);
+
+            append(src + n, len - n);
+        }
+
+        void AsyncFile::append(const uint8_t* data, size_t len) {
+            while(len > 0) {
+                size_t n = std::min(len, mChunkSize - mChunk.size());
+
+                mChunk.insert(mChunk.end(), data, data + n);
+                mOffset += n;
+
+                data += n;
+                len -= n;
+
+                if(mChunk.size() >= mChunkSize)
+                    submitChunk();
+            }
+        }
+
+        void AsyncFile::submitChunk() {
+            if(mChunk.empty())
+                return;
+
+            uint64_t chunkOffset = mChunkOffset;
+            std::vector<uint8_t> chunk;
+
+            chunk.swap(mChunk);
+
+            mChunkOffset = mOffset;
+
+            submit(chunkOffset, std::move(chunk));
+
+            // Reuse a chunk that has been written
+            std::lock_guard<std::mutex> lock(mLock);
+
+            if(!mFreeChunks.empty()) {
+                mChunk = std::move(mFreeChunks.back());
+                mFreeChunks.pop_back();
+            }
+
+            mChunk.clear();
+            mChunk.reserve(mChunkSize);
+        }
+
+        void AsyncFile::submit(uint64_t offset, std::vector<uint8_t>&& data) {
+            std::unique_lock<std::mutex> lock(mLock);
+
+            // Wait for the writer to catch up
+            mCv.wait(lock, [&] { return mJobs.size() < mMaxPending || mError; });
+
+            if(mError)
+                std::rethrow_exception(mError);
+
+            mJobs.push_back({ offset, std::move(data) });
+            mCv.notify_all();
+        }
+
+        void AsyncFile::checkError() {
+            std::lock_guard<std::mutex> lock(mLock);
+
+            if(mError)
+                std::rethrow_exception(mError);
+        }
+
+        void AsyncFile::flush() {
+            submitChunk();
+
+            std::unique_lock<std::mutex> lock(mLock);
+
+            mCv.wait(lock, [&] { return (mJobs.empty() && !mWriting) || mError; });
+
+            if(mError)
+                std::rethrow_exception(mError);
+        }
+
+        void AsyncFile::close() {
+            if(mFd < 0)
+                return;
+
+            std::exception_ptr error;
+
+            try {
+                flush();
+
+                if(fsync(mFd) != 0)
+                    throw IOException("Failed to sync " + mPath);
+            }
+            catch(...) {
+                error = std::current_exception();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mLock);
+                mStop = true;
+            }
+
+            mCv.notify_all();
+            mThread.join();
+
+            if(::close(mFd) != 0 && !error)
+                error = std::make_exception_ptr(IOException("Failed to close " + mPath));
+
+            mFd = -1;
+
+            if(error)
+                std::rethrow_exception(error);
+        }
+
+        void AsyncFile::writeJobs() {
+            std::unique_lock<std::mutex> lock(mLock);
+
+            while(true) {
+                mCv.wait(lock, [&] { return mStop || !mJobs.empty(); });
+
+                if(mJobs.empty())
+                    break;
+
+                Job job = std::move(mJobs.front());
+                mJobs.pop_front();
+
+                mWriting = true;
+
+                // Skip the rest once something has gone wrong
+                if(!mError) {
+                    lock.unlock();
+
+                    std::exception_ptr error;
+
+                    try {
+                        writeJob(job);
+                    }
+                    catch(...) {
+                        error = std::current_exception();
+                    }
+
+                    lock.lock();
+
+                    if(error)
+                        mError = error;
+                }
+
+                if(job.data.capacity() == mChunkSize && mFreeChunks.size() < mMaxPending)
+                    mFreeChunks.push_back(std::move(job.data));
+
+                mWriting = false;
+                mCv.notify_all();
+            }
+        }
+
+        void AsyncFile::writeJob(const Job& job) {
+            const uint8_t* src = job.data.data();
+            uint64_t offset = job.offset;
+            size_t len = job.data.size();
+
+            while(len > 0) {
+                ssize_t written = pwrite(mFd, src, len, static_cast<off_t>(offset));
+                if(written < 0) {
+                    if(errno == EINTR)
+                        continue;
+
+                    throw IOException("Cannot write to " + mPath);
+                }
+
+                src += written;
+                offset += written;
+                len -= written;
+            }
+        }
+    }
+}
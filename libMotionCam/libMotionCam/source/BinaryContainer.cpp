@@ -0,0 +1,739 @@
+#include "motioncam/BinaryContainer.h"
+#include "motioncam/Exceptions.h"
+#include "motioncam/AsyncFile.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+
+namespace motioncam {
+    namespace {
+        const char HEADER_MAGIC[8] = { 'M', 'C', 'R', 'A', 'W', 'B', 'I', 'N' };
+        const char FRAME_MAGIC[4]  = { 'F', 'R', 'M', 'E' };
+        const char FOOTER_MAGIC[8] = { 'M', 'C', 'R', 'A', 'W', 'E', 'N', 'D' };
+
+        const uint32_t VERSION = 3;
+        const uint32_t MIN_VERSION = 2;
+        const uint64_t ALIGNMENT = 4096;
+
+        // Sanity limit when reading lens shading maps
+        const int32_t MAX_LENS_SHADING_MAP_SIZE = 256;
+
+        enum Flags : uint32_t {
+            COMPRESSED              = 1 << 0,
+            COLOR_MATRIX1           = 1 << 1,
+            COLOR_MATRIX2           = 1 << 2,
+            CALIBRATION_MATRIX1     = 1 << 3,
+            CALIBRATION_MATRIX2     = 1 << 4,
+            FORWARD_MATRIX1         = 1 << 5,
+            FORWARD_MATRIX2         = 1 << 6
+        };
+
+#pragma pack(push, 1)
+        struct FileHeader {
+            char magic[8];
+            uint32_t version;
+            uint32_t isHdr;
+            int64_t referenceTimestamp;
+            uint64_t metadataOffset;
+            uint64_t metadataLength;
+            uint64_t firstFrameOffset;
+        };
+
+        // Followed by apertures, focal lengths, the post processing settings as JSON and, since version 3,
+        // a PreviewHeader
+        struct CameraMetadataHeader {
+            uint32_t flags;
+            int32_t sensorArrangment;
+            int32_t colorIlluminant1;
+            int32_t colorIlluminant2;
+            int32_t whiteLevel;
+            uint32_t numBlackLevels;
+            int32_t blackLevel[4];
+            float colorMatrix1[9];
+            float colorMatrix2[9];
+            float calibrationMatrix1[9];
+            float calibrationMatrix2[9];
+            float forwardMatrix1[9];
+            float forwardMatrix2[9];
+            uint32_t numApertures;
+            uint32_t numFocalLengths;
+            uint32_t settingsLength;
+        };
+
+        // Where the preview JPEG and the frame proxies are, followed by numProxies ProxyHeaders
+        struct PreviewHeader {
+            uint64_t previewOffset;
+            uint64_t previewLength;
+            uint64_t proxyTableOffset;
+            uint32_t numProxies;
+            uint32_t reserved;
+        };
+
+        struct ProxyHeader {
+            int64_t timestampNs;
+            int32_t width;
+            int32_t height;
+            uint64_t dataOffset;
+        };
+
+        // Followed by four lens shading maps
+        struct FrameHeader {
+            char magic[4];
+            uint32_t flags;
+            uint64_t dataOffset;
+            uint64_t dataLength;
+            int64_t timestampNs;
+            int64_t exposureTime;
+            int32_t width;
+            int32_t height;
+            int32_t rowStride;
+            int32_t pixelFormat;
+            int32_t rawType;
+            int32_t iso;
+            int32_t exposureCompensation;
+            int32_t screenOrientation;
+            float asShot[3];
+            float colorMatrix1[9];
+            float colorMatrix2[9];
+            float calibrationMatrix1[9];
+            float calibrationMatrix2[9];
+            float forwardMatrix1[9];
+            float forwardMatrix2[9];
+            int32_t lensShadingMapWidth;
+            int32_t lensShadingMapHeight;
+        };
+
+        struct Footer {
+            uint64_t frameTableOffset;
+            uint64_t frameTableLength;
+            uint32_t numFrames;
+            uint32_t reserved;
+            char magic[8];
+        };
+#pragma pack(pop)
+
+        uint64_t align(uint64_t offset) {
+            return (offset + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+        }
+
+        uint32_t packMatrix(const cv::Mat& m, float* output, uint32_t flag) {
+            if(m.empty())
+                return 0;
+
+            for(int y = 0; y < 3; y++)
+                for(int x = 0; x < 3; x++)
+                    output[y*3 + x] = m.at<float>(y, x);
+
+            return flag;
+        }
+
+        cv::Mat unpackMatrix(const float* input, uint32_t flags, uint32_t flag) {
+            if((flags & flag) == 0)
+                return cv::Mat();
+
+            cv::Mat m(3, 3, CV_32F);
+
+            for(int y = 0; y < 3; y++)
+                for(int x = 0; x < 3; x++)
+                    m.at<float>(y, x) = input[y*3 + x];
+
+            return m;
+        }
+
+        size_t lensShadingMapLength(const FrameHeader& header) {
+            return 4 * static_cast<size_t>(header.lensShadingMapWidth) * static_cast<size_t>(header.lensShadingMapHeight) * sizeof(float);
+        }
+    }
+
+    //
+    // Writer
+    //
+
+    BinaryContainerWriter::BinaryContainerWriter(const std::string& outputPath) :
+        mFile(std::make_unique<util::AsyncFile>(outputPath)),
+        mStarted(false),
+        mFinished(false),
+        mNumFrames(0)
+    {
+    }
+
+    BinaryContainerWriter::~BinaryContainerWriter() {
+        if(mStarted && !mFinished) {
+            try {
+                finish();
+            }
+            catch(...) {
+                // Frames written so far can still be recovered
+            }
+        }
+    }
+
+    void BinaryContainerWriter::write(const void* data, size_t len) {
+        mFile->write(data, len);
+    }
+
+    void BinaryContainerWriter::pad() {
+        static const uint8_t zeros[ALIGNMENT] = { 0 };
+
+        size_t padding = static_cast<size_t>(align(mFile->offset()) - mFile->offset());
+        if(padding > 0)
+            write(zeros, padding);
+    }
+
+    void BinaryContainerWriter::begin(const RawCameraMetadata& cameraMetadata,
+                                      const PostProcessSettings& postProcessSettings,
+                                      const int64_t referenceTimestamp,
+                                      const bool isHdr,
+                                      const std::vector<uint8_t>& preview,
+                                      const std::vector<std::shared_ptr<RawFrameProxy>>& proxies)
+    {
+        if(mStarted) {
+            throw InvalidState("Container already started");
+        }
+
+        std::string settings = postProcessSettings.toJson().dump();
+
+        CameraMetadataHeader metadata;
+        std::memset(&metadata, 0, sizeof(metadata));
+
+        metadata.sensorArrangment   = static_cast<int32_t>(cameraMetadata.sensorArrangment);
+        metadata.colorIlluminant1   = static_cast<int32_t>(cameraMetadata.colorIlluminant1);
+        metadata.colorIlluminant2   = static_cast<int32_t>(cameraMetadata.colorIlluminant2);
+        metadata.whiteLevel         = cameraMetadata.whiteLevel;
+        metadata.numBlackLevels     = static_cast<uint32_t>(std::min<size_t>(4, cameraMetadata.blackLevel.size()));
+
+        for(uint32_t i = 0; i < metadata.numBlackLevels; i++)
+            metadata.blackLevel[i] = cameraMetadata.blackLevel[i];
+
+        metadata.flags |= packMatrix(cameraMetadata.colorMatrix1, metadata.colorMatrix1, COLOR_MATRIX1);
+        metadata.flags |= packMatrix(cameraMetadata.colorMatrix2, metadata.colorMatrix2, COLOR_MATRIX2);
+        metadata.flags |= packMatrix(cameraMetadata.calibrationMatrix1, metadata.calibrationMatrix1, CALIBRATION_MATRIX1);
+        metadata.flags |= packMatrix(cameraMetadata.calibrationMatrix2, metadata.calibrationMatrix2, CALIBRATION_MATRIX2);
+        metadata.flags |= packMatrix(cameraMetadata.forwardMatrix1, metadata.forwardMatrix1, FORWARD_MATRIX1);
+        metadata.flags |= packMatrix(cameraMetadata.forwardMatrix2, metadata.forwardMatrix2, FORWARD_MATRIX2);
+
+        metadata.numApertures       = static_cast<uint32_t>(cameraMetadata.apertures.size());
+        metadata.numFocalLengths    = static_cast<uint32_t>(cameraMetadata.focalLengths.size());
+        metadata.settingsLength     = static_cast<uint32_t>(settings.size());
+
+        FileHeader header;
+        std::memset(&header, 0, sizeof(header));
+
+        std::memcpy(header.magic, HEADER_MAGIC, sizeof(HEADER_MAGIC));
+
+        header.version              = VERSION;
+        header.isHdr                = isHdr ? 1 : 0;
+        header.referenceTimestamp   = referenceTimestamp;
+        header.metadataOffset       = sizeof(FileHeader);
+        header.metadataLength       =
+            sizeof(CameraMetadataHeader) +
+            (metadata.numApertures + metadata.numFocalLengths) * sizeof(float) +
+            settings.size() +
+            sizeof(PreviewHeader);
+
+        // The preview and proxies go between the metadata and the first frame
+        PreviewHeader previewHeader;
+        std::memset(&previewHeader, 0, sizeof(previewHeader));
+
+        previewHeader.previewOffset     = header.metadataOffset + header.metadataLength;
+        previewHeader.previewLength     = preview.size();
+        previewHeader.proxyTableOffset  = previewHeader.previewOffset + previewHeader.previewLength;
+        previewHeader.numProxies        = static_cast<uint32_t>(proxies.size());
+
+        std::vector<ProxyHeader> proxyTable(proxies.size());
+        uint64_t proxyOffset = previewHeader.proxyTableOffset + proxyTable.size() * sizeof(ProxyHeader);
+
+        for(size_t i = 0; i < proxies.size(); i++) {
+            const auto& proxy = *proxies[i];
+
+            if(proxy.width <= 0 || proxy.height <= 0 || proxy.data.size() != static_cast<size_t>(proxy.width) * proxy.height) {
+                throw InvalidState("Invalid frame proxy");
+            }
+
+            proxyTable[i].timestampNs   = proxy.timestampNs;
+            proxyTable[i].width         = proxy.width;
+            proxyTable[i].height        = proxy.height;
+            proxyTable[i].dataOffset    = proxyOffset;
+
+            proxyOffset += proxy.data.size();
+        }
+
+        header.firstFrameOffset     = align(proxyOffset);
+
+        mStarted = true;
+
+        write(&header, sizeof(header));
+        write(&metadata, sizeof(metadata));
+        write(cameraMetadata.apertures.data(), cameraMetadata.apertures.size() * sizeof(float));
+        write(cameraMetadata.focalLengths.data(), cameraMetadata.focalLengths.size() * sizeof(float));
+        write(settings.data(), settings.size());
+        write(&previewHeader, sizeof(previewHeader));
+
+        write(preview.data(), preview.size());
+        write(proxyTable.data(), proxyTable.size() * sizeof(ProxyHeader));
+
+        for(auto& proxy : proxies)
+            write(proxy->data.data(), proxy->data.size());
+
+        pad();
+    }
+
+    void BinaryContainerWriter::appendFrame(RawImageBuffer& frame) {
+        appendFrame(frame, frame.data->lock(false), frame.data->len(), false);
+        frame.data->unlock();
+    }
+
+    void BinaryContainerWriter::appendFrame(const RawImageBuffer& frame, const uint8_t* data, const size_t len, const bool isCompressed) {
+        if(!mStarted || mFinished) {
+            throw InvalidState("Container not started or already finished");
+        }
+
+        FrameHeader header;
+        std::memset(&header, 0, sizeof(header));
+
+        std::memcpy(header.magic, FRAME_MAGIC, sizeof(FRAME_MAGIC));
+
+        header.flags                = isCompressed ? COMPRESSED : 0;
+        header.dataLength           = len;
+        header.timestampNs          = frame.metadata.timestampNs;
+        header.exposureTime         = frame.metadata.exposureTime;
+        header.width                = frame.width;
+        header.height               = frame.height;
+        header.rowStride            = frame.rowStride;
+        header.pixelFormat          = static_cast<int32_t>(frame.pixelFormat);
+        header.rawType              = static_cast<int32_t>(frame.metadata.rawType);
+        header.iso                  = frame.metadata.iso;
+        header.exposureCompensation = frame.metadata.exposureCompensation;
+        header.screenOrientation    = static_cast<int32_t>(frame.metadata.screenOrientation);
+
+        header.asShot[0] = frame.metadata.asShot[0];
+        header.asShot[1] = frame.metadata.asShot[1];
+        header.asShot[2] = frame.metadata.asShot[2];
+
+        header.flags |= packMatrix(frame.metadata.colorMatrix1, header.colorMatrix1, COLOR_MATRIX1);
+        header.flags |= packMatrix(frame.metadata.colorMatrix2, header.colorMatrix2, COLOR_MATRIX2);
+        header.flags |= packMatrix(frame.metadata.calibrationMatrix1, header.calibrationMatrix1, CALIBRATION_MATRIX1);
+        header.flags |= packMatrix(frame.metadata.calibrationMatrix2, header.calibrationMatrix2, CALIBRATION_MATRIX2);
+        header.flags |= packMatrix(frame.metadata.forwardMatrix1, header.forwardMatrix1, FORWARD_MATRIX1);
+        header.flags |= packMatrix(frame.metadata.forwardMatrix2, header.forwardMatrix2, FORWARD_MATRIX2);
+
+        std::vector<float> lensShadingMap;
+
+        if(frame.metadata.lensShadingMap.size() == 4) {
+            header.lensShadingMapWidth  = frame.metadata.lensShadingMap[0].cols;
+            header.lensShadingMapHeight = frame.metadata.lensShadingMap[0].rows;
+
+            lensShadingMap.reserve(4 * header.lensShadingMapWidth * header.lensShadingMapHeight);
+
+            for(auto& m : frame.metadata.lensShadingMap) {
+                for(int y = 0; y < header.lensShadingMapHeight; y++)
+                    for(int x = 0; x < header.lensShadingMapWidth; x++)
+                        lensShadingMap.push_back(m.at<float>(y, x));
+            }
+        }
+
+        size_t recordLength = sizeof(FrameHeader) + lensShadingMap.size() * sizeof(float);
+
+        header.dataOffset = align(mFile->offset() + recordLength);
+
+        // Write the header followed by the data
+        write(&header, sizeof(header));
+        write(lensShadingMap.data(), lensShadingMap.size() * sizeof(float));
+
+        pad();
+
+        write(data, len);
+
+        pad();
+
+        // Keep a copy for the frame table
+        auto* record = reinterpret_cast<const uint8_t*>(&header);
+
+        mFrameTable.insert(mFrameTable.end(), record, record + sizeof(header));
+        mFrameTable.insert(mFrameTable.end(),
+                           reinterpret_cast<const uint8_t*>(lensShadingMap.data()),
+                           reinterpret_cast<const uint8_t*>(lensShadingMap.data() + lensShadingMap.size()));
+
+        ++mNumFrames;
+    }
+
+    void BinaryContainerWriter::finish() {
+        if(!mStarted || mFinished) {
+            throw InvalidState("Container not started or already finished");
+        }
+
+        mFinished = true;
+
+        Footer footer;
+        std::memset(&footer, 0, sizeof(footer));
+
+        footer.frameTableOffset = mFile->offset();
+        footer.frameTableLength = mFrameTable.size();
+        footer.numFrames        = mNumFrames;
+
+        std::memcpy(footer.magic, FOOTER_MAGIC, sizeof(FOOTER_MAGIC));
+
+        write(mFrameTable.data(), mFrameTable.size());
+        write(&footer, sizeof(footer));
+
+        mFrameTable.clear();
+        mFrameTable.shrink_to_fit();
+
+        mFile->close();
+    }
+
+    //
+    // Reader
+    //
+
+    bool BinaryContainerReader::isBinaryContainer(const std::string& inputPath) {
+        int fd = open(inputPath.c_str(), O_RDONLY);
+        if(fd < 0)
+            return false;
+
+        char magic[sizeof(HEADER_MAGIC)];
+        bool result = pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && std::memcmp(magic, HEADER_MAGIC, sizeof(magic)) == 0;
+
+        close(fd);
+
+        return result;
+    }
+
+    BinaryContainerReader::BinaryContainerReader(const std::string& inputPath, const bool metadataOnly) :
+        mInputPath(inputPath),
+        mFd(-1),
+        mMetadataOnly(metadataOnly),
+        mFirstFrameOffset(0),
+        mReferenceTimestamp(-1),
+        mIsHdr(false),
+        mPreviewOffset(0),
+        mPreviewLength(0)
+    {
+        mFd = open(inputPath.c_str(), O_RDONLY);
+        if(mFd < 0) {
+            throw IOException("Can't read " + inputPath);
+        }
+
+        struct stat fileStat;
+        if(fstat(mFd, &fileStat) != 0) {
+            close(mFd);
+            throw IOException("Can't stat " + inputPath);
+        }
+
+        const uint64_t fileSize = static_cast<uint64_t>(fileStat.st_size);
+
+        try {
+            FileHeader header;
+            read(0, &header, sizeof(header));
+
+            if(std::memcmp(header.magic, HEADER_MAGIC, sizeof(HEADER_MAGIC)) != 0 || header.version < MIN_VERSION || header.version > VERSION) {
+                throw IOException("Invalid container " + inputPath);
+            }
+
+            if(header.metadataLength < sizeof(CameraMetadataHeader) || header.metadataOffset + header.metadataLength > fileSize) {
+                throw IOException("Invalid metadata in " + inputPath);
+            }
+
+            mReferenceTimestamp = header.referenceTimestamp;
+            mIsHdr = header.isHdr != 0;
+            mFirstFrameOffset = header.firstFrameOffset;
+
+            // Camera metadata
+            std::vector<uint8_t> metadataBuffer(header.metadataLength);
+            read(header.metadataOffset, metadataBuffer.data(), metadataBuffer.size());
+
+            CameraMetadataHeader metadata;
+            std::memcpy(&metadata, metadataBuffer.data(), sizeof(metadata));
+
+            size_t expectedLength =
+                sizeof(metadata) + (static_cast<size_t>(metadata.numApertures) + metadata.numFocalLengths) * sizeof(float) + metadata.settingsLength;
+
+            const size_t previewHeaderLength = header.version >= 3 ? sizeof(PreviewHeader) : 0;
+
+            if(expectedLength + previewHeaderLength != metadataBuffer.size() || metadata.numBlackLevels > 4) {
+                throw IOException("Invalid metadata in " + inputPath);
+            }
+
+            mCameraMetadata.sensorArrangment    = static_cast<ColorFilterArrangment>(metadata.sensorArrangment);
+            mCameraMetadata.colorIlluminant1    = static_cast<color::Illuminant>(metadata.colorIlluminant1);
+            mCameraMetadata.colorIlluminant2    = static_cast<color::Illuminant>(metadata.colorIlluminant2);
+            mCameraMetadata.whiteLevel          = metadata.whiteLevel;
+            mCameraMetadata.blackLevel.assign(metadata.blackLevel, metadata.blackLevel + metadata.numBlackLevels);
+
+            if(!mMetadataOnly) {
+                mCameraMetadata.colorMatrix1        = unpackMatrix(metadata.colorMatrix1, metadata.flags, COLOR_MATRIX1);
+                mCameraMetadata.colorMatrix2        = unpackMatrix(metadata.colorMatrix2, metadata.flags, COLOR_MATRIX2);
+                mCameraMetadata.calibrationMatrix1  = unpackMatrix(metadata.calibrationMatrix1, metadata.flags, CALIBRATION_MATRIX1);
+                mCameraMetadata.calibrationMatrix2  = unpackMatrix(metadata.calibrationMatrix2, metadata.flags, CALIBRATION_MATRIX2);
+                mCameraMetadata.forwardMatrix1      = unpackMatrix(metadata.forwardMatrix1, metadata.flags, FORWARD_MATRIX1);
+                mCameraMetadata.forwardMatrix2      = unpackMatrix(metadata.forwardMatrix2, metadata.flags, FORWARD_MATRIX2);
+            }
+
+            const float* values = reinterpret_cast<const float*>(metadataBuffer.data() + sizeof(metadata));
+
+            mCameraMetadata.apertures.assign(values, values + metadata.numApertures);
+            values += metadata.numApertures;
+
+            mCameraMetadata.focalLengths.assign(values, values + metadata.numFocalLengths);
+            values += metadata.numFocalLengths;
+
+            std::string err;
+            std::string settings(reinterpret_cast<const char*>(values), metadata.settingsLength);
+
+            json11::Json settingsJson = json11::Json::parse(settings, err);
+            if(!err.empty()) {
+                throw IOException("Cannot parse settings in " + inputPath);
+            }
+
+            mPostProcessSettings = PostProcessSettings(settingsJson);
+
+            if(previewHeaderLength > 0)
+                readPreviewTable(metadataBuffer.data() + expectedLength, previewHeaderLength, fileSize);
+
+            // Use the frame table if the container was finished, otherwise recover what we can
+            if(!readFrameTable(fileSize))
+                scanFrames(fileSize);
+        }
+        catch(...) {
+            close(mFd);
+            throw;
+        }
+    }
+
+    BinaryContainerReader::~BinaryContainerReader() {
+        if(mFd >= 0)
+            close(mFd);
+    }
+
+    void BinaryContainerReader::read(uint64_t offset, void* output, size_t len) const {
+        auto* dst = static_cast<uint8_t*>(output);
+
+        while(len > 0) {
+            ssize_t result = pread(mFd, dst, len, static_cast<off_t>(offset));
+            if(result < 0 && errno == EINTR)
+                continue;
+
+            if(result <= 0) {
+                throw IOException("Failed to read " + mInputPath);
+            }
+
+            dst += result;
+            offset += result;
+            len -= result;
+        }
+    }
+
+    void BinaryContainerReader::readPreviewTable(const uint8_t* data, size_t len, uint64_t fileSize) {
+        PreviewHeader previewHeader;
+        std::memcpy(&previewHeader, data, std::min(len, sizeof(previewHeader)));
+
+        // Ignore anything that doesn't fit, the frames can still be read
+        if(previewHeader.previewOffset + previewHeader.previewLength <= fileSize) {
+            mPreviewOffset = previewHeader.previewOffset;
+            mPreviewLength = previewHeader.previewLength;
+        }
+
+        const uint64_t proxyTableLength = static_cast<uint64_t>(previewHeader.numProxies) * sizeof(ProxyHeader);
+
+        if(previewHeader.numProxies == 0 || previewHeader.proxyTableOffset + proxyTableLength > fileSize)
+            return;
+
+        std::vector<ProxyHeader> proxyTable(previewHeader.numProxies);
+        read(previewHeader.proxyTableOffset, proxyTable.data(), proxyTableLength);
+
+        for(auto& proxy : proxyTable) {
+            const uint64_t length = static_cast<uint64_t>(proxy.width) * static_cast<uint64_t>(proxy.height);
+
+            if(proxy.width <= 0 || proxy.height <= 0 || proxy.dataOffset + length > fileSize)
+                continue;
+
+            mProxies[proxy.timestampNs] = { proxy.width, proxy.height, proxy.dataOffset };
+        }
+    }
+
+    bool BinaryContainerReader::readPreview(std::vector<uint8_t>& output) const {
+        if(mPreviewLength == 0)
+            return false;
+
+        output.resize(mPreviewLength);
+        read(mPreviewOffset, output.data(), output.size());
+
+        return true;
+    }
+
+    std::shared_ptr<RawFrameProxy> BinaryContainerReader::readFrameProxy(const int64_t timestampNs) const {
+        auto it = mProxies.find(timestampNs);
+        if(it == mProxies.end())
+            return nullptr;
+
+        auto proxy = std::make_shared<RawFrameProxy>();
+
+        proxy->timestampNs  = timestampNs;
+        proxy->width        = it->second.width;
+        proxy->height       = it->second.height;
+        proxy->data.resize(static_cast<size_t>(proxy->width) * proxy->height);
+
+        read(it->second.offset, proxy->data.data(), proxy->data.size());
+
+        return proxy;
+    }
+
+    size_t BinaryContainerReader::parseFrame(const uint8_t* data, size_t len, uint64_t fileSize) {
+        FrameHeader header;
+
+        if(len < sizeof(header))
+            return 0;
+
+        std::memcpy(&header, data, sizeof(header));
+
+        if(std::memcmp(header.magic, FRAME_MAGIC, sizeof(FRAME_MAGIC)) != 0)
+            return 0;
+
+        if(header.lensShadingMapWidth < 0 || header.lensShadingMapWidth > MAX_LENS_SHADING_MAP_SIZE ||
+           header.lensShadingMapHeight < 0 || header.lensShadingMapHeight > MAX_LENS_SHADING_MAP_SIZE)
+        {
+            return 0;
+        }
+
+        size_t recordLength = sizeof(header) + lensShadingMapLength(header);
+
+        if(len < recordLength || header.dataOffset + header.dataLength > fileSize)
+            return 0;
+
+        auto buffer = std::make_shared<RawImageBuffer>();
+
+        buffer->width                           = header.width;
+        buffer->height                          = header.height;
+        buffer->rowStride                       = header.rowStride;
+        buffer->pixelFormat                     = static_cast<PixelFormat>(header.pixelFormat);
+        buffer->isCompressed                    = (header.flags & COMPRESSED) != 0;
+
+        buffer->metadata.timestampNs            = header.timestampNs;
+        buffer->metadata.exposureTime           = header.exposureTime;
+        buffer->metadata.rawType                = static_cast<RawType>(header.rawType);
+        buffer->metadata.iso                    = header.iso;
+        buffer->metadata.exposureCompensation   = header.exposureCompensation;
+        buffer->metadata.screenOrientation      = static_cast<ScreenOrientation>(header.screenOrientation);
+        buffer->metadata.asShot                 = cv::Vec3f(header.asShot[0], header.asShot[1], header.asShot[2]);
+
+        // Colour matrices and lens shading map
+        if(!mMetadataOnly) {
+            buffer->metadata.colorMatrix1           = unpackMatrix(header.colorMatrix1, header.flags, COLOR_MATRIX1);
+            buffer->metadata.colorMatrix2           = unpackMatrix(header.colorMatrix2, header.flags, COLOR_MATRIX2);
+            buffer->metadata.calibrationMatrix1     = unpackMatrix(header.calibrationMatrix1, header.flags, CALIBRATION_MATRIX1);
+            buffer->metadata.calibrationMatrix2     = unpackMatrix(header.calibrationMatrix2, header.flags, CALIBRATION_MATRIX2);
+            buffer->metadata.forwardMatrix1         = unpackMatrix(header.forwardMatrix1, header.flags, FORWARD_MATRIX1);
+            buffer->metadata.forwardMatrix2         = unpackMatrix(header.forwardMatrix2, header.flags, FORWARD_MATRIX2);
+
+            // Lens shading map, use a flat map if it's missing
+            const int width = header.lensShadingMapWidth;
+            const int height = header.lensShadingMapHeight;
+
+            if(width < 4 || height < 4) {
+                for(int i = 0; i < 4; i++)
+                    buffer->metadata.lensShadingMap.push_back(cv::Mat(12, 16, CV_32F, cv::Scalar(1)));
+            }
+            else {
+                const uint8_t* points = data + sizeof(header);
+
+                for(int i = 0; i < 4; i++) {
+                    cv::Mat m(height, width, CV_32F);
+
+                    for(int y = 0; y < height; y++) {
+                        std::memcpy(m.ptr<float>(y), points, width * sizeof(float));
+                        points += width * sizeof(float);
+                    }
+
+                    buffer->metadata.lensShadingMap.push_back(m);
+                }
+            }
+        }
+
+        mFrames.push_back(buffer);
+        mFrameData.emplace_back(header.dataOffset, static_cast<size_t>(header.dataLength));
+
+        return recordLength;
+    }
+
+    bool BinaryContainerReader::readFrameTable(uint64_t fileSize) {
+        Footer footer;
+
+        if(fileSize < mFirstFrameOffset + sizeof(footer))
+            return false;
+
+        read(fileSize - sizeof(footer), &footer, sizeof(footer));
+
+        if(std::memcmp(footer.magic, FOOTER_MAGIC, sizeof(FOOTER_MAGIC)) != 0 ||
+           footer.frameTableOffset + footer.frameTableLength + sizeof(footer) != fileSize)
+        {
+            return false;
+        }
+
+        std::vector<uint8_t> frameTable(footer.frameTableLength);
+        read(footer.frameTableOffset, frameTable.data(), frameTable.size());
+
+        size_t pos = 0;
+
+        for(uint32_t i = 0; i < footer.numFrames; i++) {
+            size_t recordLength = parseFrame(frameTable.data() + pos, frameTable.size() - pos, fileSize);
+            if(recordLength == 0) {
+                mFrames.clear();
+                mFrameData.clear();
+
+                return false;
+            }
+
+            pos += recordLength;
+        }
+
+        return true;
+    }
+
+    void BinaryContainerReader::scanFrames(uint64_t fileSize) {
+        uint64_t offset = mFirstFrameOffset;
+        std::vector<uint8_t> record;
+
+        while(offset + sizeof(FrameHeader) <= fileSize) {
+            FrameHeader header;
+            read(offset, &header, sizeof(header));
+
+            if(std::memcmp(header.magic, FRAME_MAGIC, sizeof(FRAME_MAGIC)) != 0 ||
+               header.lensShadingMapWidth < 0 || header.lensShadingMapWidth > MAX_LENS_SHADING_MAP_SIZE ||
+               header.lensShadingMapHeight < 0 || header.lensShadingMapHeight > MAX_LENS_SHADING_MAP_SIZE)
+            {
+                break;
+            }
+
+            record.resize(sizeof(header) + lensShadingMapLength(header));
+
+            if(offset + record.size() > fileSize)
+                break;
+
+            read(offset, record.data(), record.size());
+
+            // Stop at the first incomplete frame
+            if(parseFrame(record.data(), record.size(), fileSize) == 0)
+                break;
+
+            offset = align(header.dataOffset + header.dataLength);
+        }
+    }
+
+    uint64_t BinaryContainerReader::getFrameOffset(size_t frame) const {
+        return mFrameData.at(frame).first;
+    }
+
+    size_t BinaryContainerReader::getFrameLength(size_t frame) const {
+        return mFrameData.at(frame).second;
+    }
+
+    void BinaryContainerReader::readFrame(size_t frame, std::vector<uint8_t>& output) const {
+        output.resize(getFrameLength(frame));
+        read(getFrameOffset(frame), output.data(), output.size());
+    }
+}
@@ -10,6 +10,9 @@
 #include "camera_preview2_raw16.h"
 #include "camera_preview3_raw16.h"
 #include "camera_preview4_raw16.h"
+#include "camera_preview2_raw12.h"
+#include "camera_preview3_raw12.h"
+#include "camera_preview4_raw12.h"
 
 namespace motioncam {
     void CameraPreview::generate(const RawImageBuffer& rawBuffer,
@@ -88,6 +91,16 @@ namespace motioncam {
             else
                 return;
         }
+        else if(rawBuffer.pixelFormat == PixelFormat::RAW12) {
+            if(downscaleFactor == 2)
+                camera_preview = &camera_preview2_raw12;
+            else if(downscaleFactor == 3)
+                camera_preview = &camera_preview3_raw12;
+            else if(downscaleFactor == 4)
+                camera_preview = &camera_preview4_raw12;
+            else
+                return;
+        }
         else
             return;
                 
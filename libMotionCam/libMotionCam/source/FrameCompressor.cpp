@@ -0,0 +1,139 @@
+#include "motioncam/FrameCompressor.h"
+#include "motioncam/RawImageMetadata.h"
+#include "motioncam/RawCodec.h"
+
+#include <chrono>
+#include <algorithm>
+
+namespace motioncam {
+
+    FrameCompressor::FrameCompressor(const std::vector<std::shared_ptr<RawImageBuffer>>& frames,
+                                     const int numThreads,
+                                     const int maxPending) :
+        mFrames(frames),
+        mCompressed(frames.size()),
+        mErrors(frames.size()),
+        mIsCompressed(frames.size(), false),
+        mReady(frames.size(), false),
+        mNextCompress(0),
+        mNextReturn(0),
+        mStop(false),
+        mStallTimeMs(0)
+    {
+        int threads = numThreads > 0 ? numThreads : defaultThreads();
+
+        threads = std::max(1, std::min(threads, static_cast<int>(frames.size())));
+
+        // Enough to keep every thread busy while the writer catches up
+        mMaxPending = maxPending > 0 ? maxPending : threads + 1;
+
+        for(int i = 0; i < threads; i++)
+            mThreads.emplace_back(&FrameCompressor::compressFrames, this);
+    }
+
+    FrameCompressor::~FrameCompressor() {
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            mStop = true;
+        }
+
+        mCv.notify_all();
+
+        for(auto& thread : mThreads)
+            thread.join();
+    }
+
+    int FrameCompressor::defaultThreads() {
+        return std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    }
+
+    bool FrameCompressor::compressFrame(RawImageBuffer& frame, std::vector<uint8_t>& output) {
+        if(!codec::canEncode(frame.pixelFormat, frame.width, frame.height, frame.rowStride, frame.data->len()))
+            return false;
+
+        bool result = codec::encode(
+            frame.data->lock(false), frame.data->len(), frame.pixelFormat, frame.width, frame.height, frame.rowStride, output);
+
+        frame.data->unlock();
+
+        return result;
+    }
+
+    void FrameCompressor::compressFrames() {
+        std::unique_lock<std::mutex> lock(mLock);
+
+        while(true) {
+            mCv.wait(lock, [&] {
+                return mStop || mNextCompress >= mFrames.size() || mNextCompress < mNextReturn + mMaxPending;
+            });
+
+            if(mStop || mNextCompress >= mFrames.size())
+                break;
+
+            size_t idx = mNextCompress++;
+
+            lock.unlock();
+
+            std::vector<uint8_t> output;
+            std::exception_ptr error;
+            bool isCompressed = false;
+
+            try {
+                isCompressed = compressFrame(*mFrames[idx], output);
+            }
+            catch(...) {
+                error = std::current_exception();
+            }
+
+            if(!isCompressed)
+                output.clear();
+
+            lock.lock();
+
+            mCompressed[idx] = std::move(output);
+            mErrors[idx] = error;
+            mIsCompressed[idx] = isCompressed;
+            mReady[idx] = true;
+
+            mCv.notify_all();
+        }
+    }
+
+    bool FrameCompressor::next(std::shared_ptr<RawImageBuffer>& frame, std::vector<uint8_t>& data, bool& isCompressed) {
+        std::unique_lock<std::mutex> lock(mLock);
+
+        if(mNextReturn >= mFrames.size())
+            return false;
+
+        size_t idx = mNextReturn;
+
+        if(!mReady[idx]) {
+            auto start = std::chrono::steady_clock::now();
+
+            mCv.wait(lock, [&] { return static_cast<bool>(mReady[idx]); });
+
+            mStallTimeMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        frame = mFrames[idx];
+        data = std::move(mCompressed[idx]);
+        isCompressed = mIsCompressed[idx];
+
+        auto error = mErrors[idx];
+
+        ++mNextReturn;
+
+        // Let the workers move on to the next frame
+        mCv.notify_all();
+
+        if(error)
+            std::rethrow_exception(error);
+
+        return true;
+    }
+
+    double FrameCompressor::stallTimeMs() const {
+        std::lock_guard<std::mutex> lock(mLock);
+        return mStallTimeMs;
+    }
+}
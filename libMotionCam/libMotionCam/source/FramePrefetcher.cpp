@@ -0,0 +1,112 @@
+#include "motioncam/FramePrefetcher.h"
+#include "motioncam/RawContainer.h"
+
+#include <chrono>
+#include <algorithm>
+
+namespace motioncam {
+
+    FramePrefetcher::FramePrefetcher(const RawContainer& rawContainer,
+                                     const std::vector<std::string>& frames,
+                                     const int maxPrefetch,
+                                     const int numThreads) :
+        mRawContainer(rawContainer),
+        mFrames(frames),
+        mMaxPrefetch(std::max(1, maxPrefetch)),
+        mLoaded(frames.size()),
+        mErrors(frames.size()),
+        mReady(frames.size(), false),
+        mNextLoad(0),
+        mNextReturn(0),
+        mStop(false),
+        mStallTimeMs(0)
+    {
+        // No point having more threads than frames we are allowed to load ahead
+        int threads = std::max(1, std::min(numThreads, maxPrefetch));
+
+        for(int i = 0; i < threads; i++)
+            mThreads.emplace_back(&FramePrefetcher::loadFrames, this);
+    }
+
+    FramePrefetcher::~FramePrefetcher() {
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            mStop = true;
+        }
+
+        mCv.notify_all();
+
+        for(auto& thread : mThreads)
+            thread.join();
+    }
+
+    void FramePrefetcher::loadFrames() {
+        std::unique_lock<std::mutex> lock(mLock);
+
+        while(true) {
+            mCv.wait(lock, [&] {
+                return mStop || mNextLoad >= mFrames.size() || mNextLoad < mNextReturn + mMaxPrefetch;
+            });
+
+            if(mStop || mNextLoad >= mFrames.size())
+                break;
+
+            size_t idx = mNextLoad++;
+
+            lock.unlock();
+
+            std::shared_ptr<RawImageBuffer> frame;
+            std::exception_ptr error;
+
+            try {
+                frame = mRawContainer.loadFrame(mFrames[idx]);
+            }
+            catch(...) {
+                error = std::current_exception();
+            }
+
+            lock.lock();
+
+            mLoaded[idx] = frame;
+            mErrors[idx] = error;
+            mReady[idx] = true;
+
+            mCv.notify_all();
+        }
+    }
+
+    std::shared_ptr<RawImageBuffer> FramePrefetcher::next() {
+        std::unique_lock<std::mutex> lock(mLock);
+
+        if(mNextReturn >= mFrames.size())
+            return nullptr;
+
+        size_t idx = mNextReturn;
+
+        if(!mReady[idx]) {
+            auto start = std::chrono::steady_clock::now();
+
+            mCv.wait(lock, [&] { return static_cast<bool>(mReady[idx]); });
+
+            mStallTimeMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        auto frame = std::move(mLoaded[idx]);
+        auto error = mErrors[idx];
+
+        ++mNextReturn;
+
+        // Let the loaders move on to the next frame
+        mCv.notify_all();
+
+        if(error)
+            std::rethrow_exception(error);
+
+        return frame;
+    }
+
+    double FramePrefetcher::stallTimeMs() const {
+        std::lock_guard<std::mutex> lock(mLock);
+        return mStallTimeMs;
+    }
+}
@@ -0,0 +1,44 @@
+#include "motioncam/FrameScorer.h"
+
+#include <cmath>
+
+namespace motioncam {
+    namespace {
+        const float MOTION_WEIGHT = 10.0f;
+    }
+
+    FrameScorer::FrameScorer() {
+    }
+
+    void FrameScorer::reset() {
+        mPreviousBlocks.clear();
+    }
+
+    void FrameScorer::score(RawImageBuffer& frame) {
+        frame.metadata.quality = FrameQuality();
+
+        // Frames from the camera are measured as they are copied. Measuring the whole frame here would hold
+        // up the copy thread so frames without stats aren't scored.
+        const FrameStats& stats = frame.metadata.stats;
+        if(!stats.valid)
+            return;
+
+        FrameQuality& quality = frame.metadata.quality;
+
+        quality.sharpness = stats.sharpness;
+        quality.clipped = stats.clipped;
+
+        if(!stats.blocks.empty() && mPreviousBlocks.size() == stats.blocks.size()) {
+            float motion = 0;
+
+            for(size_t i = 0; i < stats.blocks.size(); i++)
+                motion += std::abs(stats.blocks[i] - mPreviousBlocks[i]);
+
+            quality.motion = motion / stats.blocks.size();
+        }
+
+        quality.score = quality.sharpness * (1.0f - quality.clipped) / (1.0f + MOTION_WEIGHT * quality.motion);
+
+        mPreviousBlocks = stats.blocks;
+    }
+}
@@ -0,0 +1,338 @@
+#include "motioncam/FrameStats.h"
+#include "motioncam/RawCodec.h"
+
+#include <cmath>
+#include <numeric>
+#include <algorithm>
+
+namespace motioncam {
+    namespace {
+        const float CLIPPED_LEVEL = 0.98f;
+
+        float defaultWhiteLevel(const PixelFormat pixelFormat) {
+            switch(pixelFormat) {
+                case PixelFormat::RAW10:
+                    return 1023;
+
+                case PixelFormat::RAW12:
+                    return 4095;
+
+                default:
+                    return 65535;
+            }
+        }
+
+        // Pixel of the quad used for red, green, green and blue. Matches rearrange() in the generators.
+        void getChannels(const ColorFilterArrangment arrangement, int* channels) {
+            static const int CHANNELS[4][4] = {
+                { 0, 1, 2, 3 },     // RGGB
+                { 1, 0, 3, 2 },     // GRBG
+                { 2, 0, 3, 1 },     // GBRG
+                { 3, 1, 2, 0 }      // BGGR
+            };
+
+            int i = static_cast<int>(arrangement);
+            if(i < 0 || i > 3)
+                i = 3;
+
+            std::copy(CHANNELS[i], CHANNELS[i] + 4, channels);
+        }
+
+        // Reads the 4 pixels starting at x, which must be a multiple of 4
+        inline void load4(const uint8_t* row, const PixelFormat pixelFormat, const int x, int* out) {
+            if(pixelFormat == PixelFormat::RAW10) {
+                const uint8_t* p = row + (x / 4) * 5;
+
+                out[0] = (p[0] << 2) | ((p[4]     ) & 0x03);
+                out[1] = (p[1] << 2) | ((p[4] >> 2) & 0x03);
+                out[2] = (p[2] << 2) | ((p[4] >> 4) & 0x03);
+                out[3] = (p[3] << 2) | ((p[4] >> 6) & 0x03);
+            }
+            else if(pixelFormat == PixelFormat::RAW12) {
+                const uint8_t* p = row + (x / 2) * 3;
+
+                out[0] = (p[0] << 4) | (p[2] & 0x0F);
+                out[1] = (p[1] << 4) | (p[2] >> 4);
+                out[2] = (p[3] << 4) | (p[5] & 0x0F);
+                out[3] = (p[4] << 4) | (p[5] >> 4);
+            }
+            else {
+                const uint8_t* p = row + x * 2;
+
+                out[0] = p[0] | (p[1] << 8);
+                out[1] = p[2] | (p[3] << 8);
+                out[2] = p[4] | (p[5] << 8);
+                out[3] = p[6] | (p[7] << 8);
+            }
+        }
+    }
+
+    FrameStatsAccumulator::FrameStatsAccumulator(const RawCameraMetadata& cameraMetadata,
+                                                 const PixelFormat pixelFormat,
+                                                 const int width,
+                                                 const int height,
+                                                 std::shared_ptr<const FrameStatsColorTransform> colorTransform) :
+        mPixelFormat(pixelFormat),
+        mQuadWidth(width / 2),
+        mQuadHeight(height / 2),
+        mValid(false),
+        mBlackLevel{0, 0, 0, 0},
+        mWhiteLevel(0),
+        mMeanBlackLevel(0),
+        mClippedLevel(0),
+        mChannels{0, 1, 2, 3},
+        mScale{0, 0, 0, 0},
+        mColorTransform(std::move(colorTransform)),
+        mNumQuads(0),
+        mChannelSums{0, 0, 0, 0},
+        mGradient(0),
+        mGradientPixels(0),
+        mClipped(0),
+        mBlockSums(BLOCKS_X * BLOCKS_Y, 0),
+        mBlockCounts(BLOCKS_X * BLOCKS_Y, 0)
+    {
+        mValid =
+            codec::rowLength(pixelFormat, width) > 0
+            && width % 4 == 0
+            && mQuadWidth >= DOWNSCALE * BLOCKS_X
+            && mQuadHeight >= DOWNSCALE * BLOCKS_Y;
+
+        if(!mValid)
+            return;
+
+        for(int i = 0; i < 4; i++) {
+            if(cameraMetadata.blackLevel.size() == 4)
+                mBlackLevel[i] = static_cast<float>(cameraMetadata.blackLevel[i]);
+            else if(!cameraMetadata.blackLevel.empty())
+                mBlackLevel[i] = static_cast<float>(cameraMetadata.blackLevel[0]);
+        }
+
+        mMeanBlackLevel = (mBlackLevel[0] + mBlackLevel[1] + mBlackLevel[2] + mBlackLevel[3]) / 4;
+        mWhiteLevel =
+            cameraMetadata.whiteLevel > 0 ? static_cast<float>(cameraMetadata.whiteLevel) : defaultWhiteLevel(pixelFormat);
+
+        mClippedLevel = static_cast<int>(mMeanBlackLevel + CLIPPED_LEVEL * (mWhiteLevel - mMeanBlackLevel));
+
+        getChannels(cameraMetadata.sensorArrangment, mChannels);
+
+        if(mColorTransform && mColorTransform->lensShadingMap.size() == 4)
+            mHistogram.resize(HISTOGRAM_BINS, 0);
+
+        for(int c = 0; c < 4; c++)
+            mScale[c] = 1.0f / std::max(1.0f, mWhiteLevel - mBlackLevel[c]);
+
+        // Block and shading map column of each sampled quad
+        const int numQuads = mQuadWidth / DOWNSCALE;
+        const int shadingWidth = mHistogram.empty() ? 0 : mColorTransform->lensShadingMap[0].cols;
+
+        mBlockX.resize(numQuads);
+        mShadingX.resize(numQuads);
+
+        for(int i = 0; i < numQuads; i++) {
+            mBlockX[i] = std::min(BLOCKS_X - 1, i * BLOCKS_X / numQuads);
+            mShadingX[i] = std::max(0, std::min(shadingWidth - 1, i * shadingWidth / numQuads));
+        }
+
+    }
+
+    bool FrameStatsAccumulator::isSampled(const int y) const {
+        if(!mValid || (y & 1) != 0)
+            return false;
+
+        const int qy = y / 2;
+
+        return qy % DOWNSCALE == 0 && qy / DOWNSCALE < mQuadHeight / DOWNSCALE;
+    }
+
+    void FrameStatsAccumulator::add(const int y, const uint8_t* row, const uint8_t* nextRow) {
+        if(!isSampled(y))
+            return;
+
+        const int qy = y / 2;
+        const int numQuads = mQuadWidth / DOWNSCALE;
+        const int blockY = std::min(BLOCKS_Y - 1, qy * BLOCKS_Y / mQuadHeight);
+
+        const float* cameraToSrgb = nullptr;
+        const float* cameraWhite = nullptr;
+        const float* shadingRows[4] = { nullptr, nullptr, nullptr, nullptr };
+
+        if(!mHistogram.empty()) {
+            cameraToSrgb = mColorTransform->cameraToSrgb;
+            cameraWhite = mColorTransform->cameraWhite;
+
+            for(int c = 0; c < 4; c++) {
+                const cv::Mat& map = mColorTransform->lensShadingMap[c];
+                const int shadingY = std::min(map.rows - 1, qy * map.rows / mQuadHeight);
+
+                shadingRows[c] = map.ptr<float>(shadingY);
+            }
+        }
+
+        // Sum in locals, the compiler can't keep members in registers across the histogram and block updates
+        int64_t channelSums[4] = { 0, 0, 0, 0 };
+        int64_t clipped = 0;
+        int64_t gradient = 0;
+
+        const int clippedLevel = mClippedLevel;
+        const int* channels = mChannels;
+        const float* blackLevel = mBlackLevel;
+        const float* scale = mScale;
+        int64_t* blockSums = mBlockSums.data() + blockY * BLOCKS_X;
+        int32_t* blockCounts = mBlockCounts.data() + blockY * BLOCKS_X;
+        uint32_t* histogram = mHistogram.data();
+
+        for(int i = 0; i < numQuads; i++) {
+            const int x = i * DOWNSCALE * 2;
+
+            // The quad and the next pixels of the same colour
+            int top[4], bottom[4];
+
+            load4(row, mPixelFormat, x, top);
+            load4(nextRow, mPixelFormat, x, bottom);
+
+            const int p[4] = { top[0], top[1], bottom[0], bottom[1] };
+
+            gradient +=
+                std::abs(top[0] - top[2]) + std::abs(top[1] - top[3]) + std::abs(bottom[0] - bottom[2]) + std::abs(bottom[1] - bottom[3]);
+
+            for(int c = 0; c < 4; c++) {
+                channelSums[c] += p[c];
+                clipped += p[c] >= clippedLevel;
+            }
+
+            blockSums[mBlockX[i]] += p[0] + p[1] + p[2] + p[3];
+            blockCounts[mBlockX[i]] += 1;
+
+            if(!cameraToSrgb)
+                continue;
+
+            const int shadingX = mShadingX[i];
+            float v[4];
+
+            for(int c = 0; c < 4; c++)
+                v[c] = (p[channels[c]] - blackLevel[c]) * scale[c] * shadingRows[c][shadingX];
+
+            const float in[3] = {
+                std::max(0.0f, std::min(v[0],               cameraWhite[0])),
+                std::max(0.0f, std::min((v[1] + v[2]) / 2,  cameraWhite[1])),
+                std::max(0.0f, std::min(v[3],               cameraWhite[2]))
+            };
+
+            float rgb[3];
+
+            for(int c = 0; c < 3; c++) {
+                const float* m = cameraToSrgb + c*3;
+                rgb[c] = std::max(0.0f, std::min(1.0f, m[0]*in[0] + m[1]*in[1] + m[2]*in[2]));
+            }
+
+            const float L = 0.2989f*rgb[0] + 0.5870f*rgb[1] + 0.1140f*rgb[2];
+            const int bin = std::max(0, std::min(HISTOGRAM_BINS - 1, static_cast<int>(L * 255 + 0.5f)));
+
+            histogram[bin]++;
+        }
+
+        for(int c = 0; c < 4; c++)
+            mChannelSums[c] += channelSums[c];
+
+        mClipped += clipped;
+        mGradient += gradient;
+        mGradientPixels += 4 * numQuads;
+        mNumQuads += numQuads;
+    }
+
+    void FrameStatsAccumulator::merge(const FrameStatsAccumulator& other) {
+        if(!mValid || !other.mValid)
+            return;
+
+        mNumQuads += other.mNumQuads;
+        mGradient += other.mGradient;
+        mGradientPixels += other.mGradientPixels;
+        mClipped += other.mClipped;
+
+        for(int c = 0; c < 4; c++)
+            mChannelSums[c] += other.mChannelSums[c];
+
+        for(size_t i = 0; i < mBlockSums.size(); i++) {
+            mBlockSums[i] += other.mBlockSums[i];
+            mBlockCounts[i] += other.mBlockCounts[i];
+        }
+
+        if(mHistogram.size() == other.mHistogram.size()) {
+            for(size_t i = 0; i < mHistogram.size(); i++)
+                mHistogram[i] += other.mHistogram[i];
+        }
+        else {
+            mHistogram.clear();
+        }
+    }
+
+    void FrameStatsAccumulator::finish(FrameStats& stats) const {
+        stats = FrameStats();
+
+        if(!mValid || mNumQuads == 0 || mGradientPixels == 0)
+            return;
+
+        for(int c = 0; c < 4; c++)
+            stats.channelMeans[c] = static_cast<float>(mChannelSums[c]) / mNumQuads;
+
+        // Relative to the mean level so the stats don't depend on exposure
+        const float meanLevel =
+            (stats.channelMeans[0] + stats.channelMeans[1] + stats.channelMeans[2] + stats.channelMeans[3]) / 4;
+
+        const float mean = std::max(1.0f, meanLevel - mMeanBlackLevel);
+
+        stats.sharpness = static_cast<float>(mGradient) / mGradientPixels / mean;
+        stats.clipped = static_cast<float>(mClipped) / (4 * mNumQuads);
+
+        stats.blocks.resize(mBlockSums.size());
+
+        for(size_t i = 0; i < mBlockSums.size(); i++) {
+            if(mBlockCounts[i] > 0)
+                stats.blocks[i] = (static_cast<float>(mBlockSums[i]) / (4 * mBlockCounts[i]) - mMeanBlackLevel) / mean;
+        }
+
+        if(!mHistogram.empty()) {
+            stats.histogram.resize(mHistogram.size());
+
+            for(size_t i = 0; i < mHistogram.size(); i++)
+                stats.histogram[i] = static_cast<float>(mHistogram[i]) / mNumQuads;
+        }
+
+        stats.valid = true;
+    }
+
+    void FrameStatsAccumulator::measure(const RawImageBuffer& frame,
+                                        const RawCameraMetadata& cameraMetadata,
+                                        std::shared_ptr<const FrameStatsColorTransform> colorTransform,
+                                        FrameStats& stats)
+    {
+        stats = FrameStats();
+
+        FrameStatsAccumulator accumulator(cameraMetadata, frame.pixelFormat, frame.width, frame.height, std::move(colorTransform));
+
+        const size_t rowLen = codec::rowLength(frame.pixelFormat, frame.width);
+
+        if(rowLen == 0
+           || static_cast<size_t>(frame.rowStride) < rowLen
+           || static_cast<size_t>(frame.rowStride) * (frame.height - 1) + rowLen > frame.data->len())
+        {
+            return;
+        }
+
+        const uint8_t* data = frame.data->lock(false);
+        if(!data)
+            return;
+
+        for(int y = 0; y < frame.height - 1; y += 2) {
+            if(accumulator.isSampled(y)) {
+                accumulator.add(y,
+                                data + static_cast<size_t>(y) * frame.rowStride,
+                                data + static_cast<size_t>(y + 1) * frame.rowStride);
+            }
+        }
+
+        frame.data->unlock();
+
+        accumulator.finish(stats);
+    }
+}
@@ -1,6 +1,9 @@
 #include "motioncam/ImageOps.h"
 #include "motioncam/Measure.h"
 
+#include <thread>
+#include <cstring>
+
 using std::vector;
 
 namespace motioncam {    
@@ -27,9 +30,88 @@ namespace motioncam {
         return nums[nums.size()*p];
     }
     
-    float estimateNoise(cv::Mat& input) {
-        cv::Mat d = cv::abs(input);
-        float mad = findMedian(d);
+    namespace {
+        const int MAX_NOISE_THREADS = 4;
+        const int HISTOGRAM_BITS = 16;
+        const uint32_t HISTOGRAM_MASK = (1 << HISTOGRAM_BITS) - 1;
+
+        // Counts the absolute values of the rows by their high 16 bits, or when matching high bits are given,
+        // the values with those high bits by their low 16 bits. Bits of non-negative floats sort the same as the floats.
+        void countBits(const cv::Mat& input, int startRow, int endRow, int64_t highBits, std::vector<uint32_t>& counts) {
+            counts.assign(1 << HISTOGRAM_BITS, 0);
+
+            for(int y = startRow; y < endRow; y++) {
+                const uint32_t* row = input.ptr<uint32_t>(y);
+
+                if(highBits < 0) {
+                    for(int x = 0; x < input.cols; x++)
+                        counts[(row[x] & 0x7FFFFFFF) >> HISTOGRAM_BITS]++;
+                }
+                else {
+                    for(int x = 0; x < input.cols; x++) {
+                        uint32_t bits = row[x] & 0x7FFFFFFF;
+
+                        if((bits >> HISTOGRAM_BITS) == highBits)
+                            counts[bits & HISTOGRAM_MASK]++;
+                    }
+                }
+            }
+        }
+
+        // Returns the bin of the k-th value and the position of the value within the bin
+        uint32_t countBitsParallel(const cv::Mat& input, int64_t highBits, int numThreads, size_t& k) {
+            numThreads = std::max(1, std::min(numThreads, input.rows));
+            const int rowsPerThread = (input.rows + numThreads - 1) / numThreads;
+
+            std::vector<std::vector<uint32_t>> counts(numThreads);
+            std::vector<std::thread> threads;
+
+            for(int i = 1; i < numThreads; i++) {
+                threads.emplace_back(countBits,
+                                     std::cref(input),
+                                     std::min(input.rows, i * rowsPerThread),
+                                     std::min(input.rows, (i + 1) * rowsPerThread),
+                                     highBits,
+                                     std::ref(counts[i]));
+            }
+
+            countBits(input, 0, std::min(input.rows, rowsPerThread), highBits, counts[0]);
+
+            for(auto& thread : threads)
+                thread.join();
+
+            for(uint32_t bin = 0; bin <= HISTOGRAM_MASK; bin++) {
+                size_t count = 0;
+                for(auto& c : counts)
+                    count += c[bin];
+
+                if(k < count)
+                    return bin;
+
+                k -= count;
+            }
+
+            return HISTOGRAM_MASK;
+        }
+    }
+
+    float estimateNoise(cv::Mat& input, int numThreads) {
+        if(input.empty())
+            return 0;
+
+        if(numThreads <= 0)
+            numThreads = std::min(MAX_NOISE_THREADS, static_cast<int>(std::thread::hardware_concurrency()));
+
+        // Median absolute value, found from the bits of the values in two passes instead of sorting a copy
+        size_t k = input.total() / 2;
+
+        uint32_t highBits = countBitsParallel(input, -1, numThreads, k);
+        uint32_t lowBits = countBitsParallel(input, highBits, numThreads, k);
+
+        uint32_t bits = (highBits << HISTOGRAM_BITS) | lowBits;
+        float mad;
+
+        std::memcpy(&mad, &bits, sizeof(mad));
 
         return mad / 0.6745;
     }
@@ -1,4 +1,5 @@
 #include "motioncam/ImageProcessor.h"
+#include "motioncam/ImageProcessorSession.h"
 #include "motioncam/RawContainer.h"
 #include "motioncam/CameraProfile.h"
 #include "motioncam/Temperature.h"
@@ -8,6 +9,7 @@
 #include "motioncam/Measure.h"
 #include "motioncam/Settings.h"
 #include "motioncam/ImageOps.h"
+#include "motioncam/FramePrefetcher.h"
 
 // Halide
 #include "generate_edges.h"
@@ -17,6 +19,8 @@
 #include "inverse_transform.h"
 #include "fuse_image.h"
 #include "fuse_denoise.h"
+#include "fill_denoise.h"
+#include "fill_denoise_raw.h"
 
 #include "linear_image.h"
 #include "hdr_mask.h"
@@ -40,6 +44,10 @@
 #include <fstream>
 #include <algorithm>
 #include <memory>
+#include <map>
+#include <chrono>
+#include <thread>
+#include <exception>
 
 #include <exiv2/exiv2.hpp>
 #include <opencv2/features2d.hpp>
@@ -65,20 +73,8 @@ using std::vector;
 using std::to_string;
 using std::pair;
 
-static std::vector<Halide::Runtime::Buffer<float>> createWaveletBuffers(int width, int height) {
-    std::vector<Halide::Runtime::Buffer<float>> buffers;
-    
-    for(int level = 0; level < 6; level++) {
-        width = width / 2;
-        height = height / 2;
-        
-        buffers.emplace_back(width, height, 4, 4);
-    }
-    
-    return buffers;
-}
-
-extern "C" int extern_denoise(halide_buffer_t *in, int32_t width, int32_t height, int c, float weight, halide_buffer_t *out) {
+// Pipelines that call this pass the wavelet buffers of their session as the user context, or null
+extern "C" int extern_denoise(void *user_context, halide_buffer_t *in, int32_t width, int32_t height, int c, float weight, halide_buffer_t *out) {
     if (in->is_bounds_query()) {
         in->dim[0].min = 0;
         in->dim[1].min = 0;
@@ -89,7 +85,8 @@ extern "C" int extern_denoise(halide_buffer_t *in, int32_t width, int32_t height
         in->dim[2].extent = 2;
     }
     else {
-        auto inputBuffers = createWaveletBuffers(width, height);
+        auto pool = static_cast<motioncam::WaveletBufferPool*>(user_context);
+        auto inputBuffers = pool ? pool->acquire(width, height) : motioncam::WaveletBufferPool::create(width, height);
         
         forward_transform(in,
                           width,
@@ -120,6 +117,9 @@ extern "C" int extern_denoise(halide_buffer_t *in, int32_t width, int32_t height
                           1,
                           0,
                           out);
+        
+        if(pool)
+            pool->release(std::move(inputBuffers));
     }
     
     return 0;
@@ -265,6 +265,204 @@ namespace motioncam {
         NativeBuffer& nativeBuffer;
         uint8_t* nativeBufferData;
     };
+    
+    //
+    // Middle stage of the fusion pipeline. Deinterleaves the frames returned by the prefetcher and calculates
+    // their optical flow to the reference while earlier frames are being fused. Each frame is independent so
+    // several are aligned at once, each thread with its own DIS instance from the session. Frames are returned
+    // in order so the fused result is the same as fusing them one after the other.
+    //
+    
+    struct AlignedFrame {
+        std::shared_ptr<RawData> rawData;
+        cv::Mat flow;
+    };
+    
+    class FrameAligner {
+    public:
+        FrameAligner(FramePrefetcher& prefetcher,
+                     ImageProcessorSession& session,
+                     const cv::Mat& referenceFlowImage,
+                     const RawCameraMetadata& cameraMetadata,
+                     const int numThreads) :
+            mPrefetcher(prefetcher),
+            mSession(session),
+            mReferenceFlowImage(referenceFlowImage),
+            mCameraMetadata(cameraMetadata),
+            mMaxAligned(std::max(1, numThreads)),
+            mNextAlign(0),
+            mNextReturn(0),
+            mRunningThreads(std::max(1, numThreads)),
+            mStop(false),
+            mNoMoreFrames(false),
+            mDeinterleaveTimeMs(0),
+            mFlowTimeMs(0),
+            mStallTimeMs(0)
+        {
+            for(int i = 0; i < std::max(1, numThreads); i++)
+                mThreads.emplace_back(&FrameAligner::alignFrames, this);
+        }
+        
+        ~FrameAligner() {
+            {
+                std::lock_guard<std::mutex> lock(mLock);
+                mStop = true;
+            }
+            
+            mCv.notify_all();
+            
+            for(auto& thread : mThreads)
+                thread.join();
+        }
+        
+        // Returns the next frame, or null once all frames have been returned
+        std::shared_ptr<AlignedFrame> next() {
+            std::unique_lock<std::mutex> lock(mLock);
+            
+            auto isReady = [&] { return mAligned.find(mNextReturn) != mAligned.end() || mRunningThreads == 0; };
+            
+            if(!isReady()) {
+                auto start = std::chrono::steady_clock::now();
+                
+                mCv.wait(lock, isReady);
+                
+                mStallTimeMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            }
+            
+            auto it = mAligned.find(mNextReturn);
+            
+            if(it == mAligned.end()) {
+                if(mError)
+                    std::rethrow_exception(mError);
+                
+                return nullptr;
+            }
+            
+            auto frame = std::move(it->second);
+            
+            mAligned.erase(it);
+            ++mNextReturn;
+            
+            // Let the aligners move on to the next frame
+            mCv.notify_all();
+            
+            return frame;
+        }
+        
+        void log() const {
+            std::lock_guard<std::mutex> lock(mLock);
+            
+            logger::log("Deinterleave " + std::to_string(mDeinterleaveTimeMs) + " ms, " +
+                        "optical flow " + std::to_string(mFlowTimeMs) + " ms (" + std::to_string(mThreads.size()) + " threads), " +
+                        "fuse stalled for " + std::to_string(mStallTimeMs) + " ms");
+        }
+        
+    private:
+        // Takes the next frame from the prefetcher, waiting until it is within mMaxAligned frames of the
+        // frame being fused. Frames are taken one thread at a time so their indices match the prefetcher order.
+        std::shared_ptr<RawImageBuffer> takeFrame(size_t& outIdx) {
+            std::lock_guard<std::mutex> takeLock(mTakeLock);
+            
+            {
+                std::unique_lock<std::mutex> lock(mLock);
+                
+                mCv.wait(lock, [&] { return mStop || mError || mNoMoreFrames || mNextAlign < mNextReturn + mMaxAligned; });
+                
+                if(mStop || mError || mNoMoreFrames)
+                    return nullptr;
+                
+                outIdx = mNextAlign++;
+            }
+            
+            auto frame = mPrefetcher.next();
+            
+            if(!frame) {
+                std::lock_guard<std::mutex> lock(mLock);
+                mNoMoreFrames = true;
+            }
+            
+            return frame;
+        }
+        
+        void alignFrames() {
+            using namespace std::chrono;
+            
+            cv::Ptr<cv::DISOpticalFlow> opticalFlow = mSession.acquireOpticalFlow();
+            
+            try {
+                std::shared_ptr<RawImageBuffer> frame;
+                size_t idx = 0;
+                
+                while((frame = takeFrame(idx)) != nullptr) {
+                    auto aligned = std::make_shared<AlignedFrame>();
+                    auto start = steady_clock::now();
+                    
+                    aligned->rawData = ImageProcessor::loadRawImage(*frame, mCameraMetadata);
+                    frame = nullptr;
+                    
+                    auto flowStart = steady_clock::now();
+                    
+                    cv::Mat currentFlowImage(aligned->rawData->previewBuffer.height(),
+                                             aligned->rawData->previewBuffer.width(),
+                                             CV_8U,
+                                             aligned->rawData->previewBuffer.data());
+                    
+                    // DIS builds the pyramid of the reference again for every frame. OpenCV has no way to hand it a
+                    // prebuilt one, so it can't be shared between the threads or frames.
+                    opticalFlow->calc(mReferenceFlowImage, currentFlowImage, aligned->flow);
+                    
+                    auto end = steady_clock::now();
+                    
+                    std::lock_guard<std::mutex> lock(mLock);
+                    
+                    mDeinterleaveTimeMs += duration<double, std::milli>(flowStart - start).count();
+                    mFlowTimeMs += duration<double, std::milli>(end - flowStart).count();
+                    
+                    mAligned[idx] = std::move(aligned);
+                    mCv.notify_all();
+                }
+            }
+            catch(...) {
+                std::lock_guard<std::mutex> lock(mLock);
+                
+                if(!mError)
+                    mError = std::current_exception();
+            }
+            
+            mSession.releaseOpticalFlow(opticalFlow);
+            
+            {
+                std::lock_guard<std::mutex> lock(mLock);
+                --mRunningThreads;
+            }
+            
+            mCv.notify_all();
+        }
+        
+    private:
+        FramePrefetcher& mPrefetcher;
+        ImageProcessorSession& mSession;
+        const cv::Mat mReferenceFlowImage;
+        const RawCameraMetadata& mCameraMetadata;
+        const size_t mMaxAligned;
+        
+        std::vector<std::thread> mThreads;
+        mutable std::mutex mLock;
+        std::mutex mTakeLock;
+        std::condition_variable mCv;
+        
+        std::map<size_t, std::shared_ptr<AlignedFrame>> mAligned;
+        std::exception_ptr mError;
+        size_t mNextAlign;
+        size_t mNextReturn;
+        int mRunningThreads;
+        bool mStop;
+        bool mNoMoreFrames;
+        
+        double mDeinterleaveTimeMs;
+        double mFlowTimeMs;
+        double mStallTimeMs;
+    };
 
     ImageProgressHelper::ImageProgressHelper(const ImageProcessorProgress& progressListener, int numImages, int start) :
         mStart(start), mProgressListener(progressListener), mNumImages(numImages), mCurImage(0)
@@ -309,7 +507,8 @@ namespace motioncam {
                                         const float chromaEps,
                                         const RawImageMetadata& metadata,
                                         const RawCameraMetadata& cameraMetadata,
-                                        const PostProcessSettings& settings)
+                                        const PostProcessSettings& settings,
+                                        ImageProcessorSession& session)
     {
         Measure measure("postProcess");
 
@@ -325,10 +524,10 @@ namespace motioncam {
         if(settings.temperature > 0 || settings.tint > 0) {
             Temperature t(settings.temperature, settings.tint);
 
-            createSrgbMatrix(cameraMetadata, metadata, t, cameraWhite, cameraToPcs, pcsToSrgb);
+            session.createSrgbMatrix(cameraMetadata, metadata, t, cameraWhite, cameraToPcs, pcsToSrgb);
         }
         else {
-            createSrgbMatrix(cameraMetadata, metadata, metadata.asShot, cameraWhite, cameraToPcs, pcsToSrgb);
+            session.createSrgbMatrix(cameraMetadata, metadata, metadata.asShot, cameraWhite, cameraToPcs, pcsToSrgb);
         }
 
         Halide::Runtime::Buffer<float> cameraToPcsBuffer = ToHalideBuffer<float>(cameraToPcs);
@@ -618,7 +817,14 @@ namespace motioncam {
 
         cameraProfile.temperatureFromVector(rawBuffer.metadata.asShot, temperature);
 
-        cv::Mat histogram = calcHistogram(cameraMetadata, rawBuffer, false, 4);
+        // Use the histogram measured when the frame was copied if there is one
+        const auto& stats = rawBuffer.metadata.stats;
+        cv::Mat histogram;
+
+        if(stats.valid && !stats.histogram.empty())
+            histogram = cv::Mat(1, static_cast<int>(stats.histogram.size()), CV_32F, const_cast<float*>(stats.histogram.data())).clone();
+        else
+            histogram = calcHistogram(cameraMetadata, rawBuffer, false, 4);
 
         outSettings.temperature    = static_cast<float>(temperature.temperature());
         outSettings.tint           = static_cast<float>(temperature.tint());
@@ -900,6 +1106,45 @@ namespace motioncam {
         return outputBuffer;
     }
     
+    std::vector<uint8_t> ImageProcessor::createEmbeddedPreview(const RawImageBuffer& rawBuffer,
+                                                               const RawCameraMetadata& cameraMetadata,
+                                                               const PostProcessSettings& settings)
+    {
+        auto preview = createPreview(rawBuffer, 4, cameraMetadata, settings);
+        
+        cv::Mat previewImage(preview.height(), preview.width(), CV_8UC4, preview.data());
+        cv::Mat bgr;
+        
+        cv::cvtColor(previewImage, bgr, cv::COLOR_RGBA2BGR);
+        
+        std::vector<uint8_t> output;
+        cv::imencode(".jpg", bgr, output, { cv::IMWRITE_JPEG_QUALITY, 85 });
+        
+        return output;
+    }
+
+    std::shared_ptr<RawFrameProxy> ImageProcessor::createFrameProxy(const RawImageBuffer& rawBuffer,
+                                                                    const RawCameraMetadata& cameraMetadata,
+                                                                    const PostProcessSettings& settings)
+    {
+        // 1/8 of the full resolution
+        auto preview = createPreview(rawBuffer, 4, cameraMetadata, settings);
+        
+        cv::Mat previewImage(preview.height(), preview.width(), CV_8UC4, preview.data());
+        
+        auto proxy = std::make_shared<RawFrameProxy>();
+        
+        proxy->timestampNs  = rawBuffer.metadata.timestampNs;
+        proxy->width        = previewImage.cols;
+        proxy->height       = previewImage.rows;
+        proxy->data.resize(previewImage.total());
+        
+        cv::Mat luma(previewImage.rows, previewImage.cols, CV_8U, proxy->data.data());
+        cv::cvtColor(previewImage, luma, cv::COLOR_RGBA2GRAY);
+        
+        return proxy;
+    }
+
     std::shared_ptr<RawData> ImageProcessor::loadRawImage(const RawImageBuffer& rawBuffer,
                                                           const RawCameraMetadata& cameraMetadata,
                                                           const bool extendEdges,
@@ -1225,6 +1470,15 @@ namespace motioncam {
     }
 
     void ImageProcessor::process(RawContainer& rawContainer, const std::string& outputPath, const ImageProcessorProgress& progressListener)
+    {
+        ImageProcessorSession session;
+        session.process(rawContainer, outputPath, progressListener);
+    }
+
+    void ImageProcessor::process(RawContainer& rawContainer,
+                                 const std::string& outputPath,
+                                 const ImageProcessorProgress& progressListener,
+                                 ImageProcessorSession& session)
     {
         // If this is a HDR capture then find the underexposed images.
         std::vector<std::shared_ptr<RawImageBuffer>> underexposedImages;
@@ -1241,14 +1495,37 @@ namespace motioncam {
             
             std::map<std::string, float> sharpness;
             
-            for(auto& p : rawContainer.getFrames()) {
-                auto s = rawContainer.loadFrame(p);
-                sharpness[p] = measureSharpness(*s);
+            auto frames = rawContainer.getFrames();
+            
+            // Use the scores from when the frames were captured if we have them
+            for(auto& p : frames) {
+                float score = rawContainer.getFrame(p)->metadata.quality.score;
+                if(score <= 0) {
+                    sharpness.clear();
+                    break;
+                }
+                
+                sharpness[p] = score;
+            }
+            
+            if(sharpness.empty()) {
+                FramePrefetcher prefetcher(rawContainer, frames);
+                
+                for(auto& p : frames) {
+                    auto s = prefetcher.next();
+                    sharpness[p] = measureSharpness(*s);
+                }
+                
+                logger::log("Stalled loading frames for " + std::to_string(prefetcher.stallTimeMs()) + " ms");
             }
             
-            rawContainer.updateReferenceImage(sharpness.rbegin()->first);
+            auto sharpest = std::max_element(sharpness.begin(), sharpness.end(), [](const auto& a, const auto& b) {
+                return a.second < b.second;
+            });
+            
+            rawContainer.updateReferenceImage(sharpest->first);
         }
-
+        
         if(rawContainer.isHdr()) {
             double maxEv = -1e10;
             double minEv = 1e10;
@@ -1390,7 +1667,7 @@ namespace motioncam {
         ImageProgressHelper progressHelper(progressListener, static_cast<int>(rawContainer.getFrames().size()), 0);
         
         std::vector<Halide::Runtime::Buffer<uint16_t>> denoiseOutput;
-        denoiseOutput = denoise(rawContainer, progressHelper);
+        denoiseOutput = denoise(rawContainer, progressHelper, session);
         
         progressHelper.denoiseCompleted();
         
@@ -1477,13 +1754,16 @@ namespace motioncam {
             chromaEps,
             referenceRawBuffer->metadata,
             rawContainer.getCameraMetadata(),
-            settings);
+            settings,
+            session);
         
         progressHelper.postProcessCompleted();
 
-        // Write image
+        // Encode the image, the metadata is added before it's written so the file is only written once
         std::vector<int> writeParams = { cv::IMWRITE_JPEG_QUALITY, rawContainer.getPostProcessSettings().jpegQuality };
-        cv::imwrite(outputPath, outputImage, writeParams);
+        std::vector<uint8_t> jpegData;
+        
+        cv::imencode(".jpg", outputImage, jpegData, writeParams);
 
         // Create thumbnail
         cv::Mat thumbnail;
@@ -1498,7 +1778,16 @@ namespace motioncam {
                         thumbnail,
                         rawContainer.getCameraMetadata(),
                         rawContainer.getPostProcessSettings(),
-                        outputPath);
+                        jpegData);
+        
+        // Written in one go, there is nothing else to do while it's being written
+        std::ofstream outputFile(outputPath, std::ios::binary);
+        
+        outputFile.write(reinterpret_cast<const char*>(jpegData.data()), jpegData.size());
+        outputFile.close();
+        
+        if(!outputFile)
+            throw IOException("Failed to write " + outputPath);
         
         progressHelper.imageSaved();
     }
@@ -1507,17 +1796,8 @@ namespace motioncam {
                                  const std::string& outputPath,
                                  const ImageProcessorProgress& progressListener)
     {
-        Measure measure("process()");
-
-        // Open RAW container
-        RawContainer rawContainer(inputPath);
-
-        if(rawContainer.getFrames().empty()) {
-            progressListener.onError("No frames found");
-            return;
-        }
-        
-        process(rawContainer, outputPath, progressListener);
+        ImageProcessorSession session;
+        session.process(inputPath, outputPath, progressListener);
     }
 
     float ImageProcessor::adjustShadowsForFaces(cv::Mat input, PreviewMetadata& metadata) {
@@ -1554,9 +1834,9 @@ namespace motioncam {
                                          const cv::Mat& thumbnail,
                                          const RawCameraMetadata& cameraMetadata,
                                          const PostProcessSettings& settings,
-                                         const std::string& inputOutput)
+                                         std::vector<uint8_t>& jpegData)
     {
-        auto image = Exiv2::ImageFactory::open(inputOutput);
+        auto image = Exiv2::ImageFactory::open(jpegData.data(), static_cast<long>(jpegData.size()));
         if(image.get() == nullptr)
             return;
         
@@ -1635,6 +1915,14 @@ namespace motioncam {
         }
         
         image->writeMetadata();
+        
+        // Copy out the updated image
+        Exiv2::BasicIo& io = image->io();
+        
+        jpegData.resize(io.size());
+        
+        io.seek(0, Exiv2::BasicIo::beg);
+        io.read(jpegData.data(), static_cast<long>(jpegData.size()));
     }
 
     double ImageProcessor::measureSharpness(const RawImageBuffer& rawBuffer) {
@@ -1664,7 +1952,9 @@ namespace motioncam {
         return m[0];
     }
 
-    std::vector<Halide::Runtime::Buffer<uint16_t>> ImageProcessor::denoise(RawContainer& rawContainer, ImageProgressHelper& progressHelper)
+    std::vector<Halide::Runtime::Buffer<uint16_t>> ImageProcessor::denoise(RawContainer& rawContainer,
+                                                                           ImageProgressHelper& progressHelper,
+                                                                           ImageProcessorSession& session)
     {
         Measure measure("denoise()");
                 
@@ -1674,12 +1964,20 @@ namespace motioncam {
         std::vector<Halide::Runtime::Buffer<uint16_t>> result;
         
         cv::Mat referenceFlowImage(reference->previewBuffer.height(), reference->previewBuffer.width(), CV_8U, reference->previewBuffer.data());
-        Halide::Runtime::Buffer<float> fuseOutput(reference->rawBuffer.width(), reference->rawBuffer.height(), 4);
+        Halide::Runtime::Buffer<float> fuseOutput = session.fuseBuffer(reference->rawBuffer.width(), reference->rawBuffer.height());
         
         fuseOutput.fill(0);
         
         auto processFrames = rawContainer.getFrames();
-        auto it = processFrames.begin();
+        
+        // Load the other frames in the background while fusing
+        std::vector<std::string> fuseFrames;
+        
+        std::copy_if(processFrames.begin(), processFrames.end(), std::back_inserter(fuseFrames), [&](const std::string& frame) {
+            return frame != rawContainer.getReferenceImage();
+        });
+        
+        FramePrefetcher prefetcher(rawContainer, fuseFrames);
         
         // Pixels that have moved a lot will contribute less since we are less certain about them
         float motionVectorsWeight = 20*20;
@@ -1688,70 +1986,70 @@ namespace motioncam {
         float ev = calcEv(rawContainer.getCameraMetadata(), reference->metadata);
         float differenceWeight = std::max(1.0f, std::min(32.0f, -ev + 16.0f));
                 
-        while(it != processFrames.end()) {
-            if(rawContainer.getReferenceImage() == *it) {
-                ++it;
-                continue;
-            }
+        // Frames are loaded, aligned and fused at the same time. Only this thread writes to fuseOutput
+        // and it fuses the frames in order.
+        {
+            // Leave a core for fusing, there's no point having more threads than frames
+            const int numAlignThreads =
+                std::max(1, std::min(static_cast<int>(std::thread::hardware_concurrency()) - 1, static_cast<int>(fuseFrames.size())));
             
-            auto frame = rawContainer.loadFrame(*it);
-            auto current = loadRawImage(*frame, rawContainer.getCameraMetadata());
+            FrameAligner aligner(prefetcher, session, referenceFlowImage, rawContainer.getCameraMetadata(), numAlignThreads);
             
-            cv::Mat flow;
-            cv::Mat currentFlowImage(current->previewBuffer.height(),
-                                     current->previewBuffer.width(),
-                                     CV_8U,
-                                     current->previewBuffer.data());
-
-            cv::Ptr<cv::DISOpticalFlow> opticalFlow =
-                cv::DISOpticalFlow::create(cv::DISOpticalFlow::PRESET_FAST);
+            std::shared_ptr<AlignedFrame> current;
+            double fuseTimeMs = 0;
             
-            opticalFlow->setPatchSize(16);
-            opticalFlow->setPatchStride(8);
+            while((current = aligner.next()) != nullptr) {
+                auto fuseStart = std::chrono::steady_clock::now();
+                
+                Halide::Runtime::Buffer<float> flowBuffer =
+                    Halide::Runtime::Buffer<float>::make_interleaved(
+                        (float*) current->flow.data, current->flow.cols, current->flow.rows, 2);
+                
+                fuse_denoise(reference->rawBuffer,
+                             current->rawData->rawBuffer,
+                             fuseOutput,
+                             flowBuffer,
+                             reference->rawBuffer.width(),
+                             reference->rawBuffer.height(),
+                             rawContainer.getCameraMetadata().whiteLevel,
+                             motionVectorsWeight,
+                             differenceWeight,
+                             fuseOutput);
+                
+                fuseTimeMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - fuseStart).count();
+                
+                progressHelper.nextFusedImage();
+            }
             
-            opticalFlow->calc(referenceFlowImage, currentFlowImage, flow);
-                        
-            Halide::Runtime::Buffer<float> flowBuffer =
-                Halide::Runtime::Buffer<float>::make_interleaved((float*) flow.data, flow.cols, flow.rows, 2);
-                        
-            fuse_denoise(reference->rawBuffer,
-                         current->rawBuffer,
-                         fuseOutput,
-                         flowBuffer,
-                         reference->rawBuffer.width(),
-                         reference->rawBuffer.height(),
-                         rawContainer.getCameraMetadata().whiteLevel,
-                         motionVectorsWeight,
-                         differenceWeight,
-                         fuseOutput);
+            aligner.log();
             
-            progressHelper.nextFusedImage();
-
-            ++it;
+            logger::log("Fuse " + std::to_string(fuseTimeMs) + " ms");
         }
         
+        logger::log("Stalled loading frames for " + std::to_string(prefetcher.stallTimeMs()) + " ms");
+        
         const int width = reference->rawBuffer.width();
         const int height = reference->rawBuffer.height();
 
-        Halide::Runtime::Buffer<uint16_t> denoiseInput(width, height, 4);
+        Halide::Runtime::Buffer<uint16_t> denoiseInput = session.denoiseBuffer(width, height);
+        Halide::Runtime::Buffer<float> blackLevel(4);
         
+        for(int c = 0; c < 4; c++)
+            blackLevel(c) = static_cast<float>(rawContainer.getCameraMetadata().blackLevel[c]);
+        
+        // Subtract the black level of each channel and scale to the expanded range
         if(processFrames.size() <= 1)
-            denoiseInput.for_each_element([&](int x, int y, int c) {
-                float p = reference->rawBuffer(x, y, c) - rawContainer.getCameraMetadata().blackLevel[c];
-                float s = EXPANDED_RANGE / (float) (rawContainer.getCameraMetadata().whiteLevel-rawContainer.getCameraMetadata().blackLevel[c]);
-                
-                denoiseInput(x, y, c) = static_cast<uint16_t>( std::max(0.0f, std::min(p * s, (float) EXPANDED_RANGE) )) ;
-            });
-        else {
-            const float n = (float) processFrames.size() - 1;
-
-            denoiseInput.for_each_element([&](int x, int y, int c) {
-                float p = fuseOutput(x, y, c) / n - rawContainer.getCameraMetadata().blackLevel[c];
-                float s = EXPANDED_RANGE / (float) (rawContainer.getCameraMetadata().whiteLevel-rawContainer.getCameraMetadata().blackLevel[c]);
-                
-                denoiseInput(x, y, c) = static_cast<uint16_t>( std::max(0.0f, std::min(p * s, (float) EXPANDED_RANGE) ) ) ;
-            });
-        }
+            fill_denoise_raw(reference->rawBuffer,
+                             blackLevel,
+                             rawContainer.getCameraMetadata().whiteLevel,
+                             1.0f,
+                             denoiseInput);
+        else
+            fill_denoise(fuseOutput,
+                         blackLevel,
+                         rawContainer.getCameraMetadata().whiteLevel,
+                         static_cast<float>(processFrames.size() - 1),
+                         denoiseInput);
         
         // Don't need this anymore
         reference->rawBuffer = Halide::Runtime::Buffer<uint16_t>();
@@ -1765,45 +2063,67 @@ namespace motioncam {
         if(rawContainer.getPostProcessSettings().spatialDenoiseAggressiveness > 0) {
             float spatialDenoiseWeight = rawContainer.getPostProcessSettings().spatialDenoiseAggressiveness;
                         
-            for(int c = 0; c < 4; c++) {
-                auto wavelet = createWaveletBuffers(denoiseInput.width(), denoiseInput.height());
-
-                forward_transform(denoiseInput,
-                                  denoiseInput.width(),
-                                  denoiseInput.height(),
-                                  c,
-                                  wavelet[0],
-                                  wavelet[1],
-                                  wavelet[2],
-                                  wavelet[3],
-                                  wavelet[4],
-                                  wavelet[5]);
-
-                int offset = 3 * wavelet[0].stride(2);
+            std::vector<Halide::Runtime::Buffer<uint16_t>> channels(4);
+            std::vector<std::exception_ptr> errors(4);
+
+            auto denoiseChannel = [&](int c) {
+                try {
+                    auto wavelet = session.waveletBuffers().acquire(denoiseInput.width(), denoiseInput.height());
+
+                    forward_transform(denoiseInput,
+                                      denoiseInput.width(),
+                                      denoiseInput.height(),
+                                      c,
+                                      wavelet[0],
+                                      wavelet[1],
+                                      wavelet[2],
+                                      wavelet[3],
+                                      wavelet[4],
+                                      wavelet[5]);
+
+                    int offset = 3 * wavelet[0].stride(2);
+
+                    cv::Mat hh(wavelet[0].height(), wavelet[0].width(), CV_32F, wavelet[0].data() + offset);
+                    // The other channels are busy on the other cores
+                    float noiseSigma = estimateNoise(hh, 1);
+
+                    Halide::Runtime::Buffer<uint16_t> outputBuffer(width, height);
+
+                    inverse_transform(wavelet[0],
+                                      wavelet[1],
+                                      wavelet[2],
+                                      wavelet[3],
+                                      wavelet[4],
+                                      wavelet[5],
+                                      spatialDenoiseWeight*noiseSigma,
+                                      false,
+                                      1,
+                                      1,
+                                      outputBuffer);
+
+                    session.waveletBuffers().release(std::move(wavelet));
+
+                    channels[c] = outputBuffer;
+                }
+                catch(...) {
+                    errors[c] = std::current_exception();
+                }
+            };
 
-                cv::Mat hh(wavelet[0].height(), wavelet[0].width(), CV_32F, wavelet[0].data() + offset);
-                float noiseSigma = estimateNoise(hh);
+            // The channels are independent, denoise them at the same time with their own wavelet buffers
+            session.runJobs(4, denoiseChannel);
 
-                Halide::Runtime::Buffer<uint16_t> outputBuffer(width, height);
-                                
-                inverse_transform(wavelet[0],
-                                  wavelet[1],
-                                  wavelet[2],
-                                  wavelet[3],
-                                  wavelet[4],
-                                  wavelet[5],
-                                  spatialDenoiseWeight*noiseSigma,
-                                  false,
-                                  1,
-                                  1,
-                                  outputBuffer);
-
-                denoiseOutput.push_back(outputBuffer);
+            for(auto& error : errors) {
+                if(error)
+                    std::rethrow_exception(error);
             }
+
+            denoiseOutput = std::move(channels);
         }
         else {
+            // The denoise buffer belongs to the session and is reused by the next image, copy the channels out
             for(int c = 0; c < 4; c++) {
-                denoiseOutput.push_back(denoiseInput.sliced(2, c));
+                denoiseOutput.push_back(denoiseInput.sliced(2, c).copy());
             }
         }
         
@@ -0,0 +1,336 @@
+#include "motioncam/ImageProcessorSession.h"
+#include "motioncam/ImageProcessor.h"
+#include "motioncam/ImageProcessorProgress.h"
+#include "motioncam/RawContainer.h"
+#include "motioncam/Temperature.h"
+#include "motioncam/Measure.h"
+
+#include <algorithm>
+
+namespace motioncam {
+    namespace {
+        // Enough for the four channels to be denoised at the same time
+        const size_t MAX_WAVELET_BUFFERS = 4;
+        const size_t MAX_COLOR_TRANSFORMS = 64;
+
+        // One for each channel besides the one denoised by the calling thread
+        const int MAX_WORKERS = 3;
+
+        void appendKey(std::string& key, const void* data, size_t len) {
+            key.append(reinterpret_cast<const char*>(data), len);
+        }
+
+        void appendKey(std::string& key, const cv::Mat& m) {
+            int header[3] = { m.rows, m.cols, m.type() };
+            appendKey(key, header, sizeof(header));
+
+            if(m.empty())
+                return;
+
+            cv::Mat c = m.isContinuous() ? m : m.clone();
+            appendKey(key, c.data, c.total() * c.elemSize());
+        }
+
+        // Everything CameraProfile uses to build the transform
+        std::string colorTransformKey(const RawCameraMetadata& cameraMetadata, const RawImageMetadata& metadata) {
+            std::string key;
+
+            int illuminants[2] = { static_cast<int>(cameraMetadata.colorIlluminant1), static_cast<int>(cameraMetadata.colorIlluminant2) };
+            appendKey(key, illuminants, sizeof(illuminants));
+
+            appendKey(key, metadata.colorMatrix1.empty() ? cameraMetadata.colorMatrix1 : metadata.colorMatrix1);
+            appendKey(key, metadata.colorMatrix2.empty() ? cameraMetadata.colorMatrix2 : metadata.colorMatrix2);
+            appendKey(key, metadata.forwardMatrix1.empty() ? cameraMetadata.forwardMatrix1 : metadata.forwardMatrix1);
+            appendKey(key, metadata.forwardMatrix2.empty() ? cameraMetadata.forwardMatrix2 : metadata.forwardMatrix2);
+            appendKey(key, metadata.calibrationMatrix1.empty() ? cameraMetadata.calibrationMatrix1 : metadata.calibrationMatrix1);
+            appendKey(key, metadata.calibrationMatrix2.empty() ? cameraMetadata.calibrationMatrix2 : metadata.calibrationMatrix2);
+
+            return key;
+        }
+    }
+
+    std::vector<Halide::Runtime::Buffer<float>> WaveletBufferPool::create(int width, int height) {
+        std::vector<Halide::Runtime::Buffer<float>> buffers;
+
+        for(int level = 0; level < 6; level++) {
+            width = width / 2;
+            height = height / 2;
+
+            buffers.emplace_back(width, height, 4, 4);
+        }
+
+        return buffers;
+    }
+
+    std::vector<Halide::Runtime::Buffer<float>> WaveletBufferPool::acquire(int width, int height) {
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+
+            auto it = std::find_if(mBuffers.begin(), mBuffers.end(), [&](const std::vector<Halide::Runtime::Buffer<float>>& b) {
+                return b[0].width() == width / 2 && b[0].height() == height / 2;
+            });
+
+            if(it != mBuffers.end()) {
+                auto buffers = std::move(*it);
+                mBuffers.erase(it);
+
+                return buffers;
+            }
+        }
+
+        return create(width, height);
+    }
+
+    void WaveletBufferPool::release(std::vector<Halide::Runtime::Buffer<float>> buffers) {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        if(mBuffers.size() >= MAX_WAVELET_BUFFERS)
+            mBuffers.erase(mBuffers.begin());
+
+        mBuffers.push_back(std::move(buffers));
+    }
+
+    void WaveletBufferPool::clear() {
+        std::lock_guard<std::mutex> lock(mLock);
+        mBuffers.clear();
+    }
+
+    ImageProcessorSession::ImageProcessorSession() :
+        mWaveletBuffers(std::make_shared<WaveletBufferPool>()),
+        mWorkerGeneration(0),
+        mWorkerJobs(0),
+        mWorkerPending(0),
+        mStopWorkers(false)
+    {
+    }
+
+    ImageProcessorSession::~ImageProcessorSession() {
+        {
+            std::lock_guard<std::mutex> lock(mWorkerLock);
+            mStopWorkers = true;
+        }
+
+        mWorkerCondition.notify_all();
+
+        for(auto& worker : mWorkers)
+            worker.join();
+    }
+
+    void ImageProcessorSession::runJobs(int numJobs, const std::function<void (int)>& job) {
+        if(numJobs <= 0)
+            return;
+
+        const int numHelpers = std::min(numJobs - 1, MAX_WORKERS);
+
+        if(numHelpers > 0) {
+            std::lock_guard<std::mutex> lock(mWorkerLock);
+
+            // Started the first time they are needed, they wait for the batch after the last one
+            for(int i = static_cast<int>(mWorkers.size()); i < numHelpers; i++)
+                mWorkers.emplace_back(&ImageProcessorSession::doJobs, this, i + 1, mWorkerGeneration);
+
+            mWorkerJob = job;
+            mWorkerJobs = numHelpers;
+            mWorkerPending = numHelpers;
+            ++mWorkerGeneration;
+        }
+
+        if(numHelpers > 0)
+            mWorkerCondition.notify_all();
+
+        job(0);
+
+        // Run anything there isn't a thread for ourselves
+        for(int idx = numHelpers + 1; idx < numJobs; idx++)
+            job(idx);
+
+        if(numHelpers > 0) {
+            std::unique_lock<std::mutex> lock(mWorkerLock);
+
+            mWorkerDoneCondition.wait(lock, [&] { return mWorkerPending == 0; });
+            mWorkerJob = nullptr;
+        }
+    }
+
+    void ImageProcessorSession::doJobs(int idx, int64_t generation) {
+        std::unique_lock<std::mutex> lock(mWorkerLock);
+
+        while(true) {
+            mWorkerCondition.wait(lock, [&] { return mStopWorkers || mWorkerGeneration != generation; });
+
+            if(mStopWorkers)
+                break;
+
+            generation = mWorkerGeneration;
+
+            // Not needed for this batch
+            if(idx > mWorkerJobs)
+                continue;
+
+            auto job = mWorkerJob;
+
+            lock.unlock();
+
+            job(idx);
+
+            lock.lock();
+
+            if(--mWorkerPending == 0)
+                mWorkerDoneCondition.notify_one();
+        }
+    }
+
+    void ImageProcessorSession::process(const std::string& inputPath,
+                                        const std::string& outputPath,
+                                        const ImageProcessorProgress& progressListener)
+    {
+        Measure measure("process()");
+
+        // Open RAW container
+        RawContainer rawContainer(inputPath);
+
+        if(rawContainer.getFrames().empty()) {
+            progressListener.onError("No frames found");
+            return;
+        }
+
+        process(rawContainer, outputPath, progressListener);
+    }
+
+    void ImageProcessorSession::process(RawContainer& rawContainer,
+                                        const std::string& outputPath,
+                                        const ImageProcessorProgress& progressListener)
+    {
+        ImageProcessor::process(rawContainer, outputPath, progressListener, *this);
+    }
+
+    void ImageProcessorSession::trim() {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mFuseBuffer = Halide::Runtime::Buffer<float>();
+        mDenoiseBuffer = Halide::Runtime::Buffer<uint16_t>();
+        mWaveletBuffers->clear();
+        mOpticalFlow.clear();
+        mColorTransforms.clear();
+    }
+
+    Halide::Runtime::Buffer<float> ImageProcessorSession::fuseBuffer(int width, int height) {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        if(!mFuseBuffer.defined() || mFuseBuffer.width() != width || mFuseBuffer.height() != height)
+            mFuseBuffer = Halide::Runtime::Buffer<float>(width, height, 4);
+
+        return mFuseBuffer;
+    }
+
+    Halide::Runtime::Buffer<uint16_t> ImageProcessorSession::denoiseBuffer(int width, int height) {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        if(!mDenoiseBuffer.defined() || mDenoiseBuffer.width() != width || mDenoiseBuffer.height() != height)
+            mDenoiseBuffer = Halide::Runtime::Buffer<uint16_t>(width, height, 4);
+
+        return mDenoiseBuffer;
+    }
+
+    WaveletBufferPool& ImageProcessorSession::waveletBuffers() {
+        return *mWaveletBuffers;
+    }
+
+    cv::Ptr<cv::DISOpticalFlow> ImageProcessorSession::acquireOpticalFlow() {
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+
+            if(!mOpticalFlow.empty()) {
+                auto opticalFlow = mOpticalFlow.back();
+                mOpticalFlow.pop_back();
+
+                return opticalFlow;
+            }
+        }
+
+        cv::Ptr<cv::DISOpticalFlow> opticalFlow = cv::DISOpticalFlow::create(cv::DISOpticalFlow::PRESET_FAST);
+
+        opticalFlow->setPatchSize(16);
+        opticalFlow->setPatchStride(8);
+
+        return opticalFlow;
+    }
+
+    void ImageProcessorSession::releaseOpticalFlow(cv::Ptr<cv::DISOpticalFlow> opticalFlow) {
+        std::lock_guard<std::mutex> lock(mLock);
+        mOpticalFlow.push_back(opticalFlow);
+    }
+
+    void ImageProcessorSession::createSrgbMatrix(const RawCameraMetadata& cameraMetadata,
+                                                 const RawImageMetadata& rawImageMetadata,
+                                                 const Temperature& temperature,
+                                                 cv::Vec3f& cameraWhite,
+                                                 cv::Mat& outCameraToPcs,
+                                                 cv::Mat& outPcsToSrgb)
+    {
+        std::string key = colorTransformKey(cameraMetadata, rawImageMetadata);
+
+        double t[2] = { temperature.temperature(), temperature.tint() };
+        appendKey(key, "T", 1);
+        appendKey(key, t, sizeof(t));
+
+        if(findColorTransform(key, cameraWhite, outCameraToPcs, outPcsToSrgb))
+            return;
+
+        ImageProcessor::createSrgbMatrix(cameraMetadata, rawImageMetadata, temperature, cameraWhite, outCameraToPcs, outPcsToSrgb);
+
+        addColorTransform(key, cameraWhite, outCameraToPcs, outPcsToSrgb);
+    }
+
+    void ImageProcessorSession::createSrgbMatrix(const RawCameraMetadata& cameraMetadata,
+                                                 const RawImageMetadata& rawImageMetadata,
+                                                 const cv::Vec3f& asShot,
+                                                 cv::Vec3f& cameraWhite,
+                                                 cv::Mat& outCameraToPcs,
+                                                 cv::Mat& outPcsToSrgb)
+    {
+        std::string key = colorTransformKey(cameraMetadata, rawImageMetadata);
+
+        float v[3] = { asShot[0], asShot[1], asShot[2] };
+        appendKey(key, "A", 1);
+        appendKey(key, v, sizeof(v));
+
+        if(findColorTransform(key, cameraWhite, outCameraToPcs, outPcsToSrgb))
+            return;
+
+        ImageProcessor::createSrgbMatrix(cameraMetadata, rawImageMetadata, asShot, cameraWhite, outCameraToPcs, outPcsToSrgb);
+
+        addColorTransform(key, cameraWhite, outCameraToPcs, outPcsToSrgb);
+    }
+
+    bool ImageProcessorSession::findColorTransform(const std::string& key,
+                                                   cv::Vec3f& cameraWhite,
+                                                   cv::Mat& outCameraToPcs,
+                                                   cv::Mat& outPcsToSrgb)
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        auto it = mColorTransforms.find(key);
+        if(it == mColorTransforms.end())
+            return false;
+
+        cameraWhite = it->second.cameraWhite;
+        it->second.cameraToPcs.copyTo(outCameraToPcs);
+        it->second.pcsToSrgb.copyTo(outPcsToSrgb);
+
+        return true;
+    }
+
+    void ImageProcessorSession::addColorTransform(const std::string& key,
+                                                  const cv::Vec3f& cameraWhite,
+                                                  const cv::Mat& cameraToPcs,
+                                                  const cv::Mat& pcsToSrgb)
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        if(mColorTransforms.size() >= MAX_COLOR_TRANSFORMS)
+            mColorTransforms.clear();
+
+        mColorTransforms[key] = { cameraWhite, cameraToPcs.clone(), pcsToSrgb.clone() };
+    }
+}
@@ -0,0 +1,104 @@
+#include "motioncam/NativeMappedBuffer.h"
+#include "motioncam/Exceptions.h"
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace motioncam {
+
+    NativeMappedBuffer::NativeMappedBuffer(const std::string& path, const uint64_t offset, const size_t length) :
+        mMapping(nullptr),
+        mMappingLength(0),
+        mData(nullptr),
+        mLength(length)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0) {
+            throw IOException("Can't open " + path);
+        }
+
+        // Mappings must start on a page boundary
+        const uint64_t pageSize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+        const uint64_t mappingOffset = offset & ~(pageSize - 1);
+        const size_t delta = static_cast<size_t>(offset - mappingOffset);
+
+        mMappingLength = length + delta;
+
+#if defined(POSIX_FADV_WILLNEED)
+        posix_fadvise(fd, static_cast<off_t>(offset), static_cast<off_t>(length), POSIX_FADV_WILLNEED);
+#endif
+
+        // Private mapping so writes never end up back in the container
+        mMapping = mmap(nullptr, mMappingLength, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, static_cast<off_t>(mappingOffset));
+
+        // The mapping holds its own reference to the file
+        close(fd);
+
+        if(mMapping == MAP_FAILED) {
+            mMapping = nullptr;
+            throw IOException("Can't map " + path);
+        }
+
+        // Frames are consumed front to back, let the kernel read ahead
+        madvise(mMapping, mMappingLength, MADV_SEQUENTIAL);
+        madvise(mMapping, mMappingLength, MADV_WILLNEED);
+
+        mData = static_cast<uint8_t*>(mMapping) + delta;
+    }
+
+    NativeMappedBuffer::~NativeMappedBuffer() {
+        release();
+    }
+
+    uint8_t* NativeMappedBuffer::lock(bool write) {
+        return mData;
+    }
+
+    void NativeMappedBuffer::unlock() {
+    }
+
+    uint64_t NativeMappedBuffer::nativeHandle() {
+        return 0;
+    }
+
+    size_t NativeMappedBuffer::len() {
+        return mLength;
+    }
+
+    const std::vector<uint8_t>& NativeMappedBuffer::hostData() {
+        if(mMapping && mHostBuffer.size() != mLength) {
+            mHostBuffer.assign(mData, mData + mLength);
+        }
+
+        return mHostBuffer;
+    }
+
+    void NativeMappedBuffer::copyHostData(const std::vector<uint8_t>& data) {
+        // Drop the mapping and keep our own copy from now on
+        release();
+
+        mHostBuffer = data;
+        mData = mHostBuffer.data();
+        mLength = mHostBuffer.size();
+    }
+
+    std::unique_ptr<NativeBuffer> NativeMappedBuffer::clone() {
+        return std::make_unique<NativeHostBuffer>(mData, mLength);
+    }
+
+    void NativeMappedBuffer::release() {
+        if(mMapping) {
+            munmap(mMapping, mMappingLength);
+
+            mMapping = nullptr;
+            mMappingLength = 0;
+        }
+
+        mHostBuffer.resize(0);
+        mHostBuffer.shrink_to_fit();
+
+        mData = nullptr;
+        mLength = 0;
+    }
+}
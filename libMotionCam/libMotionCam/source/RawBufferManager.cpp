@@ -2,29 +2,102 @@
 
 #include <utility>
 #include "motioncam/RawContainer.h"
+#include "motioncam/ImageProcessor.h"
 #include "motioncam/Util.h"
 #include "motioncam/Logger.h"
 #include "motioncam/Measure.h"
+#include "motioncam/FrameCompressor.h"
+#include "motioncam/RawCodec.h"
+#include "motioncam/RawBufferPool.h"
+
+#if defined(__ANDROID__) || defined(__linux__)
+    #include <sys/resource.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
 
 namespace motioncam {
+    
+    static const int COMPACTION_INTERVAL_MS = 20;
+    static const int DEFAULT_RETENTION_WINDOW = 4;
+    static const size_t MAX_RECENT_SAVE_JOBS = 32;
 
+    // Buffers are ordered by timestamp, so walk outwards from the nearest one instead of sorting them all
     static std::vector<std::shared_ptr<RawImageBuffer>> FindNearestBuffers(
-        const std::vector<std::shared_ptr<RawImageBuffer>>& buffers, RawType type, int64_t timestampNs, int numBuffers) {
-     
+        const std::deque<std::shared_ptr<RawImageBuffer>>& buffers, RawType type, int64_t timestampNs, int numBuffers) {
+        
+        std::vector<std::shared_ptr<RawImageBuffer>> nearestBuffers;
+        
+        auto right = std::lower_bound(
+            buffers.begin(), buffers.end(), timestampNs,
+            [](const auto& x, int64_t timestampNs) { return x->metadata.timestampNs < timestampNs; });
+        
+        auto left = right;
+        
+        while(static_cast<int>(nearestBuffers.size()) < numBuffers) {
+            // Filter out by type
+            while(left != buffers.begin() && (*(left - 1))->metadata.rawType != type)
+                --left;
+            
+            while(right != buffers.end() && (*right)->metadata.rawType != type)
+                ++right;
+            
+            const bool hasLeft = left != buffers.begin();
+            const bool hasRight = right != buffers.end();
+            
+            if(!hasLeft && !hasRight)
+                break;
+            
+            if(hasRight &&
+               (!hasLeft || (*right)->metadata.timestampNs - timestampNs < timestampNs - (*(left - 1))->metadata.timestampNs))
+            {
+                nearestBuffers.push_back(*right);
+                ++right;
+            }
+            else {
+                --left;
+                nearestBuffers.push_back(*left);
+            }
+        }
+        
+        return nearestBuffers;
+    }
+
+    static std::vector<std::shared_ptr<RawImageBuffer>> FindBestBuffers(
+        const std::deque<std::shared_ptr<RawImageBuffer>>& buffers, RawType type, int64_t timestampNs, int64_t windowNs, int numBuffers) {
+        
         if(numBuffers <= 0)
             return std::vector<std::shared_ptr<RawImageBuffer>>();
         
-        std::vector<std::shared_ptr<RawImageBuffer>> sortedBuffers = buffers;
+        // Only look at the buffers within the window
+        auto begin = buffers.begin();
+        auto end = buffers.end();
+        
+        if(windowNs > 0) {
+            begin = std::lower_bound(
+                buffers.begin(), buffers.end(), timestampNs - windowNs,
+                [](const auto& x, int64_t timestampNs) { return x->metadata.timestampNs < timestampNs; });
+            
+            end = std::upper_bound(
+                begin, buffers.end(), timestampNs + windowNs,
+                [](int64_t timestampNs, const auto& x) { return timestampNs < x->metadata.timestampNs; });
+        }
         
-        // Sort by distance to reference timestamp
+        std::vector<std::shared_ptr<RawImageBuffer>> sortedBuffers;
+        
+        for(auto it = begin; it != end; ++it) {
+            if((*it)->metadata.rawType == type)
+                sortedBuffers.push_back(*it);
+        }
+        
+        // Sort by distance to reference timestamp first, so frames with the same score are picked by time
         std::sort(sortedBuffers.begin(), sortedBuffers.end(), [timestampNs](auto a, auto b) {
             return std::abs(a->metadata.timestampNs - timestampNs) < std::abs(b->metadata.timestampNs - timestampNs);
         });
         
-        // Filter out by type
-        sortedBuffers.erase(
-            std::remove_if(sortedBuffers.begin(), sortedBuffers.end(), [type](auto x) { return x->metadata.rawType != type; }),
-            sortedBuffers.end());
+        std::stable_sort(sortedBuffers.begin(), sortedBuffers.end(), [](auto a, auto b) {
+            return a->metadata.quality.score > b->metadata.quality.score;
+        });
         
         numBuffers = std::min((int) sortedBuffers.size(), numBuffers);
         
@@ -33,10 +106,55 @@ namespace motioncam {
 
     RawBufferManager::RawBufferManager() :
         mMemoryUseBytes(0),
-        mNumBuffers(0)
+        mNumBuffers(0),
+        mNumHdrBuffers(0),
+        mEmbedPreviews(false),
+        mGeneration(0),
+        mRetentionWindow(DEFAULT_RETENTION_WINDOW),
+        mNumTemporaryBuffers(0),
+        mActiveWrites(0),
+        mStopWriters(false),
+        mPendingBytes(0),
+        mWriteBytes(0),
+        mMaxPendingContainers(2),
+        mMaxPendingBytes(0),
+        mNumWriters(1),
+        mSavePolicy(SaveQueuePolicy::SPILL_TO_DISK),
+        mSpillFormat(ContainerFormat::ZIP),
+        mNumDropped(0),
+        mNumCompleted(0),
+        mTotalLatencyMs(0),
+        mLastLatencyMs(0),
+        mCompressedBytes(0),
+        mCompactionMinAgeNs(0),
+        mMaxCompressedBytes(0),
+        mStopCompaction(false)
     {
     }
 
+    RawBufferManager::~RawBufferManager() {
+        {
+            std::lock_guard<std::mutex> lock(mCompactionLock);
+            mStopCompaction = true;
+        }
+        
+        mCompactionCv.notify_all();
+        
+        if(mCompactionThread.joinable())
+            mCompactionThread.join();
+        
+        // Writers finish what's queued before stopping
+        {
+            std::lock_guard<std::mutex> lock(mPendingLock);
+            mStopWriters = true;
+        }
+        
+        mPendingCv.notify_all();
+        
+        for(auto& writer : mWriters)
+            writer.join();
+    }
+
     RawBufferManager::LockedBuffers::LockedBuffers() = default;
     RawBufferManager::LockedBuffers::LockedBuffers(
         std::vector<std::shared_ptr<RawImageBuffer>> buffers) : mBuffers(std::move(buffers)) {}
@@ -53,17 +171,82 @@ namespace motioncam {
         mUnusedBuffers.enqueue(buffer);
         
         ++mNumBuffers;
-        mMemoryUseBytes += static_cast<int>(buffer->data->len());
+        mMemoryUseBytes += static_cast<int64_t>(buffer->data->len());
+    }
+
+    void RawBufferManager::setBufferPool(std::shared_ptr<RawBufferPool> bufferPool) {
+        std::atomic_store(&mBufferPool, bufferPool);
     }
 
     int RawBufferManager::numBuffers() const {
         return mNumBuffers;
     }
 
-    int RawBufferManager::memoryUseBytes() const {
+    int64_t RawBufferManager::memoryUseBytes() const {
         return mMemoryUseBytes;
     }
 
+    int64_t RawBufferManager::trimMemory(int64_t maxMemoryUseBytes) {
+        std::shared_ptr<RawImageBuffer> buffer;
+        int64_t freedBytes = 0;
+        
+        auto freeBuffer = [&]() {
+            const int64_t len = static_cast<int64_t>(buffer->data->len());
+            
+            buffer = nullptr;
+            
+            // A temporary buffer is still around, it becomes one of ours instead
+            if(takeTemporaryBuffer())
+                return;
+            
+            --mNumBuffers;
+            mMemoryUseBytes -= len;
+            
+            freedBytes += len;
+        };
+        
+        // Unused buffers go first
+        while(mMemoryUseBytes > maxMemoryUseBytes && mUnusedBuffers.try_dequeue(buffer))
+            freeBuffer();
+        
+        if(mMemoryUseBytes <= maxMemoryUseBytes)
+            return freedBytes;
+        
+        // Then the oldest ready frames. Buffers in use are left alone, they'll be trimmed next time.
+        std::lock_guard<std::recursive_mutex> lock(mMutex);
+        
+        moveIncomingBuffers();
+        
+        while(mMemoryUseBytes > maxMemoryUseBytes && mReservedBuffers.try_dequeue(buffer))
+            freeBuffer();
+        
+        while(mMemoryUseBytes > maxMemoryUseBytes) {
+            auto it = findBufferToReuse();
+            
+            // HDR frames are kept until the capture has been saved
+            if(it == mReadyBuffers.end() || (*it)->metadata.rawType != RawType::ZSL)
+                break;
+            
+            buffer = *it;
+            
+            onReadyBufferRemoved(buffer);
+            mReadyBuffers.erase(it);
+            
+            freeBuffer();
+        }
+        
+        return freedBytes;
+    }
+
+    bool RawBufferManager::takeTemporaryBuffer() {
+        int numTemporaryBuffers = mNumTemporaryBuffers;
+        
+        while(numTemporaryBuffers > 0 && !mNumTemporaryBuffers.compare_exchange_weak(numTemporaryBuffers, numTemporaryBuffers - 1)) {
+        }
+        
+        return numTemporaryBuffers > 0;
+    }
+
     void RawBufferManager::reset() {
         std::shared_ptr<RawImageBuffer> buffer;
         while(mUnusedBuffers.try_dequeue(buffer)) {
@@ -71,11 +254,132 @@ namespace motioncam {
 
         {
             std::lock_guard<std::recursive_mutex> lock(mMutex);
+            
+            while(mIncomingBuffers.try_dequeue(buffer)) {
+            }
+            
+            while(mReservedBuffers.try_dequeue(buffer)) {
+            }
+            
             mReadyBuffers.clear();
+            mUncompressibleFrames.clear();
         }
         
+        mCompressedBytes = 0;
         mNumBuffers = 0;
+        mNumHdrBuffers = 0;
         mMemoryUseBytes = 0;
+        mNumTemporaryBuffers = 0;
+        
+        std::atomic_store(&mBufferPool, std::shared_ptr<RawBufferPool>());
+        
+        // Shared buffers that come back after this are dropped
+        ++mGeneration;
+    }
+
+    void RawBufferManager::moveIncomingBuffers() {
+        std::shared_ptr<RawImageBuffer> buffer;
+        
+        while(mIncomingBuffers.try_dequeue(buffer))
+            insertReadyBuffer(buffer);
+    }
+
+    void RawBufferManager::insertReadyBuffer(const std::shared_ptr<RawImageBuffer>& buffer) {
+        // Usually the newest buffer so this is an append
+        auto it = std::upper_bound(
+            mReadyBuffers.begin(), mReadyBuffers.end(), buffer->metadata.timestampNs,
+            [](int64_t timestampNs, const auto& x) { return timestampNs < x->metadata.timestampNs; });
+        
+        mReadyBuffers.insert(it, buffer);
+    }
+
+    RawBufferManager::ReadyBuffers::iterator RawBufferManager::findReadyBuffer(int64_t timestampNs) {
+        auto it = std::lower_bound(
+            mReadyBuffers.begin(), mReadyBuffers.end(), timestampNs,
+            [](const auto& x, int64_t timestampNs) { return x->metadata.timestampNs < timestampNs; });
+        
+        if(it != mReadyBuffers.end() && (*it)->metadata.timestampNs == timestampNs)
+            return it;
+        
+        return mReadyBuffers.end();
+    }
+
+    RawBufferManager::ReadyBuffers::iterator RawBufferManager::findNearestReadyBuffer(int64_t timestampNs) {
+        auto it = std::lower_bound(
+            mReadyBuffers.begin(), mReadyBuffers.end(), timestampNs,
+            [](const auto& x, int64_t timestampNs) { return x->metadata.timestampNs < timestampNs; });
+        
+        if(it == mReadyBuffers.begin())
+            return it;
+        
+        if(it == mReadyBuffers.end() || timestampNs - (*(it - 1))->metadata.timestampNs <= (*it)->metadata.timestampNs - timestampNs)
+            return it - 1;
+        
+        return it;
+    }
+
+    void RawBufferManager::removeReadyBuffers(const std::vector<std::shared_ptr<RawImageBuffer>>& buffers) {
+        for(auto& buffer : buffers) {
+            auto it = findReadyBuffer(buffer->metadata.timestampNs);
+            
+            // Timestamps should be unique but make sure we have the right buffer
+            while(it != mReadyBuffers.end() && (*it)->metadata.timestampNs == buffer->metadata.timestampNs && *it != buffer)
+                ++it;
+            
+            if(it != mReadyBuffers.end() && *it == buffer) {
+                onReadyBufferRemoved(buffer);
+                mReadyBuffers.erase(it);
+            }
+        }
+    }
+
+    void RawBufferManager::onReadyBufferRemoved(const std::shared_ptr<RawImageBuffer>& buffer) {
+        if(buffer->metadata.rawType == RawType::HDR)
+            --mNumHdrBuffers;
+    }
+
+    RawBufferManager::ReadyBuffers::iterator RawBufferManager::findBufferToReuse() {
+        // Compressed buffers are skipped, their memory isn't the size of a frame
+        auto oldest = std::find_if(mReadyBuffers.begin(), mReadyBuffers.end(), [](const auto& x) { return !x->isCompressed; });
+        
+        // Keep HDR frames in order, they are needed until the capture has been saved
+        if(oldest == mReadyBuffers.end() || oldest->get()->metadata.rawType != RawType::ZSL)
+            return oldest;
+        
+        // Pick the lowest scoring of the oldest frames, frames that haven't been scored go first
+        const int retentionWindow = mRetentionWindow;
+        
+        auto worst = oldest;
+        int n = 0;
+        
+        for(auto it = oldest; it != mReadyBuffers.end() && n < retentionWindow; ++it) {
+            if((*it)->isCompressed || (*it)->metadata.rawType != RawType::ZSL)
+                continue;
+            
+            if((*it)->metadata.quality.score < (*worst)->metadata.quality.score)
+                worst = it;
+            
+            ++n;
+        }
+        
+        return worst;
+    }
+
+    void RawBufferManager::dropCompressedBuffers(int64_t maxCompressedBytes) {
+        auto it = mReadyBuffers.begin();
+        
+        // Oldest first
+        while(mCompressedBytes > maxCompressedBytes && it != mReadyBuffers.end()) {
+            if(!(*it)->isCompressed) {
+                ++it;
+                continue;
+            }
+            
+            mCompressedBytes -= static_cast<int64_t>((*it)->data->len());
+            
+            onReadyBufferRemoved(*it);
+            it = mReadyBuffers.erase(it);
+        }
     }
 
     std::shared_ptr<RawImageBuffer> RawBufferManager::dequeueUnusedBuffer() {
@@ -85,38 +389,137 @@ namespace motioncam {
             return buffer;
         }
         
-        {
-            std::lock_guard<std::recursive_mutex> lock(mMutex);
-
-            if(!mReadyBuffers.empty()) {
-                buffer = mReadyBuffers.front();
-                mReadyBuffers.erase(mReadyBuffers.begin());
-
-                return buffer;
+        // Don't wait if someone else is using the ready buffers, take the one that was set aside instead.
+        // If there isn't one the frame is skipped.
+        std::unique_lock<std::recursive_mutex> lock(mMutex, std::try_to_lock);
+        
+        if(!lock.owns_lock()) {
+            mReservedBuffers.try_dequeue(buffer);
+            return buffer;
+        }
+        
+        moveIncomingBuffers();
+        
+        // The buffer set aside was picked before any of the ready buffers so it goes first
+        if(!mReservedBuffers.try_dequeue(buffer)) {
+            auto it = findBufferToReuse();
+            
+            if(it != mReadyBuffers.end()) {
+                buffer = *it;
+                mReadyBuffers.erase(it);
+                
+                onReadyBufferRemoved(buffer);
             }
         }
+        
+        if(buffer) {
+            reserveBuffer();
+            return buffer;
+        }
+        
+        lock.unlock();
+        
+        // Last resort, take back a buffer from a capture that hasn't been processed yet. The ready buffers
+        // aren't needed for this so don't hold them up while the frame is copied.
+        if(!reclaimSharedBuffer() || mUnusedBuffers.try_dequeue(buffer))
+            return buffer;
+        
+        // The buffer belonged to a capture that gives its frames back to the ready buffers, take it from there
+        if(!lock.try_lock())
+            return buffer;
+        
+        auto it = findBufferToReuse();
+        
+        if(it != mReadyBuffers.end()) {
+            buffer = *it;
+            mReadyBuffers.erase(it);
+            
+            onReadyBufferRemoved(buffer);
+        }
 
-        return nullptr;
+        return buffer;
     }
 
-    void RawBufferManager::enqueueReadyBuffer(const std::shared_ptr<RawImageBuffer>& buffer) {
-        std::lock_guard<std::recursive_mutex> lock(mMutex);
+    void RawBufferManager::reserveBuffer() {
+        if(mReservedBuffers.size_approx() > 0 || mReadyBuffers.size() < 2)
+            return;
+        
+        auto it = findBufferToReuse();
+        
+        // HDR frames are left alone, a capture that hasn't been saved yet may need them
+        if(it == mReadyBuffers.end() || (*it)->metadata.rawType != RawType::ZSL)
+            return;
         
-        mReadyBuffers.push_back(buffer);
+        mReservedBuffers.enqueue(*it);
+        
+        onReadyBufferRemoved(*it);
+        mReadyBuffers.erase(it);
     }
 
-    int RawBufferManager::numHdrBuffers() {
-        std::lock_guard<std::recursive_mutex> lock(mMutex);
+    std::vector<std::shared_ptr<RawImageBuffer>> RawBufferManager::shareBuffers(
+        const std::vector<std::shared_ptr<RawImageBuffer>>& buffers, bool returnToReadyBuffers)
+    {
+        std::vector<std::shared_ptr<RawImageBuffer>> sharedBuffers;
+        const int generation = mGeneration;
         
-        int hdrBuffers = 0;
+        // Each buffer is given back once the last reference to its shared copy is gone
+        for(auto& buffer : buffers) {
+            sharedBuffers.emplace_back(buffer.get(), [this, buffer, generation, returnToReadyBuffers](RawImageBuffer*) {
+                if(generation != mGeneration)
+                    return;
+                
+                if(returnToReadyBuffers)
+                    returnBuffers({ buffer });
+                else
+                    mUnusedBuffers.enqueue(buffer);
+            });
+        }
         
-        for(auto& e : mReadyBuffers) {
-            if(e->metadata.rawType == RawType::HDR) {
-                ++hdrBuffers;
-            }
+        return sharedBuffers;
+    }
+
+    bool RawBufferManager::reclaimSharedBuffer() {
+        // The copy comes out of the pool so it can't go over the memory budget
+        auto bufferPool = std::atomic_load(&mBufferPool);
+        if(!bufferPool)
+            return false;
+        
+        std::lock_guard<std::mutex> lock(mPendingLock);
+        
+        // Start with the newest container, the oldest will be processed first
+        for(auto it = mPendingContainers.rbegin(); it != mPendingContainers.rend(); ++it) {
+            if(!it->container->hasSharedFrames())
+                continue;
+            
+            auto data = bufferPool->allocate();
+            if(!data)
+                return false;
+            
+            const int64_t len = static_cast<int64_t>(data->len());
+            
+            // The copy is one of our buffers, it joins the unused buffers once the container is done with it
+            auto copy = std::make_shared<RawImageBuffer>(std::move(data));
+            
+            ++mNumBuffers;
+            mMemoryUseBytes += len;
+            
+            auto sharedCopy = shareBuffers({ copy }, false).front();
+            
+            return it->container->copySharedFrame(sharedCopy);
         }
         
-        return hdrBuffers;
+        return false;
+    }
+
+    void RawBufferManager::enqueueReadyBuffer(const std::shared_ptr<RawImageBuffer>& buffer) {
+        if(buffer->metadata.rawType == RawType::HDR)
+            ++mNumHdrBuffers;
+        
+        mIncomingBuffers.enqueue(buffer);
+    }
+
+    int RawBufferManager::numHdrBuffers() {
+        return mNumHdrBuffers;
     }
 
     void RawBufferManager::discardBuffer(const std::shared_ptr<RawImageBuffer>& buffer) {
@@ -130,7 +533,14 @@ namespace motioncam {
     void RawBufferManager::returnBuffers(const std::vector<std::shared_ptr<RawImageBuffer>>& buffers) {
         std::lock_guard<std::recursive_mutex> lock(mMutex);
 
-        std::move(buffers.begin(), buffers.end(), std::back_inserter(mReadyBuffers));
+        moveIncomingBuffers();
+        
+        for(auto& buffer : buffers) {
+            if(buffer->metadata.rawType == RawType::HDR)
+                ++mNumHdrBuffers;
+            
+            insertReadyBuffer(buffer);
+        }
     }
 
     void RawBufferManager::save(
@@ -139,20 +549,29 @@ namespace motioncam {
             int64_t referenceTimestampNs,
             const RawCameraMetadata& metadata,
             const PostProcessSettings& settings,
-            const std::string& outputPath)
+            const std::string& outputPath,
+            const FrameSelection& selection)
     {
+        const auto queuedTime = std::chrono::steady_clock::now();
         std::vector<std::shared_ptr<RawImageBuffer>> buffers;
 
         {
             std::lock_guard<std::recursive_mutex> lock(mMutex);
 
+            moveIncomingBuffers();
+            
             if (mReadyBuffers.empty())
                 return;
 
             auto typedBuffers = FindNearestBuffers(mReadyBuffers, type, referenceTimestampNs, numSaveBuffers);
             numSaveBuffers = numSaveBuffers - (int) typedBuffers.size();
             
-            auto zslBuffers = FindNearestBuffers(mReadyBuffers, RawType::ZSL, referenceTimestampNs, numSaveBuffers);
+            std::vector<std::shared_ptr<RawImageBuffer>> zslBuffers;
+            
+            if(selection.mode == FrameSelectionMode::BEST_QUALITY)
+                zslBuffers = FindBestBuffers(mReadyBuffers, RawType::ZSL, referenceTimestampNs, selection.windowMs * 1000 * 1000, numSaveBuffers);
+            else
+                zslBuffers = FindNearestBuffers(mReadyBuffers, RawType::ZSL, referenceTimestampNs, numSaveBuffers);
 
             // Set reference timestamp
             if(!zslBuffers.empty())
@@ -167,194 +586,762 @@ namespace motioncam {
             buffers.insert(buffers.end(), typedBuffers.begin(), typedBuffers.end());
             buffers.insert(buffers.end(), zslBuffers.begin(), zslBuffers.end());
             
-            // Remove from the ready buffers until we copy them
-            mReadyBuffers.erase(
-                std::remove_if(
-                    mReadyBuffers.begin(),
-                    mReadyBuffers.end(),
-                    [buffers](auto& e) { return std::find(buffers.begin(), buffers.end(), e) != buffers.end(); }),
-                mReadyBuffers.end());
+            // Remove from the ready buffers while they are saved
+            removeReadyBuffers(buffers);
         }
 
-        // Copy the buffers
-        auto rawContainer = std::make_shared<RawContainer>(
-                metadata,
-                settings,
-                referenceTimestampNs,
-                type == RawType::HDR,
-                buffers);
-
-        // Return buffers
-        auto it = buffers.begin();
-        while(it != buffers.end()) {
-            mUnusedBuffers.enqueue(*it);
-            ++it;
-        }
-
-        // Save the container
-        if(mPendingContainers.size_approx() > 1) {
-            rawContainer->save(outputPath);
-        }
-        else {
-            mPendingContainers.enqueue(rawContainer);
-        }
+        decompressBuffers(buffers);
+        
+        // Render the previews while we still have the buffers
+        std::vector<uint8_t> preview;
+        std::vector<std::shared_ptr<RawFrameProxy>> proxies;
+        
+        createPreviews(buffers, metadata, settings, referenceTimestampNs, preview, proxies);
+        
+        queueSave(buffers,
+                  metadata,
+                  settings,
+                  referenceTimestampNs,
+                  type == RawType::HDR,
+                  false,
+                  std::move(preview),
+                  std::move(proxies),
+                  outputPath,
+                  queuedTime);
     }
 
     void RawBufferManager::save(RawCameraMetadata& metadata,
                                 int64_t referenceTimestampNs,
                                 int numSaveBuffers,
                                 const PostProcessSettings& settings,
-                                const std::string& outputPath)
+                                const std::string& outputPath,
+                                const FrameSelection& selection)
     {
         Measure measure("RawBufferManager::save()");
         
+        const auto queuedTime = std::chrono::steady_clock::now();
         std::vector<std::shared_ptr<RawImageBuffer>> buffers;
 
         {
             std::lock_guard<std::recursive_mutex> lock(mMutex);
 
+            moveIncomingBuffers();
+            
             if(mReadyBuffers.empty())
                 return;
 
-            // Find reference frame
-            int referenceIdx = static_cast<int>(mReadyBuffers.size()) - 1;
-
-            for(int i = 0; i < mReadyBuffers.size(); i++) {
-                if(mReadyBuffers[i]->metadata.timestampNs == referenceTimestampNs) {
-                    referenceIdx = i;
-                    buffers.push_back(mReadyBuffers[i]);
-                    break;
-                }
+            // Find reference frame, use the latest if it's gone
+            auto referenceIt = findReadyBuffer(referenceTimestampNs);
+            if(referenceIt == mReadyBuffers.end())
+                referenceIt = mReadyBuffers.end() - 1;
+            
+            if(selection.mode == FrameSelectionMode::BEST_QUALITY) {
+                // The best frame becomes the reference
+                buffers = FindBestBuffers(mReadyBuffers,
+                                          (*referenceIt)->metadata.rawType,
+                                          (*referenceIt)->metadata.timestampNs,
+                                          selection.windowMs * 1000 * 1000,
+                                          numSaveBuffers + 1);
+                
+                if(buffers.empty())
+                    return;
+                
+                referenceTimestampNs = buffers.front()->metadata.timestampNs;
             }
+            else {
+                const int numReadyBuffers = static_cast<int>(mReadyBuffers.size());
+                const int referenceIdx = static_cast<int>(referenceIt - mReadyBuffers.begin());
+            
+                buffers.push_back(mReadyBuffers[referenceIdx]);
 
-            // Update timestamp
-            referenceTimestampNs = mReadyBuffers[referenceIdx]->metadata.timestampNs;
-
-            // Add closest images
-            int leftIdx  = referenceIdx - 1;
-            int rightIdx = referenceIdx + 1;
+                // Update timestamp
+                referenceTimestampNs = mReadyBuffers[referenceIdx]->metadata.timestampNs;
 
-            while(numSaveBuffers > 0 && (leftIdx > 0 || rightIdx < mReadyBuffers.size())) {
-                int64_t leftDifference = std::numeric_limits<long>::max();
-                int64_t rightDifference = std::numeric_limits<long>::max();
+                // Add closest images
+                int leftIdx  = referenceIdx - 1;
+                int rightIdx = referenceIdx + 1;
 
-                if(leftIdx >= 0)
-                    leftDifference = std::abs(mReadyBuffers[leftIdx]->metadata.timestampNs - mReadyBuffers[referenceIdx]->metadata.timestampNs);
+                while(numSaveBuffers > 0 && (leftIdx >= 0 || rightIdx < numReadyBuffers)) {
+                    int64_t leftDifference = std::numeric_limits<long>::max();
+                    int64_t rightDifference = std::numeric_limits<long>::max();
 
-                if(rightIdx < mReadyBuffers.size())
-                    rightDifference = std::abs(mReadyBuffers[rightIdx]->metadata.timestampNs - mReadyBuffers[referenceIdx]->metadata.timestampNs);
+                    if(leftIdx >= 0)
+                        leftDifference = std::abs(mReadyBuffers[leftIdx]->metadata.timestampNs - mReadyBuffers[referenceIdx]->metadata.timestampNs);
 
-                // Add closest buffer to reference
-                if(leftDifference < rightDifference) {
-                    buffers.push_back(mReadyBuffers[leftIdx]);
-                    mReadyBuffers[leftIdx] = nullptr;
+                    if(rightIdx < numReadyBuffers)
+                        rightDifference = std::abs(mReadyBuffers[rightIdx]->metadata.timestampNs - mReadyBuffers[referenceIdx]->metadata.timestampNs);
 
-                    --leftIdx;
-                }
-                else {
-                    buffers.push_back(mReadyBuffers[rightIdx]);
-                    mReadyBuffers[rightIdx] = nullptr;
+                    // Add closest buffer to reference
+                    if(leftDifference < rightDifference) {
+                        buffers.push_back(mReadyBuffers[leftIdx]);
+                        --leftIdx;
+                    }
+                    else {
+                        buffers.push_back(mReadyBuffers[rightIdx]);
+                        ++rightIdx;
+                    }
 
-                    ++rightIdx;
+                    --numSaveBuffers;
                 }
-
-                --numSaveBuffers;
             }
 
-            // Clear the reference frame
-            mReadyBuffers[referenceIdx] = nullptr;
+            // Remove from the ready buffers while they are saved
+            removeReadyBuffers(buffers);
+        }
 
-            // Clear out buffers we intend to copy
-            auto it = mReadyBuffers.begin();
-            while(it != mReadyBuffers.end()) {
-                if(*it == nullptr) {
-                    it = mReadyBuffers.erase(it);
+        decompressBuffers(buffers);
+        
+        // Render the previews while we still have the buffers
+        std::vector<uint8_t> preview;
+        std::vector<std::shared_ptr<RawFrameProxy>> proxies;
+        
+        createPreviews(buffers, metadata, settings, referenceTimestampNs, preview, proxies);
+        
+        queueSave(buffers,
+                  metadata,
+                  settings,
+                  referenceTimestampNs,
+                  false,
+                  true,
+                  std::move(preview),
+                  std::move(proxies),
+                  outputPath,
+                  queuedTime);
+    }
+
+    void RawBufferManager::queueSave(const std::vector<std::shared_ptr<RawImageBuffer>>& buffers,
+                                     const RawCameraMetadata& metadata,
+                                     const PostProcessSettings& settings,
+                                     int64_t referenceTimestampNs,
+                                     bool isHdr,
+                                     bool returnToReadyBuffers,
+                                     std::vector<uint8_t> preview,
+                                     std::vector<std::shared_ptr<RawFrameProxy>> proxies,
+                                     const std::string& outputPath,
+                                     TimePoint queuedTime)
+    {
+        SaveJobStats stats;
+        
+        stats.outputPath = outputPath;
+        stats.numFrames = static_cast<int>(buffers.size());
+        
+        for(auto& buffer : buffers)
+            stats.bytes += static_cast<int64_t>(buffer->data->len());
+        
+        // Released once the lock is no longer held since they give their buffers back
+        std::vector<std::shared_ptr<RawContainer>> droppedContainers;
+        std::vector<WriteJob> droppedJobs;
+        
+        std::unique_lock<std::mutex> lock(mPendingLock);
+        
+        // There's always room for one capture, however large
+        auto isFull = [&](size_t numQueued, int64_t queuedBytes) {
+            if(numQueued == 0)
+                return false;
+            
+            return numQueued >= static_cast<size_t>(mMaxPendingContainers) ||
+                   (mMaxPendingBytes > 0 && queuedBytes + stats.bytes > mMaxPendingBytes);
+        };
+        
+        if(isFull(mPendingContainers.size(), mPendingBytes)) {
+            if(mSavePolicy == SaveQueuePolicy::SPILL_TO_DISK) {
+                // Don't wait for the writers, save() is called from the UI thread. If they have fallen behind
+                // make room by dropping the oldest captures that haven't started writing.
+                while(isFull(mWriteJobs.size(), mWriteBytes)) {
+                    logger::log("Dropping oldest capture waiting to be written");
+                    
+                    mWriteBytes -= mWriteJobs.front().stats.bytes;
+                    
+                    droppedJobs.push_back(std::move(mWriteJobs.front()));
+                    mWriteJobs.pop_front();
+                    
+                    droppedJobs.back().stats.dropped = true;
+                    onSaveCompleted(droppedJobs.back().stats, droppedJobs.back().queuedTime);
                 }
-                else {
-                    ++it;
+                
+                stats.spilled = true;
+                mWriteBytes += stats.bytes;
+                
+                mWriteJobs.push_back({
+                    buffers,
+                    metadata,
+                    settings,
+                    referenceTimestampNs,
+                    isHdr,
+                    returnToReadyBuffers,
+                    std::move(preview),
+                    std::move(proxies),
+                    outputPath,
+                    mSpillFormat,
+                    stats,
+                    queuedTime
+                });
+                
+                const size_t numWriters = mWriters.size();
+                
+                if(numWriters < static_cast<size_t>(mNumWriters) && numWriters < mWriteJobs.size() + static_cast<size_t>(mActiveWrites))
+                    mWriters.emplace_back(&RawBufferManager::doWriteJobs, this);
+                
+                lock.unlock();
+                mPendingCv.notify_all();
+                
+                for(auto& job : droppedJobs)
+                    returnSavedBuffers(job.buffers, job.returnToReadyBuffers);
+                
+                return;
+            }
+            else if(mSavePolicy == SaveQueuePolicy::BLOCK) {
+                mPendingCv.wait(lock, [&] { return !isFull(mPendingContainers.size(), mPendingBytes); });
+            }
+            else {
+                while(isFull(mPendingContainers.size(), mPendingBytes)) {
+                    logger::log("Dropping oldest capture waiting to be processed");
+                    
+                    auto& pending = mPendingContainers.front();
+                    
+                    mPendingBytes -= pending.stats.bytes;
+                    
+                    pending.stats.dropped = true;
+                    onSaveCompleted(pending.stats, pending.queuedTime);
+                    
+                    droppedContainers.push_back(std::move(pending.container));
+                    mPendingContainers.pop_front();
                 }
             }
         }
-
-        // Copy the buffers
+        
+        // Share the buffers, they are returned once the container is done with them
         auto rawContainer = std::make_shared<RawContainer>(
                 metadata,
                 settings,
                 referenceTimestampNs,
-                false,
-                buffers);
+                isHdr,
+                shareBuffers(buffers, returnToReadyBuffers),
+                true);
+
+        rawContainer->setPreviews(preview, proxies);
+
+        mPendingBytes += stats.bytes;
+        mPendingContainers.push_back({ rawContainer, stats, queuedTime });
+        
+        lock.unlock();
+        
+        droppedContainers.clear();
+    }
+
+    void RawBufferManager::doWriteJobs() {
+        std::unique_lock<std::mutex> lock(mPendingLock);
+        
+        while(true) {
+            mPendingCv.wait(lock, [&] { return mStopWriters || !mWriteJobs.empty(); });
+            
+            if(mWriteJobs.empty())
+                break;
+            
+            WriteJob job = std::move(mWriteJobs.front());
+            mWriteJobs.pop_front();
+            
+            mWriteBytes -= job.stats.bytes;
+            ++mActiveWrites;
+            
+            mPendingCv.notify_all();
+            lock.unlock();
+            
+            try {
+                writeContainer(job.buffers,
+                               job.metadata,
+                               job.settings,
+                               job.referenceTimestampNs,
+                               job.isHdr,
+                               job.returnToReadyBuffers,
+                               job.preview,
+                               job.proxies,
+                               job.outputPath,
+                               job.format);
+            }
+            catch(std::exception& e) {
+                // Already logged, the buffers have been returned
+                job.stats.failed = true;
+            }
+            
+            lock.lock();
+            
+            --mActiveWrites;
+            onSaveCompleted(job.stats, job.queuedTime);
+        }
+    }
 
-        // Return buffers
+    void RawBufferManager::onSaveCompleted(SaveJobStats stats, TimePoint queuedTime) {
+        stats.latencyMs =
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - queuedTime).count();
+        
+        if(stats.dropped) {
+            ++mNumDropped;
+        }
+        else {
+            mLastLatencyMs = stats.latencyMs;
+            mTotalLatencyMs += stats.latencyMs;
+            
+            ++mNumCompleted;
+        }
+        
+        mRecentJobs.push_back(std::move(stats));
+        
+        if(mRecentJobs.size() > MAX_RECENT_SAVE_JOBS)
+            mRecentJobs.pop_front();
+    }
+
+    void RawBufferManager::setSaveQueueOptions(int maxPendingContainers,
+                                               int numWriters,
+                                               SaveQueuePolicy policy,
+                                               int64_t maxPendingBytes,
+                                               ContainerFormat spillFormat)
+    {
         {
-            std::lock_guard<std::recursive_mutex> lock(mMutex);
-            mReadyBuffers.insert(mReadyBuffers.end(), buffers.begin(), buffers.end());
+            std::lock_guard<std::mutex> lock(mPendingLock);
+            
+            mMaxPendingContainers = std::max(1, maxPendingContainers);
+            mMaxPendingBytes = std::max<int64_t>(0, maxPendingBytes);
+            mNumWriters = std::max(1, numWriters);
+            mSavePolicy = policy;
+            mSpillFormat = spillFormat;
         }
+        
+        mPendingCv.notify_all();
+    }
 
-        // Save container
-        if(mPendingContainers.size_approx() > 1) {
-            rawContainer->save(outputPath);
+    SaveQueueStats RawBufferManager::getSaveQueueStats() {
+        std::lock_guard<std::mutex> lock(mPendingLock);
+        
+        SaveQueueStats stats;
+        
+        stats.pendingContainers = static_cast<int>(mPendingContainers.size());
+        stats.pendingWrites = static_cast<int>(mWriteJobs.size()) + mActiveWrites;
+        stats.pendingBytes = mPendingBytes + mWriteBytes;
+        stats.numDropped = mNumDropped;
+        stats.lastLatencyMs = mLastLatencyMs;
+        stats.averageLatencyMs = mNumCompleted > 0 ? mTotalLatencyMs / mNumCompleted : 0;
+        stats.recentJobs.assign(mRecentJobs.begin(), mRecentJobs.end());
+        
+        return stats;
+    }
+
+    void RawBufferManager::returnSavedBuffers(const std::vector<std::shared_ptr<RawImageBuffer>>& buffers, bool returnToReadyBuffers) {
+        if(returnToReadyBuffers) {
+            returnBuffers(buffers);
         }
         else {
-            mPendingContainers.enqueue(rawContainer);
+            for(auto& buffer : buffers)
+                mUnusedBuffers.enqueue(buffer);
+        }
+    }
+
+    void RawBufferManager::writeContainer(const std::vector<std::shared_ptr<RawImageBuffer>>& buffers,
+                                          const RawCameraMetadata& metadata,
+                                          const PostProcessSettings& settings,
+                                          int64_t referenceTimestampNs,
+                                          bool isHdr,
+                                          bool returnToReadyBuffers,
+                                          const std::vector<uint8_t>& preview,
+                                          const std::vector<std::shared_ptr<RawFrameProxy>>& proxies,
+                                          const std::string& outputPath,
+                                          ContainerFormat format)
+    {
+        Measure measure("RawBufferManager::writeContainer()");
+
+        auto returnBuffer = [this, returnToReadyBuffers](const std::shared_ptr<RawImageBuffer>& buffer) {
+            returnSavedBuffers({ buffer }, returnToReadyBuffers);
+        };
+
+        size_t numWritten = 0;
+
+        try {
+            // Zip containers are written in one go, the buffers are returned once it has been saved
+            if(format == ContainerFormat::ZIP) {
+                {
+                    RawContainer container(metadata, settings, referenceTimestampNs, isHdr, buffers, true);
+                    
+                    container.setPreviews(preview, proxies);
+                    container.save(outputPath, ContainerFormat::ZIP);
+                }
+                
+                for(auto& buffer : buffers) {
+                    returnBuffer(buffer);
+                    ++numWritten;
+                }
+                
+                return;
+            }
+            
+            RawContainerWriter writer(outputPath);
+
+            writer.begin(metadata, settings, referenceTimestampNs, isHdr, preview, proxies);
+
+            // Each buffer is returned as soon as it has been written
+            writer.appendFrames(buffers, [&](const std::shared_ptr<RawImageBuffer>& buffer) {
+                returnBuffer(buffer);
+                ++numWritten;
+            });
+
+            writer.finish();
+        }
+        catch(std::exception& e) {
+            logger::log("Failed to write container: " + std::string(e.what()));
+
+            // Make sure the rest of the buffers are not lost
+            for(size_t i = numWritten; i < buffers.size(); i++)
+                returnBuffer(buffers[i]);
+
+            throw;
+        }
+    }
+
+    void RawBufferManager::setEmbedPreviews(bool embedPreviews) {
+        mEmbedPreviews = embedPreviews;
+    }
+
+    void RawBufferManager::setRetentionWindow(int numFrames) {
+        mRetentionWindow = std::max(1, numFrames);
+    }
+
+    void RawBufferManager::createPreviews(const std::vector<std::shared_ptr<RawImageBuffer>>& buffers,
+                                          const RawCameraMetadata& metadata,
+                                          const PostProcessSettings& settings,
+                                          int64_t referenceTimestampNs,
+                                          std::vector<uint8_t>& outPreview,
+                                          std::vector<std::shared_ptr<RawFrameProxy>>& outProxies)
+    {
+        if(!mEmbedPreviews)
+            return;
+
+        Measure measure("RawBufferManager::createPreviews()");
+
+        // Containers are still saved without previews if they can't be rendered
+        try {
+            for(auto& buffer : buffers) {
+                // Not supported by the preview generators
+                if(buffer->pixelFormat == PixelFormat::YUV_420_888)
+                    continue;
+
+                if(buffer->metadata.timestampNs == referenceTimestampNs)
+                    outPreview = ImageProcessor::createEmbeddedPreview(*buffer, metadata, settings);
+
+                outProxies.push_back(ImageProcessor::createFrameProxy(*buffer, metadata, settings));
+            }
+        }
+        catch(std::exception& e) {
+            logger::log("Failed to create previews: " + std::string(e.what()));
+
+            outPreview.clear();
+            outProxies.clear();
         }
     }
 
     std::shared_ptr<RawContainer> RawBufferManager::popPendingContainer() {
         std::shared_ptr<RawContainer> container;
-        mPendingContainers.try_dequeue(container);
+        
+        {
+            std::lock_guard<std::mutex> lock(mPendingLock);
+            
+            if(mPendingContainers.empty())
+                return nullptr;
+            
+            auto& pending = mPendingContainers.front();
+            
+            container = std::move(pending.container);
+            mPendingBytes -= pending.stats.bytes;
+            
+            onSaveCompleted(pending.stats, pending.queuedTime);
+            mPendingContainers.pop_front();
+        }
+        
+        // Let a blocked save() through
+        mPendingCv.notify_all();
         
         return container;
     }
 
     std::unique_ptr<RawBufferManager::LockedBuffers> RawBufferManager::consumeLatestBuffer() {
-        std::lock_guard<std::recursive_mutex> lock(mMutex);
-
-        if(mReadyBuffers.empty()) {
-            return std::unique_ptr<LockedBuffers>(new LockedBuffers());
-        }
+        std::shared_ptr<RawImageBuffer> buffer;
+        
+        {
+            std::lock_guard<std::recursive_mutex> lock(mMutex);
 
-        std::vector<std::shared_ptr<RawImageBuffer>> buffers;
+            moveIncomingBuffers();
+            
+            if(mReadyBuffers.empty()) {
+                return std::unique_ptr<LockedBuffers>(new LockedBuffers());
+            }
 
-        std::move(mReadyBuffers.end() - 1, mReadyBuffers.end(), std::back_inserter(buffers));
-        mReadyBuffers.erase(mReadyBuffers.end() - 1, mReadyBuffers.end());
+            buffer = mReadyBuffers.back();
+            
+            onReadyBufferRemoved(buffer);
+            mReadyBuffers.pop_back();
+        }
+        
+        decompressBuffers({ buffer });
 
-        return std::unique_ptr<LockedBuffers>(new LockedBuffers(buffers));
+        return std::unique_ptr<LockedBuffers>(new LockedBuffers({ buffer }));
     }
 
     std::unique_ptr<RawBufferManager::LockedBuffers> RawBufferManager::consumeBuffer(int64_t timestampNs) {
-        std::lock_guard<std::recursive_mutex> lock(mMutex);
+        std::shared_ptr<RawImageBuffer> buffer;
+        
+        {
+            std::lock_guard<std::recursive_mutex> lock(mMutex);
 
-        auto it = std::find_if(
-            mReadyBuffers.begin(), mReadyBuffers.end(),
-            [&](const auto& x) { return x->metadata.timestampNs == timestampNs; }
-        );
+            moveIncomingBuffers();
+            
+            auto it = findReadyBuffer(timestampNs);
 
-        if(it != mReadyBuffers.end()) {
-            auto lockedBuffers = std::unique_ptr<LockedBuffers>(new LockedBuffers( { *it }));
+            if(it == mReadyBuffers.end()) {
+                return std::unique_ptr<LockedBuffers>(new LockedBuffers());
+            }
+            
+            buffer = *it;
+            
+            onReadyBufferRemoved(buffer);
             mReadyBuffers.erase(it);
+        }
+        
+        decompressBuffers({ buffer });
+
+        return std::unique_ptr<LockedBuffers>(new LockedBuffers({ buffer }));
+    }
+
+    std::unique_ptr<RawBufferManager::LockedBuffers> RawBufferManager::consumeNearestBuffer(int64_t timestampNs) {
+        std::shared_ptr<RawImageBuffer> buffer;
+        
+        {
+            std::lock_guard<std::recursive_mutex> lock(mMutex);
 
-            return lockedBuffers;
+            moveIncomingBuffers();
+            
+            auto it = findNearestReadyBuffer(timestampNs);
+
+            if(it == mReadyBuffers.end()) {
+                return std::unique_ptr<LockedBuffers>(new LockedBuffers());
+            }
+            
+            buffer = *it;
+            
+            onReadyBufferRemoved(buffer);
+            mReadyBuffers.erase(it);
         }
+        
+        decompressBuffers({ buffer });
 
-        return std::unique_ptr<LockedBuffers>(new LockedBuffers());
+        return std::unique_ptr<LockedBuffers>(new LockedBuffers({ buffer }));
     }
 
     std::unique_ptr<RawBufferManager::LockedBuffers> RawBufferManager::consumeAllBuffers() {
         std::lock_guard<std::recursive_mutex> lock(mMutex);
 
-        auto lockedBuffers = std::unique_ptr<LockedBuffers>(new LockedBuffers(mReadyBuffers));
+        moveIncomingBuffers();
+        
+        std::vector<std::shared_ptr<RawImageBuffer>> buffers(mReadyBuffers.begin(), mReadyBuffers.end());
+        
+        for(auto& buffer : buffers)
+            onReadyBufferRemoved(buffer);
+        
         mReadyBuffers.clear();
 
-        return lockedBuffers;
+        return std::unique_ptr<LockedBuffers>(new LockedBuffers(buffers));
     }
 
     int64_t RawBufferManager::latestTimeStamp() {
         std::lock_guard<std::recursive_mutex> lock(mMutex);
         
+        moveIncomingBuffers();
+        
         if(mReadyBuffers.empty())
             return -1;
         
         auto latest = mReadyBuffers.back();
         return latest->metadata.timestampNs;
     }
+
+    void RawBufferManager::setCompaction(int64_t minAgeMs, int64_t maxCompressedBytes) {
+        mCompactionMinAgeNs = std::max<int64_t>(0, minAgeMs) * 1000 * 1000;
+        mMaxCompressedBytes = std::max<int64_t>(0, maxCompressedBytes);
+        
+        {
+            std::lock_guard<std::recursive_mutex> lock(mMutex);
+            
+            moveIncomingBuffers();
+            dropCompressedBuffers(mMaxCompressedBytes);
+        }
+        
+        std::lock_guard<std::mutex> lock(mCompactionLock);
+        
+        if(mMaxCompressedBytes > 0 && !mCompactionThread.joinable())
+            mCompactionThread = std::thread(&RawBufferManager::doCompaction, this);
+        
+        mCompactionCv.notify_all();
+    }
+
+    int64_t RawBufferManager::compressedBytes() const {
+        return mCompressedBytes;
+    }
+
+    void RawBufferManager::doCompaction() {
+#if defined(__ANDROID__) || defined(__linux__)
+        // Stay out of the way of the camera and UI threads
+        setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 10);
+#endif
+        
+        std::unique_lock<std::mutex> lock(mCompactionLock);
+        
+        while(!mStopCompaction) {
+            lock.unlock();
+            
+            bool compacted = false;
+            
+            try {
+                compacted = compactOldestBuffer();
+            }
+            catch(std::exception& e) {
+                logger::log("Failed to compress buffer: " + std::string(e.what()));
+            }
+            
+            lock.lock();
+            
+            // Keep going while there is work, otherwise check again in a bit
+            if(!compacted)
+                mCompactionCv.wait_for(lock, std::chrono::milliseconds(COMPACTION_INTERVAL_MS), [&] { return mStopCompaction; });
+        }
+    }
+
+    bool RawBufferManager::compactOldestBuffer() {
+        const int64_t maxCompressedBytes = mMaxCompressedBytes;
+        if(maxCompressedBytes <= 0)
+            return false;
+        
+        const int generation = mGeneration;
+        std::shared_ptr<RawImageBuffer> buffer;
+        
+        {
+            std::lock_guard<std::recursive_mutex> lock(mMutex);
+            
+            moveIncomingBuffers();
+            
+            if(mReadyBuffers.empty())
+                return false;
+            
+            // Forget about frames that are gone
+            mUncompressibleFrames.erase(
+                mUncompressibleFrames.begin(), mUncompressibleFrames.lower_bound(mReadyBuffers.front()->metadata.timestampNs));
+            
+            const int64_t maxTimestampNs = mReadyBuffers.back()->metadata.timestampNs - mCompactionMinAgeNs;
+            
+            auto it = std::find_if(mReadyBuffers.begin(), mReadyBuffers.end(), [&](const auto& x) {
+                return x->metadata.timestampNs > maxTimestampNs ||
+                       (!x->isCompressed && mUncompressibleFrames.count(x->metadata.timestampNs) == 0);
+            });
+            
+            if(it == mReadyBuffers.end() || (*it)->metadata.timestampNs > maxTimestampNs)
+                return false;
+            
+            // Take it out while it's compressed so nothing else can touch it
+            buffer = *it;
+            
+            onReadyBufferRemoved(buffer);
+            mReadyBuffers.erase(it);
+        }
+        
+        std::vector<uint8_t> compressed;
+        bool isCompressed = false;
+        
+        try {
+            isCompressed = FrameCompressor::compressFrame(*buffer, compressed);
+        }
+        catch(std::exception& e) {
+            logger::log("Failed to compress buffer: " + std::string(e.what()));
+        }
+        
+        std::unique_ptr<NativeBuffer> freeBuffer;
+        
+        if(isCompressed) {
+            freeBuffer = std::move(buffer->data);
+            
+            buffer->data = std::make_unique<NativeHostBuffer>(std::move(compressed));
+            buffer->isCompressed = true;
+        }
+        
+        {
+            std::lock_guard<std::recursive_mutex> lock(mMutex);
+            
+            // Buffers were reset in the meantime
+            if(generation != mGeneration)
+                return true;
+            
+            if(isCompressed)
+                mCompressedBytes += static_cast<int64_t>(buffer->data->len());
+            else
+                mUncompressibleFrames.insert(buffer->metadata.timestampNs);
+            
+            returnBuffers({ buffer });
+            dropCompressedBuffers(maxCompressedBytes);
+        }
+        
+        // The frame's buffer can be used for a new frame, unless a frame was decompressed into memory
+        // that isn't counted. Then drop it so we are back to the number of buffers we are counting.
+        if(freeBuffer) {
+            if(takeTemporaryBuffer())
+                freeBuffer = nullptr;
+            else
+                mUnusedBuffers.enqueue(std::make_shared<RawImageBuffer>(std::move(freeBuffer)));
+        }
+        
+        return true;
+    }
+
+    void RawBufferManager::decompressBuffers(const std::vector<std::shared_ptr<RawImageBuffer>>& buffers) {
+        for(auto& buffer : buffers) {
+            if(!buffer->isCompressed)
+                continue;
+            
+            const size_t compressedLen = buffer->data->len();
+            const uint8_t* data = buffer->data->lock(false);
+            const size_t len = codec::decodedLength(data, compressedLen);
+            
+            // Decode into an unused buffer or one from the pool. Ready frames are never evicted for this.
+            std::unique_ptr<NativeBuffer> output;
+            std::shared_ptr<RawImageBuffer> unusedBuffer;
+            
+            if(mUnusedBuffers.try_dequeue(unusedBuffer)) {
+                if(unusedBuffer->data->len() == len)
+                    output = std::move(unusedBuffer->data);
+                else
+                    mUnusedBuffers.enqueue(unusedBuffer);
+            }
+            
+            auto bufferPool = std::atomic_load(&mBufferPool);
+            
+            if(!output && bufferPool && bufferPool->bufferLength() == len) {
+                output = bufferPool->allocate();
+                
+                if(output) {
+                    ++mNumBuffers;
+                    mMemoryUseBytes += static_cast<int64_t>(len);
+                }
+            }
+            
+            // Otherwise use memory outside the budget. The next buffer freed by compaction is dropped in its place.
+            if(!output) {
+                output = std::make_unique<NativeHostBuffer>(len);
+                ++mNumTemporaryBuffers;
+            }
+            
+            codec::decode(data, compressedLen, output->lock(true), len);
+            
+            output->unlock();
+            buffer->data->unlock();
+            
+            buffer->data = std::move(output);
+            buffer->isCompressed = false;
+            
+            mCompressedBytes -= static_cast<int64_t>(compressedLen);
+        }
+    }
 }
@@ -0,0 +1,170 @@
+#include "motioncam/RawBufferPool.h"
+#include "motioncam/Exceptions.h"
+#include "motioncam/Util.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <algorithm>
+
+namespace motioncam {
+
+    std::shared_ptr<RawBufferPool> RawBufferPool::create(size_t bufferLength, int64_t budgetBytes) {
+        return std::shared_ptr<RawBufferPool>(new RawBufferPool(bufferLength, budgetBytes));
+    }
+
+    RawBufferPool::RawBufferPool(size_t bufferLength, int64_t budgetBytes) :
+        mBufferLength(bufferLength),
+        mSlotLength(0),
+        mNumSlots(0),
+        mMapping(nullptr),
+        mMappingLength(0)
+    {
+        if(bufferLength == 0)
+            throw InvalidState("Invalid buffer length");
+
+        // Keep every buffer on its own pages so they can be given back individually
+        const size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+
+        mSlotLength = (bufferLength + pageSize - 1) / pageSize * pageSize;
+        mNumSlots = static_cast<int>(std::max<int64_t>(1, budgetBytes / static_cast<int64_t>(mSlotLength)));
+        mMappingLength = mSlotLength * mNumSlots;
+
+        void* mapping = mmap(nullptr, mMappingLength, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(mapping == MAP_FAILED)
+            throw InvalidState("Can't reserve " + std::to_string(mMappingLength) + " bytes for buffers");
+
+#if defined(MADV_HUGEPAGE)
+        // Fewer TLB misses when copying whole frames, ignored if the kernel doesn't support it
+        madvise(mapping, mMappingLength, MADV_HUGEPAGE);
+#endif
+
+        mMapping = static_cast<uint8_t*>(mapping);
+
+        // Hand out the start of the mapping first
+        mFreeSlots.reserve(mNumSlots);
+
+        for(int i = mNumSlots - 1; i >= 0; i--)
+            mFreeSlots.push_back(i);
+    }
+
+    RawBufferPool::~RawBufferPool() {
+        // Buffers keep the pool alive so none can be left at this point
+        if(mMapping)
+            munmap(mMapping, mMappingLength);
+    }
+
+    std::unique_ptr<NativeBuffer> RawBufferPool::allocate() {
+        int slot;
+
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+
+            if(mFreeSlots.empty())
+                return nullptr;
+
+            slot = mFreeSlots.back();
+            mFreeSlots.pop_back();
+        }
+
+        return std::make_unique<NativePoolBuffer>(shared_from_this(), slot);
+    }
+
+    void RawBufferPool::release(int slot) {
+        // Buffers are recycled by their owner while in use, so one only comes back here when it is
+        // being dropped. Give its memory back to the system, it is committed again on next use.
+        madvise(slotData(slot), mSlotLength, MADV_DONTNEED);
+
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mFreeSlots.push_back(slot);
+    }
+
+    int64_t RawBufferPool::budgetBytes() const {
+        return static_cast<int64_t>(mNumSlots) * static_cast<int64_t>(mSlotLength);
+    }
+
+    int64_t RawBufferPool::usedBytes() const {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        return static_cast<int64_t>(mNumSlots - mFreeSlots.size()) * static_cast<int64_t>(mSlotLength);
+    }
+
+    uint8_t* RawBufferPool::slotData(int slot) const {
+        return mMapping + static_cast<size_t>(slot) * mSlotLength;
+    }
+
+    //
+
+    NativePoolBuffer::NativePoolBuffer(std::shared_ptr<RawBufferPool> pool, int slot) :
+        mPool(std::move(pool)),
+        mSlot(slot),
+        mData(mPool->slotData(slot)),
+        mLength(mPool->bufferLength())
+    {
+    }
+
+    NativePoolBuffer::~NativePoolBuffer() {
+        release();
+    }
+
+    uint8_t* NativePoolBuffer::lock(bool write) {
+        return mData;
+    }
+
+    void NativePoolBuffer::unlock() {
+    }
+
+    uint64_t NativePoolBuffer::nativeHandle() {
+        return 0;
+    }
+
+    size_t NativePoolBuffer::len() {
+        return mLength;
+    }
+
+    const std::vector<uint8_t>& NativePoolBuffer::hostData() {
+        // The slot may have been written since the last call
+        if(mPool) {
+            mHostBuffer.assign(mData, mData + mLength);
+        }
+
+        return mHostBuffer;
+    }
+
+    void NativePoolBuffer::copyHostData(const std::vector<uint8_t>& data) {
+        if(mPool && data.size() <= mPool->mSlotLength) {
+            util::fastCopy(mData, data.data(), data.size());
+
+            mLength = data.size();
+            mHostBuffer.clear();
+
+            return;
+        }
+
+        // Doesn't fit, give the slot back and keep our own copy from now on
+        release();
+
+        mHostBuffer = data;
+        mData = mHostBuffer.data();
+        mLength = mHostBuffer.size();
+    }
+
+    std::unique_ptr<NativeBuffer> NativePoolBuffer::clone() {
+        return std::make_unique<NativeHostBuffer>(mData, mLength);
+    }
+
+    void NativePoolBuffer::release() {
+        if(mPool) {
+            mPool->release(mSlot);
+            mPool.reset();
+        }
+
+        mHostBuffer.resize(0);
+        mHostBuffer.shrink_to_fit();
+
+        mData = nullptr;
+        mLength = 0;
+    }
+}
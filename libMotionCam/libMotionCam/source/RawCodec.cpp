@@ -0,0 +1,637 @@
+#include "motioncam/RawCodec.h"
+#include "motioncam/Exceptions.h"
+
+#include <cstring>
+#include <thread>
+#include <algorithm>
+
+namespace motioncam {
+    namespace codec {
+        size_t rowLength(const PixelFormat pixelFormat, const int width) {
+            switch(pixelFormat) {
+                case PixelFormat::RAW10:
+                    return width * 10 / 8;
+
+                case PixelFormat::RAW12:
+                    return width * 12 / 8;
+
+                case PixelFormat::RAW16:
+                    return width * 2;
+
+                default:
+                    return 0;
+            }
+        }
+
+        void unpackRow(const uint8_t* input, const PixelFormat pixelFormat, const int width, uint16_t* output) {
+            if(pixelFormat == PixelFormat::RAW10) {
+                for(int x = 0; x < width; x += 4) {
+                    const uint8_t* p = input + (x / 4) * 5;
+                    const uint8_t lo = p[4];
+
+                    output[x + 0] = static_cast<uint16_t>((p[0] << 2) | ((lo     ) & 0x03));
+                    output[x + 1] = static_cast<uint16_t>((p[1] << 2) | ((lo >> 2) & 0x03));
+                    output[x + 2] = static_cast<uint16_t>((p[2] << 2) | ((lo >> 4) & 0x03));
+                    output[x + 3] = static_cast<uint16_t>((p[3] << 2) | ((lo >> 6) & 0x03));
+                }
+            }
+            else if(pixelFormat == PixelFormat::RAW12) {
+                for(int x = 0; x < width; x += 2) {
+                    const uint8_t* p = input + (x / 2) * 3;
+
+                    output[x + 0] = static_cast<uint16_t>((p[0] << 4) | ((p[2]     ) & 0x0F));
+                    output[x + 1] = static_cast<uint16_t>((p[1] << 4) | ((p[2] >> 4) & 0x0F));
+                }
+            }
+            else {
+                for(int x = 0; x < width; x++)
+                    output[x] = static_cast<uint16_t>(input[x*2] | (input[x*2 + 1] << 8));
+            }
+        }
+
+        namespace {
+            // Four 10 bit pixels in 16 bit lanes to 5 bytes: the upper 8 bits of each pixel then the lower 2 bits of all four
+            inline uint64_t packRaw10(const uint64_t v) {
+                uint64_t hi = (v >> 2) & 0x00FF00FF00FF00FFULL;
+                hi = (hi | (hi >> 8))  & 0x0000FFFF0000FFFFULL;
+                hi = (hi | (hi >> 16)) & 0x00000000FFFFFFFFULL;
+
+                uint64_t lo = v & 0x0003000300030003ULL;
+                lo = (lo | (lo >> 14)) & 0x0000000F0000000FULL;
+                lo = (lo | (lo >> 28)) & 0x00000000000000FFULL;
+
+                return hi | (lo << 32);
+            }
+
+            // Four 12 bit pixels to 6 bytes, each pair is the upper 8 bits of both pixels then the lower 4 bits of both
+            inline uint64_t packRaw12(const uint64_t v) {
+                uint64_t hi = (v >> 4) & 0x00FF00FF00FF00FFULL;
+                hi = (hi | (hi >> 8))  & 0x0000FFFF0000FFFFULL;
+
+                uint64_t lo = v & 0x000F000F000F000FULL;
+                lo = (lo | (lo >> 12)) & 0x000000FF000000FFULL;
+
+                const uint64_t pairs = hi | (lo << 16);
+
+                return (pairs & 0xFFFFFFULL) | ((pairs >> 32) << 24);
+            }
+
+            // Packs four pixels at a time. Returns false if any pixel doesn't fit in the format.
+            template<int GroupLength>
+            bool packRowFast(const uint16_t* input, const int groups, const uint64_t overflowMask, uint8_t* output) {
+                uint64_t bits = 0;
+                uint64_t v, packed;
+
+                // Write whole words and let the next group overwrite the extra bytes
+                for(int g = 0; g < groups - 1; g++) {
+                    std::memcpy(&v, input + g*4, sizeof(v));
+                    bits |= v;
+
+                    packed = GroupLength == 5 ? packRaw10(v) : packRaw12(v);
+                    std::memcpy(output + g*GroupLength, &packed, sizeof(packed));
+                }
+
+                if(groups > 0) {
+                    std::memcpy(&v, input + (groups - 1)*4, sizeof(v));
+                    bits |= v;
+
+                    packed = GroupLength == 5 ? packRaw10(v) : packRaw12(v);
+                    std::memcpy(output + (groups - 1)*GroupLength, &packed, GroupLength);
+                }
+
+                return (bits & overflowMask) == 0;
+            }
+        }
+
+        void packRow(const uint16_t* input, const PixelFormat pixelFormat, const int width, uint8_t* output) {
+            if(pixelFormat == PixelFormat::RAW10) {
+                if(packRowFast<5>(input, width / 4, 0xFC00FC00FC00FC00ULL, output))
+                    return;
+
+                for(int x = 0; x < width; x += 4) {
+                    uint8_t* p = output + (x / 4) * 5;
+
+                    const uint16_t p0 = std::min<uint16_t>(input[x + 0], 1023);
+                    const uint16_t p1 = std::min<uint16_t>(input[x + 1], 1023);
+                    const uint16_t p2 = std::min<uint16_t>(input[x + 2], 1023);
+                    const uint16_t p3 = std::min<uint16_t>(input[x + 3], 1023);
+
+                    p[0] = static_cast<uint8_t>(p0 >> 2);
+                    p[1] = static_cast<uint8_t>(p1 >> 2);
+                    p[2] = static_cast<uint8_t>(p2 >> 2);
+                    p[3] = static_cast<uint8_t>(p3 >> 2);
+                    p[4] = static_cast<uint8_t>((p0 & 0x03) | ((p1 & 0x03) << 2) | ((p2 & 0x03) << 4) | ((p3 & 0x03) << 6));
+                }
+            }
+            else if(pixelFormat == PixelFormat::RAW12) {
+                int start = 0;
+
+                if(packRowFast<6>(input, width / 4, 0xF000F000F000F000ULL, output))
+                    start = width / 4 * 4;
+
+                for(int x = start; x < width; x += 2) {
+                    uint8_t* p = output + (x / 2) * 3;
+
+                    const uint16_t p0 = std::min<uint16_t>(input[x + 0], 4095);
+                    const uint16_t p1 = std::min<uint16_t>(input[x + 1], 4095);
+
+                    p[0] = static_cast<uint8_t>(p0 >> 4);
+                    p[1] = static_cast<uint8_t>(p1 >> 4);
+                    p[2] = static_cast<uint8_t>((p0 & 0x0F) | ((p1 & 0x0F) << 4));
+                }
+            }
+            else {
+                for(int x = 0; x < width; x++) {
+                    output[x*2]     = static_cast<uint8_t>(input[x] & 0xFF);
+                    output[x*2 + 1] = static_cast<uint8_t>(input[x] >> 8);
+                }
+            }
+        }
+
+        namespace {
+            const char MAGIC[4] = { 'M', 'C', 'R', 'C' };
+            const uint8_t VERSION = 1;
+
+            const int BLOCK_SIZE = 16;
+            const int STRIP_HEIGHT = 32;
+
+            // Largest residual after zigzag encoding of 16 bit values
+            const int MAX_BITS = 17;
+
+#pragma pack(push, 1)
+            // Followed by numStrips + 1 strip offsets, relative to the end of the offset table.
+            // The last offset is where any bytes past the final row are stored.
+            struct Header {
+                char magic[4];
+                uint8_t version;
+                uint8_t pixelFormat;
+                uint16_t stripHeight;
+                int32_t width;
+                int32_t height;
+                int32_t rowStride;
+                uint32_t numStrips;
+                uint64_t length;
+            };
+#pragma pack(pop)
+
+            // Number of bytes of a row stored in the buffer, the last row may not be padded
+            size_t storedRowLength(const Header& header, const int y) {
+                size_t start = static_cast<size_t>(y) * header.rowStride;
+                return static_cast<size_t>(std::min<uint64_t>(header.rowStride, header.length - start));
+            }
+
+            inline uint32_t zigzag(const int32_t v) {
+                return (static_cast<uint32_t>(v) << 1) ^ static_cast<uint32_t>(v >> 31);
+            }
+
+            inline int32_t unzigzag(const uint32_t v) {
+                return static_cast<int32_t>(v >> 1) ^ -static_cast<int32_t>(v & 1);
+            }
+
+            // Branchless min/max, compilers tend to emit branches for std::min/std::max here and
+            // those are unpredictable on noisy data
+            inline int32_t min32(const int32_t a, const int32_t b) {
+                const int32_t d = a - b;
+                return b + (d & (d >> 31));
+            }
+
+            inline int32_t max32(const int32_t a, const int32_t b) {
+                const int32_t d = a - b;
+                return a - (d & (d >> 31));
+            }
+
+            // LOCO-I median edge detector, using neighbours of the same colour
+            inline int32_t predict(const int32_t a, const int32_t b, const int32_t c) {
+                return min32(max32(a + b - c, min32(a, b)), max32(a, b));
+            }
+
+            //
+            // Residuals are written in blocks of BLOCK_SIZE values, each prefixed with its bit width
+            //
+
+            inline uint8_t* encodeBlock(const uint32_t* values, uint8_t* output) {
+                uint32_t bits = 0;
+                for(int i = 0; i < BLOCK_SIZE; i++)
+                    bits |= values[i];
+
+                const int numBits = bits == 0 ? 0 : 32 - __builtin_clz(bits);
+
+                *output++ = static_cast<uint8_t>(numBits);
+
+                if(numBits == 0)
+                    return output;
+
+                // Flush 32 bits at a time, the block always ends on a byte boundary
+                uint64_t acc = 0;
+                int accBits = 0;
+
+                for(int i = 0; i < BLOCK_SIZE; i++) {
+                    acc |= static_cast<uint64_t>(values[i]) << accBits;
+                    accBits += numBits;
+
+                    if(accBits >= 32) {
+                        const uint32_t word = static_cast<uint32_t>(acc);
+
+                        std::memcpy(output, &word, sizeof(word));
+
+                        output += sizeof(word);
+                        acc >>= 32;
+                        accBits -= 32;
+                    }
+                }
+
+                while(accBits > 0) {
+                    *output++ = static_cast<uint8_t>(acc);
+                    acc >>= 8;
+                    accBits -= 8;
+                }
+
+                return output;
+            }
+
+            inline const uint8_t* decodeBlock(const uint8_t* input, const uint8_t* end, uint32_t* values) {
+                if(input >= end)
+                    throw IOException("Corrupt frame data");
+
+                const int numBits = *input++;
+
+                if(numBits == 0) {
+                    std::fill(values, values + BLOCK_SIZE, 0);
+                    return input;
+                }
+
+                // Each block is exactly numBits * BLOCK_SIZE / 8 bytes
+                if(numBits > MAX_BITS || end - input < numBits * BLOCK_SIZE / 8)
+                    throw IOException("Corrupt frame data");
+
+                const uint32_t mask = (1u << numBits) - 1;
+                const int blockLen = numBits * BLOCK_SIZE / 8;
+
+                // Read each value with a single unaligned load when there's enough input left
+                if(end - input >= blockLen + 8) {
+                    for(int i = 0; i < BLOCK_SIZE; i++) {
+                        const int bitOffset = i * numBits;
+
+                        uint64_t word;
+                        std::memcpy(&word, input + (bitOffset >> 3), sizeof(word));
+
+                        values[i] = static_cast<uint32_t>(word >> (bitOffset & 7)) & mask;
+                    }
+
+                    return input + blockLen;
+                }
+
+                uint64_t acc = 0;
+                int accBits = 0;
+
+                for(int i = 0; i < BLOCK_SIZE; i++) {
+                    while(accBits < numBits) {
+                        acc |= static_cast<uint64_t>(*input++) << accBits;
+                        accBits += 8;
+                    }
+
+                    values[i] = static_cast<uint32_t>(acc) & mask;
+                    acc >>= numBits;
+                    accBits -= numBits;
+                }
+
+                return input;
+            }
+
+            int paddedWidth(const int width) {
+                return (width + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+            }
+
+            // Rows that don't depend on each other are reconstructed together. Each colour in a row
+            // forms its own dependency chain, so this keeps 2 * N chains in flight.
+            template<int N>
+            inline void reconstructRows(const uint32_t* const* residuals,
+                                        const uint16_t* const* above,
+                                        uint16_t* const* current,
+                                        const int width,
+                                        const bool hasAbove)
+            {
+                int32_t p[2*N];
+
+                for(int n = 0; n < N; n++) {
+                    p[2*n]     = unzigzag(residuals[n][0]) + (hasAbove ? above[n][0] : 0);
+                    p[2*n + 1] = unzigzag(residuals[n][1]) + (hasAbove ? above[n][1] : 0);
+
+                    current[n][0] = static_cast<uint16_t>(p[2*n]);
+                    current[n][1] = static_cast<uint16_t>(p[2*n + 1]);
+                }
+
+                if(hasAbove) {
+                    for(int x = 2; x < width; x += 2) {
+                        for(int n = 0; n < N; n++) {
+                            p[2*n]     = predict(p[2*n],     above[n][x],     above[n][x - 2]) + unzigzag(residuals[n][x]);
+                            p[2*n + 1] = predict(p[2*n + 1], above[n][x + 1], above[n][x - 1]) + unzigzag(residuals[n][x + 1]);
+
+                            current[n][x]     = static_cast<uint16_t>(p[2*n]);
+                            current[n][x + 1] = static_cast<uint16_t>(p[2*n + 1]);
+                        }
+                    }
+                }
+                else {
+                    for(int x = 2; x < width; x += 2) {
+                        for(int n = 0; n < N; n++) {
+                            p[2*n]     += unzigzag(residuals[n][x]);
+                            p[2*n + 1] += unzigzag(residuals[n][x + 1]);
+
+                            current[n][x]     = static_cast<uint16_t>(p[2*n]);
+                            current[n][x + 1] = static_cast<uint16_t>(p[2*n + 1]);
+                        }
+                    }
+                }
+            }
+
+            void decodeStrips(const Header& header,
+                              const uint8_t* data,
+                              const uint32_t* offsets,
+                              const size_t dataLen,
+                              const uint32_t firstStrip,
+                              const uint32_t lastStrip,
+                              uint8_t* output)
+            {
+                const PixelFormat pixelFormat = static_cast<PixelFormat>(header.pixelFormat);
+                const int width = header.width;
+                const size_t rowLen = rowLength(pixelFormat, width);
+
+                // Rows are predicted from the row two above, so rows y and y + 1 can be decoded together
+                std::vector<uint32_t> residualRows[2] = {
+                    std::vector<uint32_t>(paddedWidth(width)), std::vector<uint32_t>(paddedWidth(width))
+                };
+
+                std::vector<uint16_t> rows[4] = {
+                    std::vector<uint16_t>(width), std::vector<uint16_t>(width), std::vector<uint16_t>(width), std::vector<uint16_t>(width)
+                };
+
+                for(uint32_t strip = firstStrip; strip < lastStrip; strip++) {
+                    if(offsets[strip] > offsets[strip + 1] || offsets[strip + 1] > dataLen)
+                        throw IOException("Corrupt frame data");
+
+                    const uint8_t* input = data + offsets[strip];
+                    const uint8_t* end = data + offsets[strip + 1];
+
+                    const int startY = strip * header.stripHeight;
+                    const int endY = std::min(header.height, startY + header.stripHeight);
+
+                    for(int y = startY; y < endY; y += 2) {
+                        const int r = y - startY;
+                        const int numRows = std::min(2, endY - y);
+
+                        const uint32_t* residuals[2];
+                        const uint16_t* above[2];
+                        uint16_t* current[2];
+                        const uint8_t* padding[2];
+
+                        for(int n = 0; n < numRows; n++) {
+                            residuals[n] = residualRows[n].data();
+                            current[n] = rows[(r + n) % 4].data();
+                            above[n] = rows[(r + n + 2) % 4].data();
+
+                            for(int x = 0; x < width; x += BLOCK_SIZE)
+                                input = decodeBlock(input, end, residualRows[n].data() + x);
+
+                            // Row padding is stored as is
+                            const size_t paddingLen = storedRowLength(header, y + n) - rowLen;
+
+                            if(static_cast<size_t>(end - input) < paddingLen)
+                                throw IOException("Corrupt frame data");
+
+                            padding[n] = input;
+                            input += paddingLen;
+                        }
+
+                        if(numRows == 2)
+                            reconstructRows<2>(residuals, above, current, width, r >= 2);
+                        else
+                            reconstructRows<1>(residuals, above, current, width, r >= 2);
+
+                        for(int n = 0; n < numRows; n++) {
+                            uint8_t* outputRow = output + static_cast<size_t>(y + n) * header.rowStride;
+
+                            packRow(current[n], pixelFormat, width, outputRow);
+                            std::memcpy(outputRow + rowLen, padding[n], storedRowLength(header, y + n) - rowLen);
+                        }
+                    }
+                }
+            }
+        }
+
+        bool canEncode(const PixelFormat pixelFormat, const int width, const int height, const int rowStride, const size_t len) {
+            // Bayer rows always have an even number of pixels
+            if(width < 4 || width % 2 != 0 || height < 1)
+                return false;
+
+            if(pixelFormat == PixelFormat::RAW10 && width % 4 != 0)
+                return false;
+
+            if(pixelFormat == PixelFormat::RAW12 && width % 2 != 0)
+                return false;
+
+            const size_t rowLen = rowLength(pixelFormat, width);
+
+            if(rowLen == 0 || static_cast<size_t>(rowStride) < rowLen)
+                return false;
+
+            // Make sure all rows are in the buffer
+            return len >= static_cast<size_t>(rowStride) * (height - 1) + rowLen;
+        }
+
+        bool encode(const uint8_t* data,
+                    const size_t len,
+                    const PixelFormat pixelFormat,
+                    const int width,
+                    const int height,
+                    const int rowStride,
+                    std::vector<uint8_t>& output)
+        {
+            if(!canEncode(pixelFormat, width, height, rowStride, len))
+                return false;
+
+            Header header;
+            std::memset(&header, 0, sizeof(header));
+
+            std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+
+            header.version      = VERSION;
+            header.pixelFormat  = static_cast<uint8_t>(pixelFormat);
+            header.stripHeight  = STRIP_HEIGHT;
+            header.width        = width;
+            header.height       = height;
+            header.rowStride    = rowStride;
+            header.numStrips    = (height + STRIP_HEIGHT - 1) / STRIP_HEIGHT;
+            header.length       = len;
+
+            const size_t rowLen = rowLength(pixelFormat, width);
+            const size_t tableLen = (header.numStrips + 1) * sizeof(uint32_t);
+            const size_t rowBound = (paddedWidth(width) / BLOCK_SIZE) * (1 + MAX_BITS * BLOCK_SIZE / 8) + (rowStride - rowLen);
+            const size_t tail = len > static_cast<size_t>(rowStride) * height ? len - static_cast<size_t>(rowStride) * height : 0;
+
+            output.resize(sizeof(header) + tableLen + rowBound * height + tail);
+
+            std::memcpy(output.data(), &header, sizeof(header));
+
+            uint8_t* start = output.data() + sizeof(header) + tableLen;
+            uint8_t* out = start;
+
+            std::vector<uint32_t> offsets(header.numStrips + 1);
+            std::vector<uint32_t> residuals(paddedWidth(width), 0);
+            std::vector<uint16_t> rows[3] = {
+                std::vector<uint16_t>(width), std::vector<uint16_t>(width), std::vector<uint16_t>(width)
+            };
+
+            for(uint32_t strip = 0; strip < header.numStrips; strip++) {
+                offsets[strip] = static_cast<uint32_t>(out - start);
+
+                const int startY = strip * STRIP_HEIGHT;
+                const int endY = std::min(height, startY + STRIP_HEIGHT);
+
+                for(int y = startY; y < endY; y++) {
+                    const int r = y - startY;
+                    const uint8_t* inputRow = data + static_cast<size_t>(y) * rowStride;
+
+                    uint16_t* current = rows[r % 3].data();
+                    const uint16_t* above = rows[(r + 1) % 3].data();
+
+                    unpackRow(inputRow, pixelFormat, width, current);
+
+                    // First rows of a strip only use the pixels to the left so strips don't depend on each other
+                    if(r < 2) {
+                        residuals[0] = zigzag(current[0]);
+                        residuals[1] = zigzag(current[1]);
+
+                        for(int x = 2; x < width; x++)
+                            residuals[x] = zigzag(current[x] - current[x - 2]);
+                    }
+                    else {
+                        residuals[0] = zigzag(current[0] - above[0]);
+                        residuals[1] = zigzag(current[1] - above[1]);
+
+                        for(int x = 2; x < width; x++)
+                            residuals[x] = zigzag(current[x] - predict(current[x - 2], above[x], above[x - 2]));
+                    }
+
+                    for(int x = 0; x < width; x += BLOCK_SIZE)
+                        out = encodeBlock(residuals.data() + x, out);
+
+                    const size_t padding = storedRowLength(header, y) - rowLen;
+
+                    std::memcpy(out, inputRow + rowLen, padding);
+                    out += padding;
+                }
+            }
+
+            offsets[header.numStrips] = static_cast<uint32_t>(out - start);
+
+            // Anything past the last row
+            if(tail > 0) {
+                std::memcpy(out, data + static_cast<size_t>(rowStride) * height, tail);
+                out += tail;
+            }
+
+            std::memcpy(output.data() + sizeof(header), offsets.data(), tableLen);
+
+            output.resize(out - output.data());
+
+            // Not worth it
+            if(output.size() >= len) {
+                output.clear();
+                return false;
+            }
+
+            return true;
+        }
+
+        bool isEncoded(const uint8_t* data, const size_t len) {
+            return len >= sizeof(Header) && std::memcmp(data, MAGIC, sizeof(MAGIC)) == 0;
+        }
+
+        size_t decodedLength(const uint8_t* data, const size_t len) {
+            if(!isEncoded(data, len))
+                throw IOException("Invalid frame data");
+
+            Header header;
+            std::memcpy(&header, data, sizeof(header));
+
+            return static_cast<size_t>(header.length);
+        }
+
+        void decode(const uint8_t* data, const size_t len, uint8_t* output, const size_t outputLen, const int numThreads) {
+            if(!isEncoded(data, len))
+                throw IOException("Invalid frame data");
+
+            Header header;
+            std::memcpy(&header, data, sizeof(header));
+
+            const PixelFormat pixelFormat = static_cast<PixelFormat>(header.pixelFormat);
+
+            if(header.version != VERSION ||
+               header.stripHeight == 0 ||
+               !canEncode(pixelFormat, header.width, header.height, header.rowStride, header.length))
+            {
+                throw IOException("Invalid frame data");
+            }
+
+            if(outputLen < header.length)
+                throw InvalidState("Output buffer too small");
+
+            const size_t tableLen = (header.numStrips + 1) * sizeof(uint32_t);
+
+            if(len < sizeof(header) + tableLen ||
+               header.numStrips != static_cast<uint32_t>((header.height + header.stripHeight - 1) / header.stripHeight))
+            {
+                throw IOException("Invalid frame data");
+            }
+
+            std::vector<uint32_t> offsets(header.numStrips + 1);
+            std::memcpy(offsets.data(), data + sizeof(header), tableLen);
+
+            const uint8_t* start = data + sizeof(header) + tableLen;
+            const size_t dataLen = len - sizeof(header) - tableLen;
+
+            const uint32_t threads = static_cast<uint32_t>(std::max(1, std::min<int>(numThreads, header.numStrips)));
+
+            if(threads == 1) {
+                decodeStrips(header, start, offsets.data(), dataLen, 0, header.numStrips, output);
+            }
+            else {
+                std::vector<std::thread> workers;
+                std::vector<std::exception_ptr> errors(threads);
+
+                for(uint32_t i = 0; i < threads; i++) {
+                    const uint32_t first = header.numStrips * i / threads;
+                    const uint32_t last = header.numStrips * (i + 1) / threads;
+
+                    workers.emplace_back([&, i, first, last] {
+                        try {
+                            decodeStrips(header, start, offsets.data(), dataLen, first, last, output);
+                        }
+                        catch(...) {
+                            errors[i] = std::current_exception();
+                        }
+                    });
+                }
+
+                for(auto& worker : workers)
+                    worker.join();
+
+                for(auto& error : errors)
+                    if(error)
+                        std::rethrow_exception(error);
+            }
+
+            // Copy anything past the last row
+            const size_t rowsEnd = std::min<size_t>(header.length, static_cast<size_t>(header.rowStride) * header.height);
+            const size_t tail = header.length - rowsEnd;
+
+            if(tail > 0) {
+                if(offsets[header.numStrips] + tail > dataLen)
+                    throw IOException("Corrupt frame data");
+
+                std::memcpy(output + rowsEnd, start + offsets[header.numStrips], tail);
+            }
+        }
+    }
+}
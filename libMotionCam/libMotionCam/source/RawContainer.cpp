@@ -1,8 +1,13 @@
 #include "motioncam/RawContainer.h"
 #include "motioncam/Util.h"
 #include "motioncam/Exceptions.h"
+#include "motioncam/NativeMappedBuffer.h"
+#include "motioncam/BinaryContainer.h"
+#include "motioncam/RawCodec.h"
+#include "motioncam/FrameCompressor.h"
 #include "motioncam/Math.h"
 #include "motioncam/Measure.h"
+#include "motioncam/Logger.h"
 
 #include <zstd.h>
 #include <utility>
@@ -14,7 +19,12 @@ using json11::Json;
 
 namespace motioncam {
     static const char* METATDATA_FILENAME = "metadata";
+    static const char* INFO_FILENAME = "info";
+    static const char* PREVIEW_FILENAME = "preview.jpg";
+    static const char* PROXY_EXTENSION = ".proxy";
+    // Opt-in until decoding is fast enough that loading a frame doesn't cost more than reading it
     static const bool USE_COMPRESSION = false;
+    static const int DECODE_THREADS = 2;
     
     json11::Json::array RawContainer::toJsonArray(cv::Mat m) {
         assert(m.type() == CV_32F);
@@ -169,19 +179,26 @@ namespace motioncam {
     }
 
     RawContainer::RawContainer(const string& inputPath) :
-        mZipReader(new util::ZipReader(inputPath)),
         mReferenceTimestamp(-1),
         mIsHdr(false),
         mIsInMemory(false)
     {
-        initialise();
+        if(BinaryContainerReader::isBinaryContainer(inputPath)) {
+            mBinaryReader = std::make_unique<BinaryContainerReader>(inputPath);
+            initialiseBinary();
+        }
+        else {
+            mZipReader = std::make_unique<util::ZipReader>(inputPath);
+            initialise();
+        }
     }
 
     RawContainer::RawContainer(const RawCameraMetadata& cameraMetadata,
                                const PostProcessSettings& postProcessSettings,
                                const int64_t referenceTimestamp,
                                const bool isHdr,
-                               const std::vector<std::shared_ptr<RawImageBuffer>>& buffers) :
+                               const std::vector<std::shared_ptr<RawImageBuffer>>& buffers,
+                               const bool shareBuffers) :
         mCameraMetadata(cameraMetadata),
         mPostProcessSettings(postProcessSettings),
         mReferenceTimestamp(referenceTimestamp),
@@ -192,13 +209,19 @@ namespace motioncam {
             throw InvalidState("No buffers");
         }
 
-        // Clone buffers
         int filenameIdx = 0;
 
         for(const auto& buffer : buffers) {
             std::string filename = "frame" + std::to_string(filenameIdx) + ".raw";
 
-            mFrameBuffers[filename] = std::make_shared<RawImageBuffer>(*buffer);
+            if(shareBuffers) {
+                mFrameBuffers[filename] = buffer;
+                mSharedFrames.insert(filename);
+            }
+            else {
+                mFrameBuffers[filename] = std::make_shared<RawImageBuffer>(*buffer);
+            }
+            
             mFrames.push_back(filename);
             
             if(buffer->metadata.timestampNs == referenceTimestamp) {
@@ -214,10 +237,106 @@ namespace motioncam {
         }
     }
 
-    void RawContainer::save(const std::string& outputPath) {
-        Measure m("RawContainer::save()");
+    RawContainer::~RawContainer() {
+    }
+
+    RawContainerInfo RawContainer::readInfo(const std::string& inputPath) {
+        RawContainerInfo info;
+        
+        if(BinaryContainerReader::isBinaryContainer(inputPath)) {
+            BinaryContainerReader reader(inputPath, true);
+            
+            info.referenceTimestamp = reader.getReferenceTimestamp();
+            info.isHdr = reader.isHdr();
+            info.captureMode = reader.getPostProcessSettings().captureMode;
+            
+            for(auto& frame : reader.getFrames()) {
+                info.frames.push_back({
+                    frame->metadata.timestampNs,
+                    frame->metadata.exposureTime,
+                    frame->metadata.iso,
+                    frame->metadata.exposureCompensation,
+                    frame->metadata.rawType
+                });
+            }
+            
+            return info;
+        }
+        
+        // The info entry has the same layout as the metadata without the large fields. Older containers
+        // don't have it so fall back to the metadata.
+        util::ZipReader zip(inputPath);
+        
+        std::string jsonStr, err;
+        zip.read(zip.contains(INFO_FILENAME) ? INFO_FILENAME : METATDATA_FILENAME, jsonStr);
+        
+        json11::Json json = json11::Json::parse(jsonStr, err);
+        if(!err.empty()) {
+            throw IOException("Cannot parse metadata");
+        }
+        
+        info.referenceTimestamp = std::stol(getOptionalStringSetting(json, "referenceTimestamp", "0"));
+        info.isHdr = getOptionalSetting(json, "isHdr", false);
+        info.captureMode = getOptionalStringSetting(json["postProcessingSettings"], "captureMode", "");
+        
+        for(auto& frame : json["frames"].array_items()) {
+            info.frames.push_back({
+                std::stol(getRequiredSettingAsString(frame, "timestamp")),
+                static_cast<int64_t>(frame["exposureTime"].number_value()),
+                getOptionalSetting(frame, "iso", 0),
+                getOptionalSetting(frame, "exposureCompensation", 0),
+                getOptionalStringSetting(frame, "type", "ZSL") == "HDR" ? RawType::HDR : RawType::ZSL
+            });
+        }
+        
+        return info;
+    }
+
+    void RawContainer::convert(const std::string& inputPath, const std::string& outputPath, const ContainerFormat format) {
+        RawContainer container(inputPath);
+        
+        for(auto& frame : container.getFrames())
+            container.loadFrame(frame);
+        
+        container.save(outputPath, format);
+    }
+
+    void RawContainer::save(const std::string& outputPath, const ContainerFormat format, const int numThreads) {
+        if(format == ContainerFormat::BINARY)
+            saveBinary(outputPath, numThreads);
+        else
+            saveZip(outputPath, numThreads);
+    }
+
+    vector<std::shared_ptr<RawImageBuffer>> RawContainer::getFrameBuffers() const {
+        vector<std::shared_ptr<RawImageBuffer>> frames;
+        
+        for(auto& filename : mFrames) {
+            auto frameIt = mFrameBuffers.find(filename);
+            if(frameIt == mFrameBuffers.end()) {
+                throw InvalidState("Can't find buffer for " + filename);
+            }
+            
+            frames.push_back(frameIt->second);
+        }
+        
+        return frames;
+    }
+
+    void RawContainer::saveBinary(const std::string& outputPath, const int numThreads) {
+        Measure m("RawContainer::saveBinary()");
         
-        auto it = mFrames.begin();
+        RawContainerWriter writer(outputPath, numThreads);
+        
+        writer.begin(mCameraMetadata, mPostProcessSettings, mReferenceTimestamp, mIsHdr, getPreview(), getFrameProxies());
+        writer.appendFrames(getFrameBuffers());
+        writer.finish();
+    }
+
+    void RawContainer::saveZip(const std::string& outputPath, const int numThreads) {
+        Measure m("RawContainer::saveZip()");
+        
+        auto frames = getFrameBuffers();
         
         json11::Json::object metadataJson;
 
@@ -242,19 +361,21 @@ namespace motioncam {
         metadataJson["focalLengths"]        = mCameraMetadata.focalLengths;
         
         json11::Json::array rawImages;
+        json11::Json::array frameInfo;
         util::ZipWriter zip(outputPath);
         
         std::vector<uint8_t> tmpBuffer;
         
+        // Compress the frames in the background while they are being written
+        std::unique_ptr<FrameCompressor> compressor;
+        
+        if(USE_COMPRESSION)
+            compressor = std::make_unique<FrameCompressor>(frames, numThreads);
+        
         // Write frames first
-        while(it != mFrames.end()) {
-            auto filename = *it;
-            auto frameIt = mFrameBuffers.find(filename);
-            if(frameIt == mFrameBuffers.end()) {
-                throw InvalidState("Can't find buffer for " + filename);
-            }
-            
-            auto frame = frameIt->second;
+        for(size_t i = 0; i < frames.size(); i++) {
+            auto& filename = mFrames[i];
+            auto frame = frames[i];
             
             // If the metadata has been set, remove the frame
             json11::Json::object imageMetadata;
@@ -330,30 +451,58 @@ namespace motioncam {
                 imageMetadata["lensShadingMapHeight"] = 0;
             }
             
+            bool isCompressed = false;
+            
+            if(compressor)
+                compressor->next(frame, tmpBuffer, isCompressed);
+            
             // We'll compress the data
-            if(USE_COMPRESSION) {
+            if(isCompressed) {
                 imageMetadata["isCompressed"] = true;
                 
-                // Compress before writing to ZIP
-                auto dstBound = ZSTD_compressBound(frame->data->hostData().size());
-                tmpBuffer.resize(dstBound);
-                
-                auto writtenBytes =
-                    ZSTD_compress(&tmpBuffer[0], tmpBuffer.size(), &frame->data->hostData()[0], frame->data->hostData().size(), 1);
-                
-                zip.addFile(filename, tmpBuffer, writtenBytes);
+                zip.addFile(filename, tmpBuffer, tmpBuffer.size());
             }
             else {
                 imageMetadata["isCompressed"] = false;
                 
-                zip.addFile(filename, frame->data->hostData(), frame->data->len());
+                // Write straight from the buffer, avoids copying mapped or GPU buffers to the host first
+                zip.addFile(filename, frame->data->lock(false), frame->data->len());
+                frame->data->unlock();
             }
 
-            rawImages.push_back(imageMetadata);
+            auto proxy = getFrameProxy(filename);
+            if(proxy) {
+                imageMetadata["proxyWidth"]     = proxy->width;
+                imageMetadata["proxyHeight"]    = proxy->height;
+                
+                zip.addFile(filename + PROXY_EXTENSION, proxy->data, proxy->data.size());
+            }
 
-            ++it;
+            rawImages.push_back(imageMetadata);
+            
+            frameInfo.push_back(json11::Json::object {
+                { "timestamp",              imageMetadata["timestamp"] },
+                { "iso",                    imageMetadata["iso"] },
+                { "exposureCompensation",   imageMetadata["exposureCompensation"] },
+                { "exposureTime",           imageMetadata["exposureTime"] },
+                { "type",                   imageMetadata["type"] }
+            });
         }
         
+        // Write a summary that can be read quickly
+        json11::Json::object infoJson;
+        
+        infoJson["referenceTimestamp"]      = metadataJson["referenceTimestamp"];
+        infoJson["isHdr"]                   = metadataJson["isHdr"];
+        infoJson["postProcessingSettings"]  = json11::Json::object { { "captureMode", mPostProcessSettings.captureMode } };
+        infoJson["frames"]                  = frameInfo;
+        
+        zip.addFile(INFO_FILENAME, json11::Json(infoJson).dump());
+        
+        auto preview = getPreview();
+        if(!preview.empty())
+            zip.addFile(PREVIEW_FILENAME, preview, preview.size());
+        
         // Write the metadata
         metadataJson["frames"] = rawImages;
         
@@ -563,6 +712,12 @@ namespace motioncam {
 
             string filename = getRequiredSettingAsString(*it, "filename");
 
+            int proxyWidth = getOptionalSetting(*it, "proxyWidth", 0);
+            int proxyHeight = getOptionalSetting(*it, "proxyHeight", 0);
+
+            if(proxyWidth > 0 && proxyHeight > 0)
+                mZipProxySizes[filename] = cv::Size(proxyWidth, proxyHeight);
+
             // If this is the reference image, keep the name
             if(buffer->metadata.timestampNs == mReferenceTimestamp) {
                 mReferenceImage = filename;
@@ -579,6 +734,34 @@ namespace motioncam {
         }
     }
 
+    void RawContainer::initialiseBinary() {
+        mCameraMetadata = mBinaryReader->getCameraMetadata();
+        mPostProcessSettings = mBinaryReader->getPostProcessSettings();
+        mReferenceTimestamp = mBinaryReader->getReferenceTimestamp();
+        mIsHdr = mBinaryReader->isHdr();
+        
+        auto& frames = mBinaryReader->getFrames();
+        if(frames.empty()) {
+            throw IOException("No frames found in container");
+        }
+        
+        for(size_t i = 0; i < frames.size(); i++) {
+            string filename = "frame" + std::to_string(i) + ".raw";
+            
+            if(frames[i]->metadata.timestampNs == mReferenceTimestamp) {
+                mReferenceImage = filename;
+            }
+            
+            mFrames.push_back(filename);
+            mFrameBuffers.insert(make_pair(filename, frames[i]));
+            mBinaryFrames.insert(make_pair(filename, i));
+        }
+        
+        if(mReferenceImage.empty()) {
+            mReferenceImage = *mFrames.begin();
+        }
+    }
+
     const RawCameraMetadata& RawContainer::getCameraMetadata() const {
         return mCameraMetadata;
     }
@@ -604,6 +787,104 @@ namespace motioncam {
         return mFrames;
     }
 
+    std::unique_ptr<NativeBuffer> RawContainer::getStoredData(const std::string& frame) const {
+        // Frames are page aligned, map them directly
+        if(mBinaryReader) {
+            size_t index = mBinaryFrames.at(frame);
+            
+            return std::make_unique<NativeMappedBuffer>(
+                mBinaryReader->path(), mBinaryReader->getFrameOffset(index), mBinaryReader->getFrameLength(index));
+        }
+        
+        // Map frames stored without zip compression directly from the container
+        uint64_t offset = 0;
+        size_t length = 0;
+        
+        if(mZipReader->findStoredEntry(frame, offset, length))
+            return std::make_unique<NativeMappedBuffer>(mZipReader->path(), offset, length);
+        
+        std::vector<uint8_t> data;
+        mZipReader->read(frame, data);
+        
+        return std::make_unique<NativeHostBuffer>(std::move(data));
+    }
+
+    size_t RawContainer::getDecodedLength(const uint8_t* data, const size_t len, const bool isCompressed) {
+        if(!isCompressed)
+            return len;
+        
+        if(codec::isEncoded(data, len))
+            return codec::decodedLength(data, len);
+        
+        // Older containers were compressed with zstd
+        auto contentSize = ZSTD_getFrameContentSize(data, len);
+        if(contentSize == ZSTD_CONTENTSIZE_UNKNOWN || contentSize == ZSTD_CONTENTSIZE_ERROR)
+            throw IOException("Invalid compressed frame");
+        
+        return static_cast<size_t>(contentSize);
+    }
+
+    void RawContainer::decodeFrame(const uint8_t* data,
+                                   const size_t len,
+                                   const bool isCompressed,
+                                   uint8_t* output,
+                                   const size_t outputLen)
+    {
+        if(outputLen < getDecodedLength(data, len, isCompressed))
+            throw InvalidState("Output buffer too small");
+        
+        if(!isCompressed) {
+            util::fastCopy(output, data, len, DECODE_THREADS);
+        }
+        else if(codec::isEncoded(data, len)) {
+            codec::decode(data, len, output, outputLen, DECODE_THREADS);
+        }
+        else {
+            size_t result = ZSTD_decompress(output, outputLen, data, len);
+            if(ZSTD_isError(result))
+                throw IOException("Failed to decompress frame");
+        }
+    }
+
+    size_t RawContainer::getFrameDataLength(const std::string& frame) const {
+        auto buffer = getFrame(frame);
+        
+        if(buffer->data->len() > 0)
+            return buffer->data->len();
+        
+        auto stored = getStoredData(frame);
+        
+        size_t len = getDecodedLength(stored->lock(false), stored->len(), buffer->isCompressed);
+        stored->unlock();
+        
+        return len;
+    }
+
+    size_t RawContainer::loadFrame(const std::string& frame, NativeBuffer& output) const {
+        auto buffer = getFrame(frame);
+        
+        // Already loaded, copy it
+        auto stored = buffer->data->len() > 0 ? nullptr : getStoredData(frame);
+        auto& source = stored ? *stored : *buffer->data;
+        
+        const bool isCompressed = stored ? buffer->isCompressed : false;
+        const uint8_t* data = source.lock(false);
+        
+        size_t len = getDecodedLength(data, source.len(), isCompressed);
+
+        if(output.len() < len) {
+            source.unlock();
+            throw InvalidState("Output buffer too small");
+        }
+
+        decodeFrame(data, source.len(), isCompressed, output.lock(true), output.len());
+        
+        output.unlock();
+        source.unlock();
+        
+        return len;
+    }
+
     std::shared_ptr<RawImageBuffer> RawContainer::loadFrame(const std::string& frame) const {
         auto buffer = mFrameBuffers.find(frame);
         if(buffer == mFrameBuffers.end()) {
@@ -614,27 +895,24 @@ namespace motioncam {
         if(buffer->second->data->len() > 0)
             return buffer->second;
         
-        // Load the data into the buffer
-        std::vector<uint8_t> data;
-
-        mZipReader->read(frame, data);
+        auto stored = getStoredData(frame);
         
-        if(buffer->second->isCompressed) {
-            std::vector<uint8_t> tmp;
-            
-            size_t outputSize = ZSTD_getFrameContentSize(static_cast<void*>(&data[0]), data.size());
-            tmp.resize(outputSize);
-            
-            long readBytes =
-                ZSTD_decompress(static_cast<void*>(&tmp[0]), tmp.size(), &data[0], data.size());
-            
-            tmp.resize(readBytes);
-            
-            buffer->second->data->copyHostData(tmp);
-        }
-        else {
-            buffer->second->data->copyHostData(data);
+        if(!buffer->second->isCompressed) {
+            buffer->second->data = std::move(stored);
+            return buffer->second;
         }
+        
+        // Decode straight into the frame buffer
+        const uint8_t* data = stored->lock(false);
+        
+        auto output = std::make_unique<NativeHostBuffer>(getDecodedLength(data, stored->len(), true));
+        
+        decodeFrame(data, stored->len(), true, output->lock(true), output->len());
+        
+        output->unlock();
+        stored->unlock();
+        
+        buffer->second->data = std::move(output);
                 
         return buffer->second;
     }
@@ -648,6 +926,84 @@ namespace motioncam {
         return buffer->second;
     }
 
+    std::vector<uint8_t> RawContainer::getPreview() const {
+        std::vector<uint8_t> preview;
+        
+        if(!mPreview.empty())
+            preview = mPreview;
+        else if(mBinaryReader)
+            mBinaryReader->readPreview(preview);
+        else if(mZipReader && mZipReader->contains(PREVIEW_FILENAME))
+            mZipReader->read(PREVIEW_FILENAME, preview);
+        
+        return preview;
+    }
+
+    void RawContainer::setPreview(const std::vector<uint8_t>& preview) {
+        mPreview = preview;
+    }
+
+    std::shared_ptr<RawFrameProxy> RawContainer::getFrameProxy(const std::string& frame) const {
+        auto proxyIt = mFrameProxies.find(frame);
+        if(proxyIt != mFrameProxies.end())
+            return proxyIt->second;
+        
+        if(mBinaryReader) {
+            auto bufferIt = mFrameBuffers.find(frame);
+            if(bufferIt == mFrameBuffers.end())
+                return nullptr;
+            
+            return mBinaryReader->readFrameProxy(bufferIt->second->metadata.timestampNs);
+        }
+        
+        auto sizeIt = mZipProxySizes.find(frame);
+        if(!mZipReader || sizeIt == mZipProxySizes.end())
+            return nullptr;
+        
+        auto proxy = std::make_shared<RawFrameProxy>();
+        
+        mZipReader->read(frame + PROXY_EXTENSION, proxy->data);
+        
+        if(proxy->data.size() != static_cast<size_t>(sizeIt->second.area())) {
+            throw IOException("Invalid proxy for " + frame);
+        }
+        
+        proxy->timestampNs  = getFrame(frame)->metadata.timestampNs;
+        proxy->width        = sizeIt->second.width;
+        proxy->height       = sizeIt->second.height;
+        
+        return proxy;
+    }
+
+    void RawContainer::setFrameProxy(const std::string& frame, const std::shared_ptr<RawFrameProxy>& proxy) {
+        mFrameProxies[frame] = proxy;
+    }
+
+    void RawContainer::setPreviews(const std::vector<uint8_t>& preview, const std::vector<std::shared_ptr<RawFrameProxy>>& proxies) {
+        setPreview(preview);
+        
+        for(auto& proxy : proxies) {
+            for(auto& it : mFrameBuffers) {
+                if(it.second->metadata.timestampNs == proxy->timestampNs) {
+                    setFrameProxy(it.first, proxy);
+                    break;
+                }
+            }
+        }
+    }
+
+    vector<std::shared_ptr<RawFrameProxy>> RawContainer::getFrameProxies() const {
+        vector<std::shared_ptr<RawFrameProxy>> proxies;
+        
+        for(auto& filename : mFrames) {
+            auto proxy = getFrameProxy(filename);
+            if(proxy)
+                proxies.push_back(proxy);
+        }
+        
+        return proxies;
+    }
+
     void RawContainer::removeFrame(const std::string& frame) {
         auto it = std::find(mFrames.begin(), mFrames.end(), frame);
         if(it != mFrames.end()) {
@@ -657,5 +1013,100 @@ namespace motioncam {
         auto bufferIt = mFrameBuffers.find(frame);
         if(bufferIt != mFrameBuffers.end())
             mFrameBuffers.erase(bufferIt);
+        
+        mFrameProxies.erase(frame);
+        mSharedFrames.erase(frame);
+    }
+
+    bool RawContainer::copySharedFrame(const std::shared_ptr<RawImageBuffer>& copy) {
+        if(mSharedFrames.empty())
+            return false;
+        
+        auto it = mSharedFrames.begin();
+        auto& buffer = mFrameBuffers[*it];
+        
+        const size_t len = buffer->data->len();
+        if(len > copy->data->len())
+            return false;
+        
+        copy->metadata = buffer->metadata;
+        copy->pixelFormat = buffer->pixelFormat;
+        copy->width = buffer->width;
+        copy->height = buffer->height;
+        copy->rowStride = buffer->rowStride;
+        copy->isCompressed = buffer->isCompressed;
+        
+        util::fastCopy(copy->data->lock(true), buffer->data->lock(false), len);
+        
+        copy->data->unlock();
+        buffer->data->unlock();
+        
+        buffer = copy;
+        
+        mSharedFrames.erase(it);
+        
+        return true;
+    }
+
+    RawContainerWriter::RawContainerWriter(const std::string& outputPath, const int numThreads) :
+        mWriter(std::make_unique<BinaryContainerWriter>(outputPath)),
+        mNumThreads(numThreads)
+    {
+    }
+
+    RawContainerWriter::~RawContainerWriter() {
+    }
+
+    void RawContainerWriter::begin(const RawCameraMetadata& cameraMetadata,
+                                   const PostProcessSettings& postProcessSettings,
+                                   const int64_t referenceTimestamp,
+                                   const bool isHdr,
+                                   const std::vector<uint8_t>& preview,
+                                   const std::vector<std::shared_ptr<RawFrameProxy>>& proxies)
+    {
+        mWriter->begin(cameraMetadata, postProcessSettings, referenceTimestamp, isHdr, preview, proxies);
+    }
+
+    void RawContainerWriter::appendFrame(RawImageBuffer& frame) {
+        if(USE_COMPRESSION && FrameCompressor::compressFrame(frame, mTmpBuffer))
+            mWriter->appendFrame(frame, mTmpBuffer.data(), mTmpBuffer.size(), true);
+        else
+            mWriter->appendFrame(frame);
+    }
+
+    void RawContainerWriter::appendFrames(const vector<std::shared_ptr<RawImageBuffer>>& frames,
+                                          const std::function<void (const std::shared_ptr<RawImageBuffer>&)>& onFrameWritten)
+    {
+        if(!USE_COMPRESSION) {
+            for(auto& frame : frames) {
+                mWriter->appendFrame(*frame);
+                
+                if(onFrameWritten)
+                    onFrameWritten(frame);
+            }
+            
+            return;
+        }
+        
+        FrameCompressor compressor(frames, mNumThreads);
+        
+        std::shared_ptr<RawImageBuffer> frame;
+        bool isCompressed = false;
+        
+        while(compressor.next(frame, mTmpBuffer, isCompressed)) {
+            if(isCompressed)
+                mWriter->appendFrame(*frame, mTmpBuffer.data(), mTmpBuffer.size(), true);
+            else
+                mWriter->appendFrame(*frame);
+            
+            if(onFrameWritten)
+                onFrameWritten(frame);
+        }
+        
+        logger::log("Stalled compressing frames for " + std::to_string(compressor.stallTimeMs()) + " ms");
+    }
+
+    void RawContainerWriter::finish() {
+        mWriter->finish();
     }
 }
@@ -0,0 +1,253 @@
+#include "motioncam/RawContainerCatalog.h"
+#include "motioncam/Util.h"
+#include "motioncam/Exceptions.h"
+#include "motioncam/Logger.h"
+
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include <cstdio>
+#include <cstring>
+#include <set>
+
+namespace motioncam {
+    namespace {
+        const char INDEX_MAGIC[8] = { 'M', 'C', 'C', 'A', 'T', 'L', 'O', 'G' };
+        const uint32_t INDEX_VERSION = 1;
+
+#pragma pack(push, 1)
+        struct IndexFrame {
+            int64_t timestampNs;
+            int64_t exposureTime;
+            int32_t iso;
+            int32_t exposureCompensation;
+            int32_t rawType;
+        };
+#pragma pack(pop)
+
+        class IndexWriter {
+        public:
+            template<typename T>
+            void write(const T& value) {
+                auto* p = reinterpret_cast<const uint8_t*>(&value);
+                data.insert(data.end(), p, p + sizeof(T));
+            }
+
+            void write(const std::string& value) {
+                write(static_cast<uint32_t>(value.size()));
+                data.insert(data.end(), value.begin(), value.end());
+            }
+
+            std::vector<uint8_t> data;
+        };
+
+        class IndexReader {
+        public:
+            IndexReader(const std::vector<uint8_t>& data) : mData(data), mPos(0) {
+            }
+
+            template<typename T>
+            void read(T& value) {
+                if(mPos + sizeof(T) > mData.size())
+                    throw IOException("Truncated index");
+
+                std::memcpy(&value, mData.data() + mPos, sizeof(T));
+                mPos += sizeof(T);
+            }
+
+            void read(std::string& value) {
+                uint32_t len = 0;
+                read(len);
+
+                if(mPos + len > mData.size())
+                    throw IOException("Truncated index");
+
+                value.assign(reinterpret_cast<const char*>(mData.data() + mPos), len);
+                mPos += len;
+            }
+
+        private:
+            const std::vector<uint8_t>& mData;
+            size_t mPos;
+        };
+    }
+
+    RawContainerCatalog::RawContainerCatalog(const std::string& directory, const std::string& indexPath) :
+        mDirectory(directory),
+        mIndexPath(indexPath)
+    {
+        if(!load())
+            mEntries.clear();
+    }
+
+    bool RawContainerCatalog::load() {
+        std::vector<uint8_t> data;
+
+        try {
+            util::ReadFile(mIndexPath, data);
+
+            IndexReader reader(data);
+
+            char magic[sizeof(INDEX_MAGIC)];
+            uint32_t version = 0;
+            uint32_t numEntries = 0;
+
+            reader.read(magic);
+            reader.read(version);
+
+            if(std::memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0 || version != INDEX_VERSION)
+                return false;
+
+            reader.read(numEntries);
+
+            for(uint32_t i = 0; i < numEntries; i++) {
+                std::string filename;
+                Entry entry;
+                uint8_t isValid = 0;
+                uint8_t isHdr = 0;
+                uint32_t numFrames = 0;
+
+                reader.read(filename);
+                reader.read(entry.fileSize);
+                reader.read(entry.modifiedTime);
+                reader.read(isValid);
+                reader.read(entry.info.referenceTimestamp);
+                reader.read(isHdr);
+                reader.read(entry.info.captureMode);
+                reader.read(numFrames);
+
+                entry.isValid = isValid != 0;
+                entry.info.isHdr = isHdr != 0;
+
+                if(numFrames > data.size() / sizeof(IndexFrame))
+                    return false;
+
+                entry.info.frames.reserve(numFrames);
+
+                for(uint32_t j = 0; j < numFrames; j++) {
+                    IndexFrame frame;
+                    reader.read(frame);
+
+                    entry.info.frames.push_back({
+                        frame.timestampNs,
+                        frame.exposureTime,
+                        frame.iso,
+                        frame.exposureCompensation,
+                        static_cast<RawType>(frame.rawType)
+                    });
+                }
+
+                mEntries.emplace(std::move(filename), std::move(entry));
+            }
+        }
+        catch(IOException& e) {
+            return false;
+        }
+
+        return true;
+    }
+
+    void RawContainerCatalog::save() const {
+        IndexWriter writer;
+
+        writer.write(INDEX_MAGIC);
+        writer.write(INDEX_VERSION);
+        writer.write(static_cast<uint32_t>(mEntries.size()));
+
+        for(auto& it : mEntries) {
+            const Entry& entry = it.second;
+
+            writer.write(it.first);
+            writer.write(entry.fileSize);
+            writer.write(entry.modifiedTime);
+            writer.write(static_cast<uint8_t>(entry.isValid));
+            writer.write(entry.info.referenceTimestamp);
+            writer.write(static_cast<uint8_t>(entry.info.isHdr));
+            writer.write(entry.info.captureMode);
+            writer.write(static_cast<uint32_t>(entry.info.frames.size()));
+
+            for(auto& frame : entry.info.frames) {
+                IndexFrame indexFrame = {
+                    frame.timestampNs,
+                    frame.exposureTime,
+                    frame.iso,
+                    frame.exposureCompensation,
+                    static_cast<int32_t>(frame.rawType)
+                };
+
+                writer.write(indexFrame);
+            }
+        }
+
+        // Replace the index in one go so it's never left half written
+        std::string tmpPath = mIndexPath + ".tmp";
+
+        util::WriteFile(writer.data.data(), writer.data.size(), tmpPath);
+
+        if(std::rename(tmpPath.c_str(), mIndexPath.c_str()) != 0)
+            throw IOException("Cannot write " + mIndexPath);
+    }
+
+    size_t RawContainerCatalog::rescan() {
+        DIR* dir = opendir(mDirectory.c_str());
+        if(!dir) {
+            throw IOException("Can't open " + mDirectory);
+        }
+
+        std::set<std::string> found;
+        size_t numRead = 0;
+
+        struct dirent* dirEntry;
+
+        while((dirEntry = readdir(dir)) != nullptr) {
+            std::string filename(dirEntry->d_name);
+
+            if(filename.empty() || filename[0] == '.')
+                continue;
+
+            std::string path = mDirectory + "/" + filename;
+
+            struct stat fileStat;
+            if(stat(path.c_str(), &fileStat) != 0 || !S_ISREG(fileStat.st_mode) || path == mIndexPath)
+                continue;
+
+            found.insert(filename);
+
+            const uint64_t fileSize = static_cast<uint64_t>(fileStat.st_size);
+            const int64_t modifiedTime = static_cast<int64_t>(fileStat.st_mtime);
+
+            auto it = mEntries.find(filename);
+            if(it != mEntries.end() && it->second.fileSize == fileSize && it->second.modifiedTime == modifiedTime)
+                continue;
+
+            Entry entry;
+
+            entry.fileSize = fileSize;
+            entry.modifiedTime = modifiedTime;
+
+            // Files that aren't containers are kept too, so they're not opened again until they change
+            try {
+                entry.info = RawContainer::readInfo(path);
+                entry.isValid = true;
+            }
+            catch(std::exception& e) {
+                logger::log("Skipping " + path + ": " + e.what());
+            }
+
+            mEntries[filename] = std::move(entry);
+            ++numRead;
+        }
+
+        closedir(dir);
+
+        // Drop containers that have gone
+        for(auto it = mEntries.begin(); it != mEntries.end(); ) {
+            if(found.find(it->first) == found.end())
+                it = mEntries.erase(it);
+            else
+                ++it;
+        }
+
+        return numRead;
+    }
+}
@@ -1,12 +1,20 @@
 #include "motioncam/Util.h"
 #include "motioncam/Exceptions.h"
+#include "motioncam/AsyncFile.h"
 
 #include <fstream>
+#include <algorithm>
+#include <thread>
+#include <cstring>
 
 #ifdef ZSTD_AVAILABLE
     #include <zstd.h>
 #endif
 
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
 using std::string;
 using std::vector;
 using std::ios;
@@ -19,22 +27,47 @@ namespace motioncam {
         // Very basic zip writer
         //
             
-        ZipWriter::ZipWriter(const string& filename) : m_zip{ 0 }, m_commited(false) {
-            if(!mz_zip_writer_init_file(&m_zip, filename.c_str(), 0)) {
+        ZipWriter::ZipWriter(const string& filename) :
+            m_zip{ 0 },
+            m_file(std::make_unique<AsyncFile>(filename)),
+            m_commited(false)
+        {
+            m_zip.m_pWrite = &ZipWriter::write;
+            m_zip.m_pIO_opaque = this;
+            
+            if(!mz_zip_writer_init(&m_zip, 0)) {
                 throw IOException("Can't create " + filename);
             }
         }
     
+        size_t ZipWriter::write(void* opaque, mz_uint64 offset, const void* data, size_t len) {
+            auto* writer = static_cast<ZipWriter*>(opaque);
+            
+            // miniz reports the error
+            try {
+                writer->m_file->write(offset, data, len);
+            }
+            catch(std::exception& e) {
+                return 0;
+            }
+            
+            return len;
+        }
+    
         void ZipWriter::addFile(const std::string& filename, const std::string& data) {
             addFile(filename, vector<uint8_t>(data.begin(), data.end()), data.size());
         }
 
         void ZipWriter::addFile(const std::string& filename, const std::vector<uint8_t>& data, const size_t numBytes) {
+            addFile(filename, data.data(), numBytes);
+        }
+
+        void ZipWriter::addFile(const std::string& filename, const uint8_t* data, const size_t numBytes) {
             if(m_commited) {
                 throw IOException("Can't add " + filename + " because archive has been commited");
             }
             
-            if(!mz_zip_writer_add_mem(&m_zip, filename.c_str(), data.data(), numBytes, MZ_NO_COMPRESSION)) {
+            if(!mz_zip_writer_add_mem(&m_zip, filename.c_str(), data, numBytes, MZ_NO_COMPRESSION)) {
                 throw IOException("Can't add " + filename);
             }
         }
@@ -49,6 +82,8 @@ namespace motioncam {
             }
             
             m_commited = true;
+            
+            m_file->close();
         }
         
         ZipWriter::~ZipWriter() {
@@ -62,7 +97,7 @@ namespace motioncam {
         // Very basic zip reader
         //
         
-        ZipReader::ZipReader(const string& filename) : m_zip{ 0 } {
+        ZipReader::ZipReader(const string& filename) : m_zip{ 0 }, m_path(filename) {
             if(!mz_zip_reader_init_file(&m_zip, filename.c_str(), 0)) {
                 throw IOException("Can't read " + filename);
             }
@@ -92,13 +127,23 @@ namespace motioncam {
             output = std::string(tmp.begin(), tmp.end());
         }
     
-        void ZipReader::read(const string& filename, vector<uint8_t>& output) {
+        size_t ZipReader::indexOf(const string& filename) const {
             auto it = std::find(m_files.begin(), m_files.end(), filename);
             if(it == m_files.end()) {
                 throw IOException("Unable to find " + filename);
             }
             
-            size_t index = it - m_files.begin();
+            return it - m_files.begin();
+        }
+    
+        bool ZipReader::contains(const string& filename) const {
+            return std::find(m_files.begin(), m_files.end(), filename) != m_files.end();
+        }
+    
+        void ZipReader::read(const string& filename, vector<uint8_t>& output) {
+            std::lock_guard<std::mutex> lock(m_lock);
+            
+            size_t index = indexOf(filename);
             mz_zip_archive_file_stat stat;
             
             if (!mz_zip_reader_file_stat(&m_zip, static_cast<mz_uint>(index), &stat))
@@ -111,6 +156,42 @@ namespace motioncam {
                 throw IOException("Failed to load " + filename);
             }
         }
+
+        bool ZipReader::findStoredEntry(const string& filename, uint64_t& offset, size_t& length) {
+            // Local file header layout, see miniz_zip.c
+            const uint32_t LOCAL_DIR_HEADER_SIG = 0x04034b50;
+            const size_t LOCAL_DIR_HEADER_SIZE = 30;
+            const size_t LOCAL_DIR_FILENAME_LEN_OFS = 26;
+            const size_t LOCAL_DIR_EXTRA_LEN_OFS = 28;
+            
+            std::lock_guard<std::mutex> lock(m_lock);
+            
+            size_t index = indexOf(filename);
+            mz_zip_archive_file_stat stat;
+            
+            if (!mz_zip_reader_file_stat(&m_zip, static_cast<mz_uint>(index), &stat))
+                throw IOException("Failed to stat " + filename);
+            
+            // Only entries stored as-is can be used directly
+            if(stat.m_method != 0 || stat.m_comp_size != stat.m_uncomp_size || stat.m_is_encrypted)
+                return false;
+            
+            uint8_t header[LOCAL_DIR_HEADER_SIZE];
+            
+            if(m_zip.m_pRead(m_zip.m_pIO_opaque, stat.m_local_header_ofs, header, LOCAL_DIR_HEADER_SIZE) != LOCAL_DIR_HEADER_SIZE)
+                throw IOException("Failed to read header of " + filename);
+            
+            auto readU16 = [&](size_t ofs) { return static_cast<uint32_t>(header[ofs]) | (static_cast<uint32_t>(header[ofs + 1]) << 8); };
+            auto readU32 = [&](size_t ofs) { return readU16(ofs) | (readU16(ofs + 2) << 16); };
+            
+            if(readU32(0) != LOCAL_DIR_HEADER_SIG)
+                throw IOException("Invalid header for " + filename);
+            
+            offset = stat.m_local_header_ofs + LOCAL_DIR_HEADER_SIZE + readU16(LOCAL_DIR_FILENAME_LEN_OFS) + readU16(LOCAL_DIR_EXTRA_LEN_OFS);
+            length = static_cast<size_t>(stat.m_uncomp_size);
+            
+            return true;
+        }
     
         //
 
@@ -125,27 +206,46 @@ namespace motioncam {
             const size_t buffOutSize = ZSTD_DStreamOutSize();
 
             vector<uint8_t> buffIn(buffInSize);
-            vector<uint8_t> buffOut(buffOutSize);
 
             std::shared_ptr<ZSTD_DCtx> ctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
 
             size_t err = 0;
+            bool firstChunk = true;
             
             while(!file.eof() || !file.fail()) {
                 file.read(reinterpret_cast<char*>(buffIn.data()), buffInSize);
                 size_t readBytes = file.gcount();
                 
+                // Size the output up front if the frame has its size, so it doesn't keep growing
+                if(firstChunk) {
+                    auto contentSize = ZSTD_getFrameContentSize(buffIn.data(), readBytes);
+                    if(contentSize != ZSTD_CONTENTSIZE_UNKNOWN && contentSize != ZSTD_CONTENTSIZE_ERROR)
+                        output.reserve(output.size() + contentSize);
+                    
+                    firstChunk = false;
+                }
+                
                 ZSTD_inBuffer inputBuffer = { buffIn.data(), readBytes, 0 };
                 
                 while (inputBuffer.pos < inputBuffer.size) {
-                    ZSTD_outBuffer outputBuffer = { buffOut.data(), buffOut.size(), 0 };
+                    // Decompress straight into the output
+                    size_t pos = output.size();
+                    size_t available = output.capacity() - pos;
+                    
+                    if(available == 0)
+                        available = buffOutSize;
+                    
+                    output.resize(pos + available);
+                    
+                    ZSTD_outBuffer outputBuffer = { output.data() + pos, available, 0 };
 
                     err = ZSTD_decompressStream(ctx.get(), &outputBuffer, &inputBuffer);
+                    
+                    output.resize(pos + outputBuffer.pos);
+                    
                     if(ZSTD_isError(err)) {
                         throw IOException("Failed to decompress file " + inputPath + " error: " + ZSTD_getErrorName(err));
                     }
-                    
-                    output.insert(output.end(), buffOut.begin(), buffOut.end());
                 }
             }
 
@@ -154,7 +254,7 @@ namespace motioncam {
             }
         }
     
-        void WriteCompressedFile(const vector<uint8_t>& data, const string& outputPath) {
+        void WriteCompressedFile(const vector<uint8_t>& data, const string& outputPath, const int compressionLevel, const int numWorkers) {
             std::ofstream file(outputPath, std::ios::binary);
             
             // If we have a problem
@@ -170,9 +270,13 @@ namespace motioncam {
 
             vector<uint8_t> buffOut(buffOutSize);
             
-            ZSTD_CCtx_setParameter(ctx.get(), ZSTD_c_compressionLevel, 1);
+            ZSTD_CCtx_setParameter(ctx.get(), ZSTD_c_compressionLevel, compressionLevel);
             ZSTD_CCtx_setParameter(ctx.get(), ZSTD_c_checksumFlag, 1);
             
+            // Fails without threading support, in which case we compress on this thread
+            if(numWorkers > 0)
+                ZSTD_CCtx_setParameter(ctx.get(), ZSTD_c_nbWorkers, numWorkers);
+            
             size_t pos = 0;
             bool lastChunk = false;
             
@@ -286,5 +390,110 @@ namespace motioncam {
             basePath = path.substr(0, index);
             filename = path.substr(index + 1, path.size());
         }
+        
+        //
+        // Frame copies
+        //
+        
+        namespace {
+            // Smaller copies are likely to be read again soon so leave them in the cache
+            const size_t STREAMING_COPY_MIN_LENGTH = 256 * 1024;
+            
+            // Each thread copies at least this much
+            const size_t PARALLEL_COPY_MIN_LENGTH = 4 * 1024 * 1024;
+            const int MAX_COPY_THREADS = 4;
+            
+            const size_t PAGE_SIZE = 4096;
+            
+            void streamingCopy(uint8_t* dst, const uint8_t* src, size_t len) {
+#if defined(__SSE2__)
+                // Streaming stores need an aligned destination
+                const size_t head = std::min(len, (16 - (reinterpret_cast<uintptr_t>(dst) & 15)) & 15);
+                
+                std::memcpy(dst, src, head);
+                
+                dst += head;
+                src += head;
+                len -= head;
+                
+                const uint8_t* end = src + (len & ~size_t(63));
+                
+                while(src < end) {
+                    // Prefetching past the end is harmless
+                    _mm_prefetch(reinterpret_cast<const char*>(src + PAGE_SIZE), _MM_HINT_T0);
+                    
+                    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+                    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+                    __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+                    __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 48));
+                    
+                    _mm_stream_si128(reinterpret_cast<__m128i*>(dst),      a);
+                    _mm_stream_si128(reinterpret_cast<__m128i*>(dst + 16), b);
+                    _mm_stream_si128(reinterpret_cast<__m128i*>(dst + 32), c);
+                    _mm_stream_si128(reinterpret_cast<__m128i*>(dst + 48), d);
+                    
+                    src += 64;
+                    dst += 64;
+                }
+                
+                _mm_sfence();
+                
+                len &= 63;
+#elif defined(__aarch64__)
+                const uint8_t* end = src + (len & ~size_t(63));
+                
+                while(src < end) {
+                    __builtin_prefetch(src + PAGE_SIZE);
+                    
+                    // Non-temporal store pairs of NEON registers
+                    __asm__ volatile(
+                        "ldp q0, q1, [%[src]]\n"
+                        "ldp q2, q3, [%[src], #32]\n"
+                        "stnp q0, q1, [%[dst]]\n"
+                        "stnp q2, q3, [%[dst], #32]\n"
+                        :
+                        : [src] "r" (src), [dst] "r" (dst)
+                        : "v0", "v1", "v2", "v3", "memory");
+                    
+                    src += 64;
+                    dst += 64;
+                }
+                
+                len &= 63;
+#endif
+                std::memcpy(dst, src, len);
+            }
+        }
+        
+        void fastCopy(void* dst, const void* src, size_t len, int numThreads) {
+            auto* dstBytes = static_cast<uint8_t*>(dst);
+            auto* srcBytes = static_cast<const uint8_t*>(src);
+            
+            if(len < STREAMING_COPY_MIN_LENGTH) {
+                std::memcpy(dstBytes, srcBytes, len);
+                return;
+            }
+            
+            numThreads = std::max(1, std::min({ numThreads, MAX_COPY_THREADS, static_cast<int>(len / PARALLEL_COPY_MIN_LENGTH) }));
+            
+            if(numThreads == 1) {
+                streamingCopy(dstBytes, srcBytes, len);
+                return;
+            }
+            
+            // Split on page boundaries, the calling thread copies the first part
+            const size_t partLength = (len / numThreads + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+            
+            std::vector<std::thread> threads;
+            
+            for(size_t offset = partLength; offset < len; offset += partLength) {
+                threads.emplace_back(streamingCopy, dstBytes + offset, srcBytes + offset, std::min(partLength, len - offset));
+            }
+            
+            streamingCopy(dstBytes, srcBytes, std::min(partLength, len));
+            
+            for(auto& thread : threads)
+                thread.join();
+        }
     }
 }
@@ -1,4 +1,16 @@
 #include "ImageProcessor.h"
+#include "ImageProcessorSession.h"
+#include "RawBufferManager.h"
+#include "FrameCompressor.h"
+#include "RawCodec.h"
+#include "FrameStats.h"
+#include "Util.h"
+
+#include <chrono>
+#include <thread>
+#include <random>
+#include <cmath>
+#include <cstring>
 
 const std::string FILENAMES[] = {
 };
@@ -19,17 +31,264 @@ public:
     }
 };
 
+static double elapsedMs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static std::shared_ptr<motioncam::RawImageBuffer> createSyntheticFrame(int width, int height, std::mt19937& rng) {
+    auto frame = std::make_shared<motioncam::RawImageBuffer>(std::make_unique<motioncam::NativeHostBuffer>(width * height * 2));
+
+    frame->width = width;
+    frame->height = height;
+    frame->rowStride = width * 2;
+    frame->pixelFormat = motioncam::PixelFormat::RAW16;
+
+    // Smooth scene with a bayer pattern and some noise, 10 bit values
+    std::normal_distribution<float> noise(0, 4);
+    uint16_t* data = reinterpret_cast<uint16_t*>(frame->data->lock(true));
+
+    for(int y = 0; y < height; y++) {
+        for(int x = 0; x < width; x++) {
+            float v = 256 + 128*std::sin(x*0.004f)*std::cos(y*0.003f) + ((x & 1) ^ (y & 1))*64 + noise(rng);
+            data[y*width + x] = static_cast<uint16_t>(std::max(0.0f, std::min(1023.0f, v)));
+        }
+    }
+
+    frame->data->unlock();
+
+    return frame;
+}
+
+static void benchmarkCompaction() {
+    const int width = 4000;
+    const int height = 3000;
+    const int numBuffers = 8;
+    const int frameIntervalMs = 33;
+    const int numFrames = 150;
+
+    std::mt19937 rng(0);
+    auto source = createSyntheticFrame(width, height, rng);
+    const size_t frameLength = source->data->len();
+
+    // Codec on its own
+    std::vector<uint8_t> compressed;
+
+    auto start = std::chrono::steady_clock::now();
+    motioncam::FrameCompressor::compressFrame(*source, compressed);
+    double compressMs = elapsedMs(start);
+
+    std::vector<uint8_t> decompressed(frameLength);
+
+    start = std::chrono::steady_clock::now();
+    motioncam::codec::decode(compressed.data(), compressed.size(), decompressed.data(), decompressed.size());
+    double decompressMs = elapsedMs(start);
+
+    std::cout << "compression ratio " << frameLength / static_cast<double>(compressed.size())
+              << " compress " << frameLength / compressMs / 1000 << " MB/s"
+              << " decompress " << frameLength / decompressMs / 1000 << " MB/s" << std::endl;
+
+    // History kept in the same memory, with and without compaction
+    auto& bufferManager = motioncam::RawBufferManager::get();
+
+    for(int compact = 0; compact < 2; compact++) {
+        bufferManager.reset();
+
+        // Half the buffers are given to compressed frames when compacting
+        int n = compact ? numBuffers / 2 : numBuffers;
+
+        for(int i = 0; i < n; i++) {
+            auto buffer = std::make_shared<motioncam::RawImageBuffer>(*source);
+            bufferManager.addBuffer(buffer);
+        }
+
+        bufferManager.setCompaction(compact ? frameIntervalMs : 0, compact ? static_cast<int64_t>(frameLength) * (numBuffers - n) : 0);
+
+        for(int i = 0; i < numFrames; i++) {
+            auto buffer = bufferManager.dequeueUnusedBuffer();
+            if(!buffer)
+                continue;
+
+            buffer->width = width;
+            buffer->height = height;
+            buffer->rowStride = source->rowStride;
+            buffer->pixelFormat = source->pixelFormat;
+            buffer->metadata.timestampNs = static_cast<int64_t>(i) * frameIntervalMs * 1000 * 1000;
+            buffer->data->copyHostData(source->data->hostData());
+
+            bufferManager.enqueueReadyBuffer(buffer);
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(frameIntervalMs));
+        }
+
+        auto buffers = bufferManager.consumeAllBuffers()->getBuffers();
+        int64_t memoryUse = bufferManager.memoryUseBytes() + bufferManager.compressedBytes();
+
+        std::cout << (compact ? "compaction: " : "no compaction: ")
+                  << buffers.size() << " frames of history in " << memoryUse / (1024*1024) << " MB" << std::endl;
+    }
+
+    bufferManager.setCompaction(0, 0);
+    bufferManager.reset();
+}
+
+static void benchmarkCopy() {
+    // RAW10 and RAW16 12MP frames
+    const size_t sizes[] = { 4000 * 3000 * 10 / 8, 4000 * 3000 * 2 };
+    const int iterations = 20;
+
+    for(size_t size : sizes) {
+        std::vector<uint8_t> src(size, 1);
+        std::vector<uint8_t> dst(size, 0);
+
+        auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < iterations; i++)
+            std::memcpy(dst.data(), src.data(), size);
+
+        double memcpyMs = elapsedMs(start) / iterations;
+
+        std::cout << size / (1024*1024) << " MB memcpy " << memcpyMs << " ms";
+
+        for(int numThreads = 1; numThreads <= 4; numThreads *= 2) {
+            start = std::chrono::steady_clock::now();
+            for(int i = 0; i < iterations; i++)
+                motioncam::util::fastCopy(dst.data(), src.data(), size, numThreads);
+
+            std::cout << ", fastCopy x" << numThreads << " " << elapsedMs(start) / iterations << " ms";
+        }
+
+        std::cout << std::endl;
+    }
+}
+
+static void benchmarkFrameStats() {
+    const int width = 4000;
+    const int height = 3000;
+    const int iterations = 20;
+
+    std::mt19937 rng(0);
+    auto frame = createSyntheticFrame(width, height, rng);
+
+    motioncam::RawCameraMetadata cameraMetadata;
+    cameraMetadata.whiteLevel = 1023;
+    cameraMetadata.blackLevel = { 64, 64, 64, 64 };
+
+    auto colorTransform = std::make_shared<motioncam::FrameStatsColorTransform>();
+    const float identity[9] = { 1, 0, 0, 0, 1, 0, 0, 0, 1 };
+
+    std::copy(identity, identity + 9, colorTransform->cameraToSrgb);
+    std::fill(colorTransform->cameraWhite, colorTransform->cameraWhite + 3, 1.0f);
+
+    for(int c = 0; c < 4; c++)
+        colorTransform->lensShadingMap.push_back(cv::Mat(12, 16, CV_32F, cv::Scalar(1.0f)));
+
+    motioncam::FrameStats stats;
+
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < iterations; i++)
+        motioncam::FrameStatsAccumulator::measure(*frame, cameraMetadata, colorTransform, stats);
+
+    std::cout << "Frame stats " << elapsedMs(start) / iterations << " ms, sharpness " << stats.sharpness << std::endl;
+}
+
+// Encodes and decodes frames of each format, with and without padding at the end of rows, and checks
+// every byte comes back
+static bool testCodecRoundTrip() {
+    const motioncam::PixelFormat formats[] = {
+        motioncam::PixelFormat::RAW10, motioncam::PixelFormat::RAW12, motioncam::PixelFormat::RAW16 };
+
+    const int width = 1000;
+    const int height = 301;
+    const int paddings[] = { 0, 16, 7 };
+
+    std::mt19937 rng(0);
+    std::normal_distribution<float> noise(0, 4);
+    std::uniform_int_distribution<int> byte(0, 255);
+
+    bool passed = true;
+
+    for(auto pixelFormat : formats) {
+        const int maxValue = pixelFormat == motioncam::PixelFormat::RAW10 ? 1023 :
+                             pixelFormat == motioncam::PixelFormat::RAW12 ? 4095 : 65535;
+
+        const size_t rowLen = motioncam::codec::rowLength(pixelFormat, width);
+
+        for(int padding : paddings) {
+            const int rowStride = static_cast<int>(rowLen) + padding;
+
+            // A few bytes past the last row as well when the rows are padded
+            const size_t len = static_cast<size_t>(rowStride) * height + (padding > 0 ? 3 : 0);
+
+            std::vector<uint8_t> frame(len);
+            std::vector<uint16_t> row(width);
+
+            for(auto& b : frame)
+                b = static_cast<uint8_t>(byte(rng));
+
+            for(int y = 0; y < height; y++) {
+                for(int x = 0; x < width; x++) {
+                    float v = maxValue * (0.25f + 0.125f*std::sin(x*0.004f)*std::cos(y*0.003f)) + ((x & 1) ^ (y & 1))*64 + noise(rng);
+
+                    // Some clipped pixels
+                    if((x * 7 + y * 13) % 997 == 0)
+                        v = static_cast<float>(maxValue);
+
+                    row[x] = static_cast<uint16_t>(std::max(0.0f, std::min(static_cast<float>(maxValue), v)));
+                }
+
+                motioncam::codec::packRow(row.data(), pixelFormat, width, frame.data() + static_cast<size_t>(y) * rowStride);
+            }
+
+            std::vector<uint8_t> encoded;
+
+            if(!motioncam::codec::encode(frame.data(), frame.size(), pixelFormat, width, height, rowStride, encoded)) {
+                std::cout << "codec: failed to encode format " << static_cast<int>(pixelFormat) << " padding " << padding << std::endl;
+                passed = false;
+                continue;
+            }
+
+            for(int numThreads = 1; numThreads <= 4; numThreads *= 4) {
+                std::vector<uint8_t> decoded(motioncam::codec::decodedLength(encoded.data(), encoded.size()));
+
+                motioncam::codec::decode(encoded.data(), encoded.size(), decoded.data(), decoded.size(), numThreads);
+
+                if(decoded != frame) {
+                    std::cout << "codec: round trip mismatch format " << static_cast<int>(pixelFormat)
+                              << " padding " << padding << " threads " << numThreads << std::endl;
+                    passed = false;
+                }
+            }
+        }
+    }
+
+    std::cout << "codec round trip " << (passed ? "passed" : "FAILED") << std::endl;
+
+    return passed;
+}
+
 int main(int argc, const char * argv[]) {
+    if(argc > 1 && std::string(argv[1]) == "test") {
+        return testCodecRoundTrip() ? 0 : 1;
+    }
+    
+    if(argc > 1 && std::string(argv[1]) == "benchmark") {
+        benchmarkCopy();
+        benchmarkFrameStats();
+        benchmarkCompaction();
+        return 0;
+    }
+    
     auto inPath = "./";
     auto outPath = "./";
 
+    // Reuse buffers between images
+    motioncam::ImageProcessorSession session;
+
     for(auto filename : FILENAMES) {
         std::cout << "processing " << filename << std::endl;
 
         ProgressListener progressListener;
-        motioncam::ImageProcessor imageProcessor;
 
-        imageProcessor.process(inPath + filename, outPath + filename + ".jpg", progressListener);
+        session.process(inPath + filename, outPath + filename + ".jpg", progressListener);
     }
     
     return 0;